@@ -38,6 +38,327 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "ChESS.h"
+
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// The ChESS response at a single pixel. p points to the pixel in question
+static inline int16_t response_at(const uint8_t* p, int stride)
+{
+    uint8_t circular_sample[16];
+
+    circular_sample[2] = p[ - 2 - 5 * stride];
+    circular_sample[1] = p[ - 5 * stride];
+    circular_sample[0] = p[ + 2 - 5 * stride];
+    circular_sample[8] = p[ - 2 + 5 * stride];
+    circular_sample[9] = p[ + 5 * stride];
+    circular_sample[10] = p[ + 2 + 5 * stride];
+    circular_sample[3] = p[ - 4 - 4 * stride];
+    circular_sample[15] = p[ + 4 - 4 * stride];
+    circular_sample[7] = p[ - 4 + 4 * stride];
+    circular_sample[11] = p[ + 4 + 4 * stride];
+    circular_sample[4] = p[ - 5 - 2 * stride];
+    circular_sample[14] = p[ + 5 - 2 * stride];
+    circular_sample[6] = p[ - 5 + 2 * stride];
+    circular_sample[12] = p[ + 5 + 2 * stride];
+    circular_sample[5] = p[ - 5];
+    circular_sample[13] = p[ + 5];
+
+    // purely horizontal local_mean samples
+    uint16_t local_mean = (p[-1] + p[0] + p[1]) * 16 / 3;
+
+    uint16_t sum_response = 0;
+    uint16_t diff_response = 0;
+    uint16_t mean = 0;
+
+    int sub_idx;
+    for (sub_idx = 0; sub_idx < 4; ++sub_idx) {
+        uint8_t a = circular_sample[sub_idx];
+        uint8_t b = circular_sample[sub_idx + 4];
+        uint8_t c = circular_sample[sub_idx + 8];
+        uint8_t d = circular_sample[sub_idx + 12];
+
+        sum_response += abs(a - b + c - d);
+        diff_response += abs(a - c) + abs(b - d);
+        mean += a + b + c + d;
+    }
+
+    return sum_response - diff_response - abs(mean - local_mean);
+}
+
+// ORs the Nbits low bits of "bits" into the mask, starting at bit x
+static inline void set_mask_bits(uint64_t* mask_row, int x, uint64_t bits, int Nbits)
+{
+    const int shift = x & 63;
+    mask_row[x >> 6] |= bits << shift;
+    if (shift + Nbits > 64)
+        mask_row[(x >> 6) + 1] |= bits >> (64 - shift);
+}
+
+// If mask_row != NULL, I also clamp the responses to >= 0, and I set the mask
+// bits of all the pixels with (clamped) response > threshold. Otherwise I
+// output the raw response
+static void response_row_scalar(      int16_t* restrict response_row,
+                                     uint64_t* restrict mask_row,
+                                const uint8_t* restrict image_row,
+                                int x0, int x1, int stride,
+                                int16_t threshold)
+{
+    if (mask_row == NULL) {
+        for (int x = x0; x < x1; x++)
+            response_row[x] = response_at(&image_row[x], stride);
+        return;
+    }
+
+    for (int x = x0; x < x1; x++) {
+        int16_t r = response_at(&image_row[x], stride);
+        if (r < 0) r = 0;
+        if (r > threshold)
+            mask_row[x >> 6] |= (uint64_t)1 << (x & 63);
+        response_row[x] = r;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// The vectorized implementations compute exactly the same thing as
+// response_at(), but for many adjacent pixels at a time. All the intermediate
+// values fit into 16 bits:
+//
+//   sum_response, diff_response <= 4*510
+//   mean, local_mean            <= 4*1020
+//
+// so I widen each sample to int16 and do everything in 16-bit lanes. The only
+// non-trivial bit is the /3 in local_mean. I compute that as a multiply-high:
+// x/3 = (x*0xAAAB) >> 17 exactly for all 16-bit x
+
+__attribute__((target("sse4.1")))
+static inline __m128i response8_sse41(const uint8_t* p, int stride)
+{
+#define SAMPLE(dx,dy) _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)&p[(dx) + (dy)*stride]))
+    const __m128i s[16] =
+        { SAMPLE( 2,-5), SAMPLE( 0,-5), SAMPLE(-2,-5), SAMPLE(-4,-4),
+          SAMPLE(-5,-2), SAMPLE(-5, 0), SAMPLE(-5, 2), SAMPLE(-4, 4),
+          SAMPLE(-2, 5), SAMPLE( 0, 5), SAMPLE( 2, 5), SAMPLE( 4, 4),
+          SAMPLE( 5, 2), SAMPLE( 5, 0), SAMPLE( 5,-2), SAMPLE( 4,-4) };
+    __m128i local_mean = _mm_add_epi16(_mm_add_epi16(SAMPLE(-1,0), SAMPLE(0,0)), SAMPLE(1,0));
+#undef SAMPLE
+    local_mean = _mm_srli_epi16(_mm_mulhi_epu16(_mm_slli_epi16(local_mean, 4),
+                                                _mm_set1_epi16((short)0xAAAB)),
+                                1);
+
+    __m128i sum_response  = _mm_setzero_si128();
+    __m128i diff_response = _mm_setzero_si128();
+    __m128i mean          = _mm_setzero_si128();
+    for (int sub_idx = 0; sub_idx < 4; ++sub_idx) {
+        __m128i a = s[sub_idx];
+        __m128i b = s[sub_idx + 4];
+        __m128i c = s[sub_idx + 8];
+        __m128i d = s[sub_idx + 12];
+
+        sum_response  = _mm_add_epi16(sum_response,
+                                      _mm_abs_epi16(_mm_sub_epi16(_mm_add_epi16(a,c),
+                                                                  _mm_add_epi16(b,d))));
+        diff_response = _mm_add_epi16(diff_response,
+                                      _mm_add_epi16(_mm_abs_epi16(_mm_sub_epi16(a,c)),
+                                                    _mm_abs_epi16(_mm_sub_epi16(b,d))));
+        mean          = _mm_add_epi16(mean,
+                                      _mm_add_epi16(_mm_add_epi16(a,b),
+                                                    _mm_add_epi16(c,d)));
+    }
+
+    return _mm_sub_epi16(_mm_sub_epi16(sum_response, diff_response),
+                         _mm_abs_epi16(_mm_sub_epi16(mean, local_mean)));
+}
+
+__attribute__((target("sse4.1")))
+static void response_row_sse41(      int16_t* restrict response_row,
+                                    uint64_t* restrict mask_row,
+                               const uint8_t* restrict image_row,
+                               int x0, int x1, int stride,
+                               int16_t threshold)
+{
+    int x;
+    if (mask_row == NULL) {
+        for (x = x0; x + 16 <= x1; x += 16) {
+            _mm_storeu_si128((__m128i*)&response_row[x    ], response8_sse41(&image_row[x    ], stride));
+            _mm_storeu_si128((__m128i*)&response_row[x + 8], response8_sse41(&image_row[x + 8], stride));
+        }
+    } else {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i th   = _mm_set1_epi16(threshold);
+        for (x = x0; x + 16 <= x1; x += 16) {
+            __m128i r0 = _mm_max_epi16(response8_sse41(&image_row[x    ], stride), zero);
+            __m128i r1 = _mm_max_epi16(response8_sse41(&image_row[x + 8], stride), zero);
+            _mm_storeu_si128((__m128i*)&response_row[x    ], r0);
+            _mm_storeu_si128((__m128i*)&response_row[x + 8], r1);
+
+            // Each 16-bit comparison result is 0 or -1. packs() turns these
+            // into 8-bit values without changing them, and the movemask then
+            // gives me one bit per pixel
+            uint32_t bits =
+                (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpgt_epi16(r0, th),
+                                                            _mm_cmpgt_epi16(r1, th)));
+            if (bits)
+                set_mask_bits(mask_row, x, bits, 16);
+        }
+    }
+    response_row_scalar(response_row, mask_row, image_row, x, x1, stride, threshold);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i response16_avx2(const uint8_t* p, int stride)
+{
+#define SAMPLE(dx,dy) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&p[(dx) + (dy)*stride]))
+    const __m256i s[16] =
+        { SAMPLE( 2,-5), SAMPLE( 0,-5), SAMPLE(-2,-5), SAMPLE(-4,-4),
+          SAMPLE(-5,-2), SAMPLE(-5, 0), SAMPLE(-5, 2), SAMPLE(-4, 4),
+          SAMPLE(-2, 5), SAMPLE( 0, 5), SAMPLE( 2, 5), SAMPLE( 4, 4),
+          SAMPLE( 5, 2), SAMPLE( 5, 0), SAMPLE( 5,-2), SAMPLE( 4,-4) };
+    __m256i local_mean = _mm256_add_epi16(_mm256_add_epi16(SAMPLE(-1,0), SAMPLE(0,0)), SAMPLE(1,0));
+#undef SAMPLE
+    local_mean = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(local_mean, 4),
+                                                      _mm256_set1_epi16((short)0xAAAB)),
+                                   1);
+
+    __m256i sum_response  = _mm256_setzero_si256();
+    __m256i diff_response = _mm256_setzero_si256();
+    __m256i mean          = _mm256_setzero_si256();
+    for (int sub_idx = 0; sub_idx < 4; ++sub_idx) {
+        __m256i a = s[sub_idx];
+        __m256i b = s[sub_idx + 4];
+        __m256i c = s[sub_idx + 8];
+        __m256i d = s[sub_idx + 12];
+
+        sum_response  = _mm256_add_epi16(sum_response,
+                                         _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a,c),
+                                                                           _mm256_add_epi16(b,d))));
+        diff_response = _mm256_add_epi16(diff_response,
+                                         _mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(a,c)),
+                                                          _mm256_abs_epi16(_mm256_sub_epi16(b,d))));
+        mean          = _mm256_add_epi16(mean,
+                                         _mm256_add_epi16(_mm256_add_epi16(a,b),
+                                                          _mm256_add_epi16(c,d)));
+    }
+
+    return _mm256_sub_epi16(_mm256_sub_epi16(sum_response, diff_response),
+                            _mm256_abs_epi16(_mm256_sub_epi16(mean, local_mean)));
+}
+
+__attribute__((target("avx2")))
+static void response_row_avx2(      int16_t* restrict response_row,
+                                   uint64_t* restrict mask_row,
+                              const uint8_t* restrict image_row,
+                              int x0, int x1, int stride,
+                              int16_t threshold)
+{
+    int x;
+    if (mask_row == NULL) {
+        for (x = x0; x + 32 <= x1; x += 32) {
+            _mm256_storeu_si256((__m256i*)&response_row[x     ], response16_avx2(&image_row[x     ], stride));
+            _mm256_storeu_si256((__m256i*)&response_row[x + 16], response16_avx2(&image_row[x + 16], stride));
+        }
+    } else {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i th   = _mm256_set1_epi16(threshold);
+        for (x = x0; x + 32 <= x1; x += 32) {
+            __m256i r0 = _mm256_max_epi16(response16_avx2(&image_row[x     ], stride), zero);
+            __m256i r1 = _mm256_max_epi16(response16_avx2(&image_row[x + 16], stride), zero);
+            _mm256_storeu_si256((__m256i*)&response_row[x     ], r0);
+            _mm256_storeu_si256((__m256i*)&response_row[x + 16], r1);
+
+            // Same as in the sse4.1 flavor, but packs() works within each
+            // 128-bit lane, so I need to permute the 64-bit chunks back into
+            // pixel order
+            __m256i packed = _mm256_packs_epi16(_mm256_cmpgt_epi16(r0, th),
+                                                _mm256_cmpgt_epi16(r1, th));
+            uint32_t bits =
+                (uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3,1,2,0)));
+            if (bits)
+                set_mask_bits(mask_row, x, bits, 32);
+        }
+    }
+    response_row_scalar(response_row, mask_row, image_row, x, x1, stride, threshold);
+}
+
+#endif
+
+typedef void (response_row_function_t)(      int16_t* restrict response_row,
+                                            uint64_t* restrict mask_row,
+                                       const uint8_t* restrict image_row,
+                                       int x0, int x1, int stride,
+                                       int16_t threshold);
+
+static void response_with(response_row_function_t* response_row,
+                                int16_t* restrict response,
+                               uint64_t* restrict mask,
+                          const uint8_t* restrict image,
+                          int w, int h, int stride,
+                          int16_t threshold)
+{
+    const int Nwords = MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w);
+
+    // funny bounds due to sampling ring radius (5) and border of previously applied blur (2)
+    for (int y = 7; y < h - 7; y++) {
+        uint64_t* mask_row = NULL;
+        if (mask != NULL) {
+            mask_row = &mask[y * Nwords];
+            memset(mask_row, 0, Nwords * sizeof(mask_row[0]));
+        }
+        response_row(&response[y * w], mask_row, &image[y * stride], 7, w - 7, stride, threshold);
+    }
+}
+
+// These are the specific implementations. Each one produces bit-identical
+// output. mrgingham_ChESS_response_5() picks the fastest one this CPU can run.
+// The SIMD flavors may ONLY be called if the CPU supports the corresponding
+// instructions. On non-x86 machines they're all the scalar implementation
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_scalar(      int16_t* restrict response,
+                                       const uint8_t* restrict image,
+                                       int w, int h, int stride )
+{
+    response_with(&response_row_scalar, response, NULL, image, w, h, stride, 0);
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_sse41(      int16_t* restrict response,
+                                      const uint8_t* restrict image,
+                                      int w, int h, int stride )
+{
+#ifdef HAVE_X86_SIMD
+    response_with(&response_row_sse41, response, NULL, image, w, h, stride, 0);
+#else
+    response_with(&response_row_scalar, response, NULL, image, w, h, stride, 0);
+#endif
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_avx2(      int16_t* restrict response,
+                                     const uint8_t* restrict image,
+                                     int w, int h, int stride )
+{
+#ifdef HAVE_X86_SIMD
+    response_with(&response_row_avx2, response, NULL, image, w, h, stride, 0);
+#else
+    response_with(&response_row_scalar, response, NULL, image, w, h, stride, 0);
+#endif
+}
+
+static response_row_function_t* best_response_row_function(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))   return &response_row_avx2;
+    if(__builtin_cpu_supports("sse4.1")) return &response_row_sse41;
+#endif
+    return &response_row_scalar;
+}
 
 /**
  * Perform the ChESS corner detection algorithm with a 5 px sampling radius
@@ -57,50 +378,306 @@ void mrgingham_ChESS_response_5(      int16_t* restrict response,
                                 const uint8_t* restrict image,
                                 int w, int h, int stride )
 {
-    int x, y;
-    // funny bounds due to sampling ring radius (5) and border of previously applied blur (2)
-    for (y = 7; y < h - 7; y++)
-        for (x = 7; x < w - 7; x++) {
-            const unsigned offset_input    = x + y * stride;
-            const unsigned offset_response = x + y * w;
-            uint8_t circular_sample[16];
-
-            circular_sample[2] = image[offset_input - 2 - 5 * stride];
-            circular_sample[1] = image[offset_input - 5 * stride];
-            circular_sample[0] = image[offset_input + 2 - 5 * stride];
-            circular_sample[8] = image[offset_input - 2 + 5 * stride];
-            circular_sample[9] = image[offset_input + 5 * stride];
-            circular_sample[10] = image[offset_input + 2 + 5 * stride];
-            circular_sample[3] = image[offset_input - 4 - 4 * stride];
-            circular_sample[15] = image[offset_input + 4 - 4 * stride];
-            circular_sample[7] = image[offset_input - 4 + 4 * stride];
-            circular_sample[11] = image[offset_input + 4 + 4 * stride];
-            circular_sample[4] = image[offset_input - 5 - 2 * stride];
-            circular_sample[14] = image[offset_input + 5 - 2 * stride];
-            circular_sample[6] = image[offset_input - 5 + 2 * stride];
-            circular_sample[12] = image[offset_input + 5 + 2 * stride];
-            circular_sample[5] = image[offset_input - 5];
-            circular_sample[13] = image[offset_input + 5];
-
-            // purely horizontal local_mean samples
-            uint16_t local_mean = (image[offset_input - 1] + image[offset_input] + image[offset_input + 1]) * 16 / 3;
-
-            uint16_t sum_response = 0;
-            uint16_t diff_response = 0;
-            uint16_t mean = 0;
-
-            int sub_idx;
-            for (sub_idx = 0; sub_idx < 4; ++sub_idx) {
-                uint8_t a = circular_sample[sub_idx];
-                uint8_t b = circular_sample[sub_idx + 4];
-                uint8_t c = circular_sample[sub_idx + 8];
-                uint8_t d = circular_sample[sub_idx + 12];
-
-                sum_response += abs(a - b + c - d);
-                diff_response += abs(a - c) + abs(b - d);
-                mean += a + b + c + d;
-            }
-
-            response[offset_response] = sum_response - diff_response - abs(mean - local_mean);
+    response_with(best_response_row_function(), response, NULL, image, w, h, stride, 0);
+}
+
+// The fused flavors: these compute the response, clamp it to >= 0, and build
+// the candidate mask, all in the same pass. See ChESS.h for details
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_clamp_mask_scalar(      int16_t* restrict response,
+                                                       uint64_t* restrict mask,
+                                                  const uint8_t* restrict image,
+                                                  int w, int h, int stride,
+                                                  int16_t threshold )
+{
+    response_with(&response_row_scalar, response, mask, image, w, h, stride, threshold);
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_clamp_mask_sse41(      int16_t* restrict response,
+                                                      uint64_t* restrict mask,
+                                                 const uint8_t* restrict image,
+                                                 int w, int h, int stride,
+                                                 int16_t threshold )
+{
+#ifdef HAVE_X86_SIMD
+    response_with(&response_row_sse41, response, mask, image, w, h, stride, threshold);
+#else
+    response_with(&response_row_scalar, response, mask, image, w, h, stride, threshold);
+#endif
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_clamp_mask_avx2(      int16_t* restrict response,
+                                                     uint64_t* restrict mask,
+                                                const uint8_t* restrict image,
+                                                int w, int h, int stride,
+                                                int16_t threshold )
+{
+#ifdef HAVE_X86_SIMD
+    response_with(&response_row_avx2, response, mask, image, w, h, stride, threshold);
+#else
+    response_with(&response_row_scalar, response, mask, image, w, h, stride, threshold);
+#endif
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_clamp_mask(      int16_t* restrict response,
+                                                uint64_t* restrict mask,
+                                           const uint8_t* restrict image,
+                                           int w, int h, int stride,
+                                           int16_t threshold )
+{
+    response_with(best_response_row_function(), response, mask, image, w, h, stride, threshold);
+}
+
+
+
+
+// The 16-bit flavors. These are for images with more than 8 bits per pixel,
+// stored in uint16_t containers. The response is computed with 32-bit
+// intermediates, and then scaled back down by shift bits, saturating to the
+// int16_t range. With shift = bit_depth-8 the response is thus in the same
+// units as the 8-bit response, so the same thresholds apply, but the low bits
+// of the input still contribute to it. The image stride is in pixels, not bytes
+static inline int16_t response_at_u16(const uint16_t* p, int stride, int shift)
+{
+    int32_t circular_sample[16];
+
+    circular_sample[2] = p[ - 2 - 5 * stride];
+    circular_sample[1] = p[ - 5 * stride];
+    circular_sample[0] = p[ + 2 - 5 * stride];
+    circular_sample[8] = p[ - 2 + 5 * stride];
+    circular_sample[9] = p[ + 5 * stride];
+    circular_sample[10] = p[ + 2 + 5 * stride];
+    circular_sample[3] = p[ - 4 - 4 * stride];
+    circular_sample[15] = p[ + 4 - 4 * stride];
+    circular_sample[7] = p[ - 4 + 4 * stride];
+    circular_sample[11] = p[ + 4 + 4 * stride];
+    circular_sample[4] = p[ - 5 - 2 * stride];
+    circular_sample[14] = p[ + 5 - 2 * stride];
+    circular_sample[6] = p[ - 5 + 2 * stride];
+    circular_sample[12] = p[ + 5 + 2 * stride];
+    circular_sample[5] = p[ - 5];
+    circular_sample[13] = p[ + 5];
+
+    // purely horizontal local_mean samples
+    int32_t local_mean = (p[-1] + p[0] + p[1]) * 16 / 3;
+
+    int32_t sum_response = 0;
+    int32_t diff_response = 0;
+    int32_t mean = 0;
+
+    int sub_idx;
+    for (sub_idx = 0; sub_idx < 4; ++sub_idx) {
+        int32_t a = circular_sample[sub_idx];
+        int32_t b = circular_sample[sub_idx + 4];
+        int32_t c = circular_sample[sub_idx + 8];
+        int32_t d = circular_sample[sub_idx + 12];
+
+        sum_response += abs(a - b + c - d);
+        diff_response += abs(a - c) + abs(b - d);
+        mean += a + b + c + d;
+    }
+
+    int32_t response = (sum_response - diff_response - abs(mean - local_mean)) >> shift;
+    if (response >  INT16_MAX) return INT16_MAX;
+    if (response <  INT16_MIN) return INT16_MIN;
+    return (int16_t)response;
+}
+
+static void response_row_u16_scalar(      int16_t*  restrict response_row,
+                                         uint64_t* restrict mask_row,
+                                    const uint16_t* restrict image_row,
+                                    int x0, int x1, int stride, int shift,
+                                    int16_t threshold)
+{
+    if (mask_row == NULL) {
+        for (int x = x0; x < x1; x++)
+            response_row[x] = response_at_u16(&image_row[x], stride, shift);
+        return;
+    }
+
+    for (int x = x0; x < x1; x++) {
+        int16_t r = response_at_u16(&image_row[x], stride, shift);
+        if (r < 0) r = 0;
+        if (r > threshold)
+            mask_row[x >> 6] |= (uint64_t)1 << (x & 63);
+        response_row[x] = r;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// The 16-bit samples don't fit the 8-bit flavor's 16-bit intermediates, so
+// here I use 32-bit lanes. The /3 is done in floating point: x*16 < 2**24 so
+// it's exact as a float, and truncating the correctly-rounded quotient gives
+// exactly floor(x*16/3)
+__attribute__((target("avx2")))
+static inline __m256i response8_u16_avx2(const uint16_t* p, int stride, __m128i shift)
+{
+#define SAMPLE(dx,dy) _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&p[(dx) + (dy)*stride]))
+    const __m256i s[16] =
+        { SAMPLE( 2,-5), SAMPLE( 0,-5), SAMPLE(-2,-5), SAMPLE(-4,-4),
+          SAMPLE(-5,-2), SAMPLE(-5, 0), SAMPLE(-5, 2), SAMPLE(-4, 4),
+          SAMPLE(-2, 5), SAMPLE( 0, 5), SAMPLE( 2, 5), SAMPLE( 4, 4),
+          SAMPLE( 5, 2), SAMPLE( 5, 0), SAMPLE( 5,-2), SAMPLE( 4,-4) };
+    __m256i local_mean = _mm256_add_epi32(_mm256_add_epi32(SAMPLE(-1,0), SAMPLE(0,0)), SAMPLE(1,0));
+#undef SAMPLE
+    local_mean = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(_mm256_slli_epi32(local_mean, 4)),
+                                                   _mm256_set1_ps(3.0f)));
+
+    __m256i sum_response  = _mm256_setzero_si256();
+    __m256i diff_response = _mm256_setzero_si256();
+    __m256i mean          = _mm256_setzero_si256();
+    for (int sub_idx = 0; sub_idx < 4; ++sub_idx) {
+        __m256i a = s[sub_idx];
+        __m256i b = s[sub_idx + 4];
+        __m256i c = s[sub_idx + 8];
+        __m256i d = s[sub_idx + 12];
+
+        sum_response  = _mm256_add_epi32(sum_response,
+                                         _mm256_abs_epi32(_mm256_sub_epi32(_mm256_add_epi32(a,c),
+                                                                           _mm256_add_epi32(b,d))));
+        diff_response = _mm256_add_epi32(diff_response,
+                                         _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(a,c)),
+                                                          _mm256_abs_epi32(_mm256_sub_epi32(b,d))));
+        mean          = _mm256_add_epi32(mean,
+                                         _mm256_add_epi32(_mm256_add_epi32(a,b),
+                                                          _mm256_add_epi32(c,d)));
+    }
+
+    return _mm256_sra_epi32(_mm256_sub_epi32(_mm256_sub_epi32(sum_response, diff_response),
+                                             _mm256_abs_epi32(_mm256_sub_epi32(mean, local_mean))),
+                            shift);
+}
+
+__attribute__((target("avx2")))
+static void response_row_u16_avx2(      int16_t*  restrict response_row,
+                                       uint64_t* restrict mask_row,
+                                  const uint16_t* restrict image_row,
+                                  int x0, int x1, int stride, int shift,
+                                  int16_t threshold)
+{
+    const __m128i shiftv = _mm_cvtsi32_si128(shift);
+    const __m256i zero   = _mm256_setzero_si256();
+    const __m256i th     = _mm256_set1_epi16(threshold);
+
+    int x;
+    for (x = x0; x + 16 <= x1; x += 16) {
+        // packs() saturates to int16, but it works within each 128-bit lane,
+        // so I permute the 64-bit chunks back into pixel order
+        __m256i r =
+            _mm256_permute4x64_epi64(_mm256_packs_epi32(response8_u16_avx2(&image_row[x    ], stride, shiftv),
+                                                        response8_u16_avx2(&image_row[x + 8], stride, shiftv)),
+                                     _MM_SHUFFLE(3,1,2,0));
+        if (mask_row != NULL) {
+            r = _mm256_max_epi16(r, zero);
+            __m256i packed = _mm256_packs_epi16(_mm256_cmpgt_epi16(r, th), zero);
+            uint32_t bits =
+                (uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3,1,2,0))) & 0xFFFF;
+            if (bits)
+                set_mask_bits(mask_row, x, bits, 16);
+        }
+        _mm256_storeu_si256((__m256i*)&response_row[x], r);
+    }
+    response_row_u16_scalar(response_row, mask_row, image_row, x, x1, stride, shift, threshold);
+}
+
+#endif
+
+typedef void (response_row_u16_function_t)(      int16_t*  restrict response_row,
+                                                uint64_t* restrict mask_row,
+                                           const uint16_t* restrict image_row,
+                                           int x0, int x1, int stride, int shift,
+                                           int16_t threshold);
+
+static void response_with_u16(response_row_u16_function_t* response_row,
+                                    int16_t*  restrict response,
+                                   uint64_t* restrict mask,
+                              const uint16_t* restrict image,
+                              int w, int h, int stride, int shift,
+                              int16_t threshold)
+{
+    const int Nwords = MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w);
+
+    for (int y = 7; y < h - 7; y++) {
+        uint64_t* mask_row = NULL;
+        if (mask != NULL) {
+            mask_row = &mask[y * Nwords];
+            memset(mask_row, 0, Nwords * sizeof(mask_row[0]));
         }
+        response_row(&response[y * w], mask_row, &image[y * stride], 7, w - 7, stride, shift, threshold);
+    }
+}
+
+static response_row_u16_function_t* best_response_row_u16_function(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))   return &response_row_u16_avx2;
+#endif
+    return &response_row_u16_scalar;
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_u16_scalar(      int16_t*  restrict response,
+                                           const uint16_t* restrict image,
+                                           int w, int h, int stride, int shift )
+{
+    response_with_u16(&response_row_u16_scalar, response, NULL, image, w, h, stride, shift, 0);
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_u16_avx2(      int16_t*  restrict response,
+                                         const uint16_t* restrict image,
+                                         int w, int h, int stride, int shift )
+{
+#ifdef HAVE_X86_SIMD
+    response_with_u16(&response_row_u16_avx2, response, NULL, image, w, h, stride, shift, 0);
+#else
+    response_with_u16(&response_row_u16_scalar, response, NULL, image, w, h, stride, shift, 0);
+#endif
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_u16(      int16_t*  restrict response,
+                                    const uint16_t* restrict image,
+                                    int w, int h, int stride, int shift )
+{
+    response_with_u16(best_response_row_u16_function(), response, NULL, image, w, h, stride, shift, 0);
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_u16_clamp_mask_scalar(      int16_t*  restrict response,
+                                                           uint64_t* restrict mask,
+                                                      const uint16_t* restrict image,
+                                                      int w, int h, int stride, int shift,
+                                                      int16_t threshold )
+{
+    response_with_u16(&response_row_u16_scalar, response, mask, image, w, h, stride, shift, threshold);
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_u16_clamp_mask_avx2(      int16_t*  restrict response,
+                                                         uint64_t* restrict mask,
+                                                    const uint16_t* restrict image,
+                                                    int w, int h, int stride, int shift,
+                                                    int16_t threshold )
+{
+#ifdef HAVE_X86_SIMD
+    response_with_u16(&response_row_u16_avx2, response, mask, image, w, h, stride, shift, threshold);
+#else
+    response_with_u16(&response_row_u16_scalar, response, mask, image, w, h, stride, shift, threshold);
+#endif
+}
+
+__attribute__((visibility("default")))
+void mrgingham_ChESS_response_5_u16_clamp_mask(      int16_t*  restrict response,
+                                                    uint64_t* restrict mask,
+                                               const uint16_t* restrict image,
+                                               int w, int h, int stride, int shift,
+                                               int16_t threshold )
+{
+    response_with_u16(best_response_row_u16_function(), response, mask, image, w, h, stride, shift, threshold);
 }
@@ -14,6 +14,8 @@
   There's a more full-featured GPL-licensed implementation on that page
 */
 
+#include <stdint.h>
+
 
 /**
  * Perform the ChESS corner detection algorithm with a 5 px sampling radius
@@ -32,3 +34,105 @@ void mrgingham_ChESS_response_5(      int16_t* response,
                                 const uint8_t* image,
                                 int w, int h,
                                 int stride);
+
+/**
+ * The specific implementations of mrgingham_ChESS_response_5(). These all
+ * produce bit-identical output; mrgingham_ChESS_response_5() picks the fastest
+ * one the CPU supports at runtime. They're exposed mostly for testing. The
+ * SIMD flavors may only be called if the CPU supports the corresponding
+ * instruction set. On non-x86 machines they all use the scalar implementation
+ */
+void mrgingham_ChESS_response_5_scalar(      int16_t* response,
+                                       const uint8_t* image,
+                                       int w, int h,
+                                       int stride);
+void mrgingham_ChESS_response_5_sse41(      int16_t* response,
+                                      const uint8_t* image,
+                                      int w, int h,
+                                      int stride);
+void mrgingham_ChESS_response_5_avx2(      int16_t* response,
+                                     const uint8_t* image,
+                                     int w, int h,
+                                     int stride);
+
+/**
+ * Computes the ChESS response, clamps it to >= 0, and marks the candidate
+ * pixels, all in one pass over the image
+ *
+ * The response is the same as what mrgingham_ChESS_response_5() produces, but
+ * with all negative values replaced by 0. The mask has one bit per pixel: bit x
+ * of row y is set iff response[x + y*w] > threshold. Each row of the mask is
+ * MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w) 64-bit words long; bit x is bit (x%64)
+ * of word (x/64). Like the response, only the rows 7..h-8 of the mask are
+ * written. The caller must initialize the others
+ */
+#define MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w) (((w) + 63) / 64)
+void mrgingham_ChESS_response_5_clamp_mask(      int16_t* response,
+                                                uint64_t* mask,
+                                           const uint8_t* image,
+                                           int w, int h,
+                                           int stride,
+                                           int16_t threshold);
+void mrgingham_ChESS_response_5_clamp_mask_scalar(      int16_t* response,
+                                                       uint64_t* mask,
+                                                  const uint8_t* image,
+                                                  int w, int h,
+                                                  int stride,
+                                                  int16_t threshold);
+void mrgingham_ChESS_response_5_clamp_mask_sse41(      int16_t* response,
+                                                      uint64_t* mask,
+                                                 const uint8_t* image,
+                                                 int w, int h,
+                                                 int stride,
+                                                 int16_t threshold);
+void mrgingham_ChESS_response_5_clamp_mask_avx2(      int16_t* response,
+                                                     uint64_t* mask,
+                                                const uint8_t* image,
+                                                int w, int h,
+                                                int stride,
+                                                int16_t threshold);
+
+/**
+ * The ChESS response of 16-bit images: images with more than 8 bits per pixel,
+ * stored in uint16_t containers
+ *
+ * The response is computed with 32-bit intermediates, then shifted right by
+ * "shift" bits and saturated to the int16_t range. Pass shift = bit_depth-8 to
+ * get a response in the same units as what the 8-bit functions produce, while
+ * still using all the bits of the input.
+ *
+ * Unlike the 8-bit functions, the stride here is in PIXELS, not bytes. The
+ * _clamp_mask flavors work like mrgingham_ChESS_response_5_clamp_mask(). As
+ * with the 8-bit functions, these all produce identical output, and the
+ * dispatched ones pick the fastest implementation the CPU supports
+ */
+void mrgingham_ChESS_response_5_u16(      int16_t*  response,
+                                    const uint16_t* image,
+                                    int w, int h,
+                                    int stride, int shift);
+void mrgingham_ChESS_response_5_u16_scalar(      int16_t*  response,
+                                           const uint16_t* image,
+                                           int w, int h,
+                                           int stride, int shift);
+void mrgingham_ChESS_response_5_u16_avx2(      int16_t*  response,
+                                         const uint16_t* image,
+                                         int w, int h,
+                                         int stride, int shift);
+void mrgingham_ChESS_response_5_u16_clamp_mask(      int16_t*  response,
+                                                    uint64_t* mask,
+                                               const uint16_t* image,
+                                               int w, int h,
+                                               int stride, int shift,
+                                               int16_t threshold);
+void mrgingham_ChESS_response_5_u16_clamp_mask_scalar(      int16_t*  response,
+                                                           uint64_t* mask,
+                                                      const uint16_t* image,
+                                                      int w, int h,
+                                                      int stride, int shift,
+                                                      int16_t threshold);
+void mrgingham_ChESS_response_5_u16_clamp_mask_avx2(      int16_t*  response,
+                                                         uint64_t* mask,
+                                                    const uint16_t* image,
+                                                    int w, int h,
+                                                    int stride, int shift,
+                                                    int16_t threshold);
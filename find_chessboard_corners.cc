@@ -1,10 +1,16 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <assert.h>
+#include <string.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <type_traits>
+#include <atomic>
 
 #include "point.hh"
 #include "mrgingham-internal.h"
+#include "find_chessboard_corners.hh"
+#include "thread_pool.hh"
 
 extern "C"
 {
@@ -34,7 +40,8 @@ extern "C"
 // looking at a region inside a chessboard square instead of on a corner, then
 // the region will be relatively flat (same color), and the variance will be too
 // low. These parameters set the size of this search window and the threshold
-// for the standard deviation (sqrt(variance))
+// for the standard deviation (sqrt(variance)). The window radius is
+// options_t::variance_window_radius; this is its default
 #define CONSTANCY_WINDOW_R                  10
 #define STDEV_THRESHOLD                     20
 
@@ -47,44 +54,104 @@ extern "C"
 using namespace mrgingham;
 namespace mrgingham {
 
-static bool high_variance( int16_t x, int16_t y, int16_t w, int16_t h, const uint8_t* image )
+// Everything high_variance() needs to look at the image. The image is indexed
+// with its stride: pixel (x,y) is at image[x + y*stride]. The stride is in
+// pixels. The pixels are either uint8_t or uint16_t. For 16-bit images,
+// image_shift = bit_depth-8, and I scale the threshold to match.
+//
+// If integrals is non-NULL, these are the summed-area tables of a larger image,
+// and our image is the sub-region of it that starts at (x0,y0). I then get the
+// sums in O(1) from the tables. Otherwise I sum the pixels directly
+template<typename T>
+struct variance_window_t
 {
-    if(x-CONSTANCY_WINDOW_R < 0 || x+CONSTANCY_WINDOW_R >= w ||
-       y-CONSTANCY_WINDOW_R < 0 || y+CONSTANCY_WINDOW_R >= h )
+    const T* image;
+    int      stride;
+    int      image_shift;
+    int      R;
+
+    const image_integrals_t* integrals;
+    int                      x0, y0;
+};
+
+// The sum of the pixels and the sum of their squares in the (2R+1)x(2R+1)
+// window centered on (x,y). Differences of the unsigned table entries wrap
+// around just like the sums themselves do, so this is exact as long as the
+// window is at most MRGINGHAM_IMAGE_INTEGRALS_WINDOW_MAX pixels on a side
+template<typename T>
+static void window_sums( uint64_t* sum, uint64_t* sum_sq,
+                         int x, int y,
+                         const variance_window_t<T>* v )
+{
+    const int R = v->R;
+
+    if(v->integrals != NULL)
     {
-        // I give up on edges
-        return false;
-    }
+        const int stride = v->integrals->stride;
+        const int i00 = (v->x0 + x - R    ) + (v->y0 + y - R    )*stride;
+        const int i01 = (v->x0 + x + R + 1) + (v->y0 + y - R    )*stride;
+        const int i10 = (v->x0 + x - R    ) + (v->y0 + y + R + 1)*stride;
+        const int i11 = (v->x0 + x + R + 1) + (v->y0 + y + R + 1)*stride;
+
+        const uint32_t* s = v->integrals->sum.data();
+        *sum = (uint32_t)(s[i11] - s[i01] - s[i10] + s[i00]);
 
-    // I should be able to do this with opencv, but it's way too much of a pain
-    // in my ass, so I do it myself
-    int32_t sum = 0;
-    for(int dy = -CONSTANCY_WINDOW_R; dy <=CONSTANCY_WINDOW_R; dy++)
-        for(int dx = -CONSTANCY_WINDOW_R; dx <=CONSTANCY_WINDOW_R; dx++)
+        if(sizeof(T) == 1)
+        {
+            const uint32_t* s2 = v->integrals->sum_sq_u32.data();
+            *sum_sq = (uint32_t)(s2[i11] - s2[i01] - s2[i10] + s2[i00]);
+        }
+        else
         {
-            uint8_t val = image[ x+dx + (y+dy)*w ];
-            sum += (int32_t)val;
+            const uint64_t* s2 = v->integrals->sum_sq_u64.data();
+            *sum_sq = s2[i11] - s2[i01] - s2[i10] + s2[i00];
         }
+        return;
+    }
 
-    int32_t mean = sum / ((1 + 2*CONSTANCY_WINDOW_R)*
-                          (1 + 2*CONSTANCY_WINDOW_R));
-    int32_t sum_deviation_sq = 0;
-    for(int dy = -CONSTANCY_WINDOW_R; dy <=CONSTANCY_WINDOW_R; dy++)
-        for(int dx = -CONSTANCY_WINDOW_R; dx <=CONSTANCY_WINDOW_R; dx++)
+    *sum    = 0;
+    *sum_sq = 0;
+    for(int dy = -R; dy <= R; dy++)
+        for(int dx = -R; dx <= R; dx++)
         {
-            uint8_t val = image[ x+dx + (y+dy)*w ];
-            int32_t deviation = (int32_t)val - mean;
-            sum_deviation_sq += deviation*deviation;
+            uint64_t val = v->image[ x+dx + (y+dy)*v->stride ];
+            *sum    += val;
+            *sum_sq += val*val;
         }
+}
+
+template<typename T>
+static bool high_variance( int16_t x, int16_t y, int16_t w, int16_t h,
+                           const variance_window_t<T>* v )
+{
+    const int R = v->R;
+    if(x-R < 0 || x+R >= w ||
+       y-R < 0 || y+R >= h )
+    {
+        // I give up on edges
+        return false;
+    }
+
+    uint64_t sum, sum_sq;
+    window_sums(&sum, &sum_sq, x, y, v);
 
-    int32_t var = sum_deviation_sq / ((1 + 2*CONSTANCY_WINDOW_R)*
-                                      (1 + 2*CONSTANCY_WINDOW_R));
+    // The variance is computed about the mean, truncated to an integer:
+    //
+    //   sum( (val - mean)^2 ) = sum_sq - 2*mean*sum + N*mean^2
+    //
+    // Everything here fits into 64 bits, so this is exact
+    const int64_t N    = (int64_t)(1 + 2*R) * (int64_t)(1 + 2*R);
+    const int64_t mean = (int64_t)sum / N;
+    const int64_t sum_deviation_sq =
+        (int64_t)sum_sq - 2*mean*(int64_t)sum + N*mean*mean;
+
+    int64_t var = sum_deviation_sq / N;
 
     // // to show the variances and empirically find the threshold
-    // printf("%d %d %d\n", x, y, var);
+    // printf("%d %d %d\n", x, y, (int)var);
     // return false;
 
-    return var > VARIANCE_THRESHOLD;
+    return var > ((int64_t)VARIANCE_THRESHOLD << (2*v->image_shift));
 }
 
 // The point-list data structure for the connected-component traversal
@@ -93,6 +160,7 @@ struct xylist_t
 {
     struct xy_t* xy;
     int N;
+    int Nallocated;
 };
 
 static struct xylist_t xylist_alloc()
@@ -101,7 +169,8 @@ static struct xylist_t xylist_alloc()
 
     // start out large-enough for most use cases (should have connected
     // components with <10 pixels generally). Will realloc if really needed
-    l.xy = (struct xy_t*)malloc( 128 * sizeof(struct xy_t) );
+    l.Nallocated = 128;
+    l.xy = (struct xy_t*)malloc( l.Nallocated * sizeof(struct xy_t) );
 
     return l;
 }
@@ -109,22 +178,23 @@ static void xylist_reset(struct xylist_t* l)
 {
     l->N = 0;
 }
-static void xylist_reset_with(struct xylist_t* l, int16_t x, int16_t y)
-{
-    l->N = 1;
-    l->xy[0].x = x;
-    l->xy[0].y = y;
-}
 static void xylist_free(struct xylist_t* l)
 {
     free(l->xy);
     l->xy = NULL;
     l->N = -1;
+    l->Nallocated = 0;
 }
 static void xylist_push(struct xylist_t* l, int16_t x, int16_t y)
 {
     l->N++;
-    l->xy = (struct xy_t*)realloc(l->xy, l->N * sizeof(struct xy_t)); // no-op most of the time
+    if(l->N > l->Nallocated)
+    {
+        // I grow geometrically, so a list that's reused doesn't hit the heap
+        // once it's big enough
+        l->Nallocated *= 2;
+        l->xy = (struct xy_t*)realloc(l->xy, l->Nallocated * sizeof(struct xy_t));
+    }
 
     l->xy[l->N-1].x = x;
     l->xy[l->N-1].y = y;
@@ -145,6 +215,9 @@ typedef struct
     uint64_t sum_w_x, sum_w_y, sum_w;
     int N;
 
+    // The second moments. These give the covariance of each corner
+    uint64_t sum_w_xx, sum_w_xy, sum_w_yy;
+
     // I keep track of the position and magnitude of the peak, and I reject all
     // points whose response is smaller than some (small) ratio of the max. Note
     // that the max is updated as I go, so it's possible to accumulate some
@@ -180,9 +253,12 @@ static void accumulate(int16_t x, int16_t y, int16_t w, int16_t h, const int16_t
         c->y_peak       = y;
     }
 
-    c->sum_w_x += response * x;
-    c->sum_w_y += response * y;
-    c->sum_w   += response;
+    c->sum_w_x  += response * x;
+    c->sum_w_y  += response * y;
+    c->sum_w    += response;
+    c->sum_w_xx += (uint64_t)response * x * x;
+    c->sum_w_xy += (uint64_t)response * x * y;
+    c->sum_w_yy += (uint64_t)response * y * y;
     c->N++;
 
 
@@ -190,10 +266,35 @@ static void accumulate(int16_t x, int16_t y, int16_t w, int16_t h, const int16_t
     // printf("%d %d %d\n", x, y, response);
 
 }
+// The polarity of the corner at (x,y). I sample the same 16-pixel ring of
+// radius 5 that ChESS uses. The ring is symmetric, so the mean intensity
+// cancels out of both sums
+template<typename T>
+static CornerPolarity corner_polarity( int16_t x, int16_t y,
+                                       const variance_window_t<T>* v )
+{
+    static const int8_t ring[16][2] =
+        { { 2,-5}, { 0,-5}, {-2,-5}, {-4,-4}, {-5,-2}, {-5, 0}, {-5, 2}, {-4, 4},
+          {-2, 5}, { 0, 5}, { 2, 5}, { 4, 4}, { 5, 2}, { 5, 0}, { 5,-2}, { 4,-4} };
+
+    const T* p = &v->image[x + y*v->stride];
+    int c = 0, s = 0;
+    for(int i=0; i<16; i++)
+    {
+        const int dx = ring[i][0];
+        const int dy = ring[i][1];
+        const int val = (int)p[dx + dy*v->stride];
+        c += val * (dx*dx - dy*dy);
+        s += val * 2*dx*dy;
+    }
+    return CornerPolarity(c, s);
+}
+
+template<typename T>
 static bool connected_component_is_valid(const connected_component_t* c,
 
                                          int16_t w, int16_t h,
-                                         const uint8_t* image)
+                                         const variance_window_t<T>* variance_window)
 {
     // We're looking at a candidate peak. I don't want to find anything
     // inside a chessboard square, which the detector does sometimes. I
@@ -205,18 +306,29 @@ static bool connected_component_is_valid(const connected_component_t* c,
         c->N >= CONNECTED_COMPONENT_MIN_SIZE          &&
         c->response_max > RESPONSE_MIN_PEAK_THRESHOLD &&
         high_variance(c->x_peak, c->y_peak,
-                      w,h, image);
+                      w,h, variance_window);
 }
+// The sides of the image a connected component can run into. These are
+// reported by trace_connected_component()
+#define MARGIN_LEFT   1
+#define MARGIN_RIGHT  2
+#define MARGIN_TOP    4
+#define MARGIN_BOTTOM 8
+
 static void check_and_push_candidate(struct xylist_t* l,
-                                     bool* touched_margin,
+                                     int* touched_margin,
                                      int16_t x, int16_t y, int16_t w, int16_t h,
                                      const int16_t* d,
                                      int margin)
 {
-    if( !(x >= margin && x < w-margin &&
-          y >= margin && y < h-margin ))
+    int touched = 0;
+    if( x <  margin   ) touched |= MARGIN_LEFT;
+    if( x >= w-margin ) touched |= MARGIN_RIGHT;
+    if( y <  margin   ) touched |= MARGIN_TOP;
+    if( y >= h-margin ) touched |= MARGIN_BOTTOM;
+    if( touched )
     {
-        *touched_margin = true;
+        *touched_margin |= touched;
         return;
     }
 
@@ -225,28 +337,27 @@ static void check_and_push_candidate(struct xylist_t* l,
 
     xylist_push(l, x, y);
 }
-static bool follow_connected_component(PointDouble* out,
-
-                                       struct xylist_t* l,
-                                       int16_t w, int16_t h, int16_t* d,
+// Expands the seed points in l into their connected component, accumulating it
+// into *c. Returns which sides of the margin the component touched: a
+// combination of the MARGIN_... bits, or 0 if it didn't touch the margin at all
+static int trace_connected_component(connected_component_t* c,
 
-                                       const uint8_t* image,
-                                       int margin)
+                                     struct xylist_t* l,
+                                     int16_t w, int16_t h, int16_t* d,
+                                     int margin)
 {
-    connected_component_t c = {};
-
-    bool touched_margin = false;
+    int touched_margin = 0;
 
     int16_t x, y;
     while( xylist_pop(l, &x, &y))
     {
-        if(!is_valid(x,y,w,h,d, &c))
+        if(!is_valid(x,y,w,h,d, c))
         {
             d[x + y*w] = 0; // mark invalid; just in case
             continue;
         }
 
-        accumulate  (x,y,w,h,d, &c);
+        accumulate  (x,y,w,h,d, c);
         d[x + y*w] = 0; // mark invalid
 
         check_and_push_candidate(l, &touched_margin, x+1, y,   w,h,d,margin);
@@ -254,16 +365,7 @@ static bool follow_connected_component(PointDouble* out,
         check_and_push_candidate(l, &touched_margin, x,   y+1, w,h,d,margin);
         check_and_push_candidate(l, &touched_margin, x,   y-1, w,h,d,margin);
     }
-
-    // If I touched the margin, this connected component is NOT valid
-    if( !touched_margin &&
-        connected_component_is_valid(&c, w,h,image) )
-    {
-        out->x = (double)c.sum_w_x / (double)c.sum_w;
-        out->y = (double)c.sum_w_y / (double)c.sum_w;
-        return true;
-    }
-    return false;
+    return touched_margin;
 }
 
 static PointDouble scale_image_coord(const PointDouble* pt, double scale)
@@ -281,261 +383,1076 @@ static PointDouble scale_image_coord(const PointDouble* pt, double scale)
 
 #define DUMP_FILENAME_CORNERS_BASE   "/tmp/mrgingham-1-corners"
 #define DUMP_FILENAME_CORNERS        DUMP_FILENAME_CORNERS_BASE ".vnl"
-static int process_connected_components(int w, int h, int16_t* d,
 
-                                        const uint8_t* image,
-                                        std::vector<PointInt>* points_scaled_out,
-                                        std::vector<mrgingham::PointDouble>* points_refinement,
-                                        signed char*                         level_refinement,
-                                        bool debug, const char* debug_image_filename,
-                                        int image_pyramid_level,
-                                        int margin)
+// Opens the self-plotting corner dump written in debug mode. The filename is
+// written into the given buffer, which must be kept around until
+// close_corner_dump() is called
+static FILE* open_corner_dump(char* debug_filename, int debug_filename_size,
+                              bool refinement, int image_pyramid_level,
+                              const char* debug_image_filename)
 {
-    FILE* debugfp = NULL;
-    const char* debug_filename = NULL;
-    if(debug)
+    if(!refinement)
+        snprintf(debug_filename, debug_filename_size, DUMP_FILENAME_CORNERS);
+    else
+        snprintf(debug_filename, debug_filename_size,
+                 DUMP_FILENAME_CORNERS_BASE "-refinement-level%d.vnl", image_pyramid_level);
+    fprintf(stderr, "Writing self-plotting corner dump to %s\n", debug_filename);
+
+    FILE* debugfp = fopen(debug_filename, "w");
+    assert(debugfp);
+    if(debug_image_filename != NULL)
+        fprintf(debugfp, "#!/usr/bin/feedgnuplot --dom --with 'points pt 7 ps 2' --square --image %s\n", debug_image_filename);
+    else
+        fprintf(debugfp, "#!/usr/bin/feedgnuplot --dom --square --set 'yr [:] rev'\n");
+    fprintf(debugfp, "# x y\n");
+    return debugfp;
+}
+static void close_corner_dump(FILE* debugfp, const char* debug_filename)
+{
+    fclose(debugfp);
+    chmod(debug_filename,
+          S_IRUSR | S_IRGRP | S_IROTH |
+          S_IWUSR | S_IWGRP |
+          S_IXUSR | S_IXGRP | S_IXOTH);
+}
+
+// The buffers used by the corner finder and the refinement. These may be kept
+// around, and reused from image to image, so that I don't need to allocate them
+// every time
+//
+// The full-image connected-component search works on runs: horizontal strips
+// of adjacent candidate pixels in a row
+struct run_t
+{
+    int16_t y, x0, x1; // x1 is one-past-the-end
+    int     parent;    // the union-find forest. Roots point to themselves
+};
+
+// The streaming connected-component search (options_t::streaming) never has
+// the whole response. Each component that's still open keeps its own runs and
+// the responses of their pixels. In these runs, parent is the index of the
+// first pixel of the run in responses
+struct stream_component_t
+{
+    std::vector<run_t>   runs;
+    std::vector<int16_t> responses;
+
+    // The union-find forest over the components. Roots point to themselves
+    int  parent;
+
+    // The raster index (y*w + x) of the first pixel of the component. The
+    // components are reported in this order
+    int  key;
+
+    // The last row that has a run of this component
+    int  last_y;
+    bool touched_margin;
+};
+struct stream_closed_t
+{
+    int                   key;
+    connected_component_t c;
+};
+
+struct chessboard_corners_buffers_t
+{
+    std::vector<int16_t>  response;
+    std::vector<uint64_t> mask;
+    struct xylist_t       l;
+
+    std::vector<run_t>                 runs;
+    // components[i] is valid for each root run i
+    std::vector<connected_component_t> components;
+    std::vector<uint8_t>               touched_margin;
+
+    // For the tiled connected-component search. band_runs[i] are the runs
+    // found in band i, band_start[i] is the index of its first run in runs,
+    // and spanning[i] is set for each root run i whose component crosses a
+    // seam between the bands
+    std::vector<std::vector<run_t> > band_runs;
+    std::vector<int>                 band_start;
+    std::vector<uint8_t>             spanning;
+
+    // For the streaming search: the response and the mask of one block of
+    // rows, the runs in the previous and the current rows, the components
+    // that are still open (with a list of the unused slots), and the finished
+    // components that will be reported
+    std::vector<int16_t>            stream_response;
+    std::vector<uint64_t>           stream_mask;
+    std::vector<run_t>              stream_runs_prev, stream_runs_cur;
+    std::vector<stream_component_t> stream_components;
+    std::vector<int>                stream_free, stream_absorbed;
+    std::vector<stream_closed_t>    stream_closed;
+
+    // The parallel refinement gives each worker its own scratch space. The
+    // first worker uses this structure itself, and worker i>0 uses
+    // refinement_workers[i-1]. These are allocated as needed, and kept
+    std::vector<chessboard_corners_buffers_t*> refinement_workers;
+};
+
+__attribute__((visibility("default")))
+chessboard_corners_buffers_t* chessboard_corners_buffers_alloc(void)
+{
+    chessboard_corners_buffers_t* buffers = new chessboard_corners_buffers_t;
+    buffers->l = xylist_alloc();
+    return buffers;
+}
+
+__attribute__((visibility("default")))
+void chessboard_corners_buffers_free(chessboard_corners_buffers_t* buffers)
+{
+    if(buffers == NULL)
+        return;
+    for(chessboard_corners_buffers_t* worker : buffers->refinement_workers)
+        chessboard_corners_buffers_free(worker);
+    xylist_free(&buffers->l);
+    delete buffers;
+}
+
+// Appends the runs of candidate pixels in row y to runs. The mask has a bit set
+// for each pixel with response > RESPONSE_MIN_THRESHOLD: exactly the pixels
+// that may belong to a connected component. mask_row is the mask of this row.
+// I only look at the columns [x0,x1). Each run starts out as its own
+// component: its parent is its own index in runs
+static void find_runs_in_row(std::vector<run_t>* runs,
+                             const uint64_t* mask_row,
+                             int x0, int x1, int16_t y)
+{
+    // I find the runs of set bits, word by word. A run may span several
+    // words, so the current run is carried from one word to the next
+    int run_start = -1;
+    for(int iword = x0/64; iword*64 < x1; iword++)
     {
-        if(points_refinement == NULL)
-            debug_filename = DUMP_FILENAME_CORNERS;
-        else
+        uint64_t bits = mask_row[iword];
+
+        // Only look at x0 <= x < x1
+        if(iword*64 < x0)
+            bits &= ~(uint64_t)0 << (x0 - iword*64);
+        if(iword*64 + 64 > x1)
+            bits &= ((uint64_t)1 << (x1 - iword*64)) - 1;
+
+        int x = 0;
+        while(x < 64)
         {
-            char filename[256];
-            sprintf(filename, DUMP_FILENAME_CORNERS_BASE "-refinement-level%d.vnl", image_pyramid_level);
-            debug_filename = filename;
+            if(run_start < 0)
+            {
+                // Looking for the start of a run
+                uint64_t b = bits >> x;
+                if(b == 0) break;
+                x += __builtin_ctzll(b);
+                run_start = iword*64 + x;
+            }
+            else
+            {
+                // Looking for the end of the run
+                uint64_t b = ~bits >> x;
+                if(b == 0) break;
+                x += __builtin_ctzll(b);
+                runs->push_back( run_t({y, (int16_t)run_start, (int16_t)(iword*64 + x),
+                                        (int)runs->size()}) );
+                run_start = -1;
+            }
         }
-        fprintf(stderr, "Writing self-plotting corner dump to %s\n", debug_filename);
-
-        debugfp = fopen(debug_filename, "w");
-        assert(debugfp);
-        if(debug_image_filename != NULL)
-            fprintf(debugfp, "#!/usr/bin/feedgnuplot --dom --with 'points pt 7 ps 2' --square --image %s\n", debug_image_filename);
-        else
-            fprintf(debugfp, "#!/usr/bin/feedgnuplot --dom --square --set 'yr [:] rev'\n");
-        fprintf(debugfp, "# x y\n");
     }
+    if(run_start >= 0)
+        runs->push_back( run_t({y, (int16_t)run_start, (int16_t)x1,
+                                (int)runs->size()}) );
+}
 
+// Finds the runs of candidate pixels in rows [y0,y1). I only look at the
+// columns that may contain connected components: [margin, w-margin)
+static void find_runs(std::vector<run_t>* runs,
+                      int w, const uint64_t* mask,
+                      int margin, int y0, int y1)
+{
+    runs->clear();
 
+    const int Nmask_words = MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w);
+    const int x0 = margin;
+    const int x1 = w-margin;
+    if(x0 >= x1)
+        return;
 
-    uint16_t coord_scale = 1U << image_pyramid_level;
+    for(int16_t y = y0; y<y1; y++)
+        find_runs_in_row(runs, &mask[y*Nmask_words], x0, x1, y);
+}
 
-    struct xylist_t l = xylist_alloc();
+static int find_root(std::vector<run_t>& runs, int i)
+{
+    int root = i;
+    while(runs[root].parent != root)
+        root = runs[root].parent;
 
-    int N = 0;
+    // path compression
+    while(runs[i].parent != root)
+    {
+        int next = runs[i].parent;
+        runs[i].parent = root;
+        i = next;
+    }
+    return root;
+}
 
-    // I assume that points_scaled_out and points_refinement aren't both non-NULL
+// I always keep the lower index as the root. So the root of each connected
+// component is its first run, in raster order
+static void join(std::vector<run_t>& runs, int a, int b)
+{
+    a = find_root(runs, a);
+    b = find_root(runs, b);
+    if(a < b) runs[b].parent = a;
+    else      runs[a].parent = b;
+}
 
-    // I loop through all the pixels in the image. For each one I expand it into
-    // the connected component that contains it. If I'm refining, I only look
-    // for the connected component around the points I'm interested in
-    if(points_scaled_out != NULL)
+// Labels the runs in [i0,i1) with their connected components. Two runs are
+// connected if they're in adjacent rows, and they overlap horizontally: I use
+// 4-connectivity, like the flood fill in trace_connected_component()
+static void join_runs(std::vector<run_t>& runs, int i0, int i1)
+{
+    // The runs in the previous row are [iprev0,iprev1). The runs are sorted
+    // by y, then by x, so I sweep through both rows together
+    int iprev0 = i0, iprev1 = i0;
+    for(int i=i0; i<i1; i++)
     {
-        for(int16_t y = margin+1; y<h-margin-1; y++)
-            for(int16_t x = margin+1; x<w-margin-1; x++)
+        if(i == i0 || runs[i].y != runs[i-1].y)
+        {
+            // new row
+            if(i > i0 && runs[i-1].y == runs[i].y-1)
             {
-                if( !is_valid(x,y,w,h,d, NULL) )
-                    continue;
+                iprev0 = iprev1;
+                iprev1 = i;
+            }
+            else
+                iprev0 = iprev1 = i;
+        }
 
-                xylist_reset_with(&l, x, y);
+        while(iprev0 < iprev1 && runs[iprev0].x1 <= runs[i].x0)
+            iprev0++;
+        for(int j=iprev0; j<iprev1 && runs[j].x0 < runs[i].x1; j++)
+            join(runs, i, j);
+    }
+}
 
-                PointDouble pt;
-                if( follow_connected_component(&pt,
-                                               &l, w,h,d,
-                                               image,
-                                               margin) )
-                {
-                    pt = scale_image_coord(&pt, (double)coord_scale);
-                    if( debugfp )
-                        fprintf(debugfp, "%f %f\n", pt.x, pt.y);
+// The covariance of the response of the given connected component, scaled to
+// the full-resolution image. The moments may be about any origin: the central
+// moments don't depend on it
+static CornerCovariance component_covariance(const connected_component_t* c,
+                                             double coord_scale)
+{
+    const double sum_w = (double)c->sum_w;
+    const double mx    = (double)c->sum_w_x / sum_w;
+    const double my    = (double)c->sum_w_y / sum_w;
+    const double s2    = coord_scale*coord_scale;
+    return CornerCovariance( ((double)c->sum_w_xx / sum_w - mx*mx) * s2,
+                             ((double)c->sum_w_xy / sum_w - mx*my) * s2,
+                             ((double)c->sum_w_yy / sum_w - my*my) * s2 );
+}
 
-                    points_scaled_out->push_back(PointInt((int)(0.5 + pt.x * FIND_GRID_SCALE),
-                                                          (int)(0.5 + pt.y * FIND_GRID_SCALE)));
-                }
-            }
-        N = points_scaled_out->size();
+// Reports the given finished connected component, if it's valid. Its centroid
+// is appended to points_scaled_out, and its strength and polarity to the other
+// arrays, if they're given
+template<typename T>
+static void report_connected_component(const connected_component_t* c,
+                                       int w, int h,
+                                       const variance_window_t<T>* variance_window,
+                                       uint16_t coord_scale,
+                                       FILE* debugfp,
+                                       std::vector<PointInt>* points_scaled_out,
+                                       std::vector<int16_t>*  strengths_out,
+                                       std::vector<CornerPolarity>* polarities_out,
+                                       std::vector<CornerCovariance>* covariances_out)
+{
+    if( !connected_component_is_valid(c, w,h, variance_window) )
+        return;
+
+    PointDouble pt( (double)c->sum_w_x / (double)c->sum_w,
+                    (double)c->sum_w_y / (double)c->sum_w );
+    pt = scale_image_coord(&pt, (double)coord_scale);
+    if( debugfp )
+        fprintf(debugfp, "%f %f\n", pt.x, pt.y);
+
+    points_scaled_out->push_back(PointInt((int)(0.5 + pt.x * FIND_GRID_SCALE),
+                                          (int)(0.5 + pt.y * FIND_GRID_SCALE)));
+    if(strengths_out != NULL)
+        strengths_out->push_back(c->response_max);
+    if(polarities_out != NULL)
+        polarities_out->push_back(corner_polarity(c->x_peak, c->y_peak, variance_window));
+    if(covariances_out != NULL)
+        covariances_out->push_back(component_covariance(c, (double)coord_scale));
+}
+
+// Finds all the connected components of the candidate pixels in the response,
+// and reports the valid ones.
+//
+// I do this in two sequential passes over run-length-encoded rows. First I
+// find the runs, and label them with union-find. Then I sweep through the runs
+// once to find the peak of each component, and again to accumulate the
+// response-weighted centroid. Like everywhere else, I only accumulate the
+// pixels whose response is above RESPONSE_MIN_THRESHOLD_RATIO_OF_MAX() of the
+// peak. The components are reported in the raster order of their first pixel
+//
+// With Nthreads > 1 I split the image into horizontal bands, and each thread
+// works on its own band. I stitch the labels together at the seams between the
+// bands, and the components that cross a seam are then accumulated serially.
+// This produces exactly the same results as the serial search
+template<typename T>
+static int process_connected_components(int w, int h, const int16_t* d,
+                                        const uint64_t* mask,
+
+                                        const variance_window_t<T>* variance_window,
+                                        std::vector<PointInt>* points_scaled_out,
+                                        std::vector<int16_t>*  strengths_out,
+                                        std::vector<CornerPolarity>* polarities_out,
+                                        std::vector<CornerCovariance>* covariances_out,
+                                        chessboard_corners_buffers_t* buffers,
+                                        bool debug, const char* debug_image_filename,
+                                        int image_pyramid_level,
+                                        int margin,
+                                        int Nthreads)
+{
+    FILE* debugfp = NULL;
+    char  debug_filename[256];
+    if(debug)
+        debugfp = open_corner_dump(debug_filename, sizeof(debug_filename),
+                                   false, image_pyramid_level,
+                                   debug_image_filename);
+
+    uint16_t coord_scale = 1U << image_pyramid_level;
+
+    std::vector<run_t>&                 runs           = buffers->runs;
+    std::vector<connected_component_t>& components     = buffers->components;
+    std::vector<uint8_t>&               touched_margin = buffers->touched_margin;
+    std::vector<uint8_t>&               spanning       = buffers->spanning;
+    std::vector<int>&                   band_start     = buffers->band_start;
+
+    // Each band should be big-enough for the threading overhead to not matter
+    int Nbands = Nthreads;
+    if(Nbands > (h - 2*margin) / 32) Nbands = (h - 2*margin) / 32;
+    if(Nbands < 1)                   Nbands = 1;
+
+    if(Nbands == 1)
+    {
+        find_runs(&runs, w, mask, margin, margin, h-margin);
+        join_runs(runs, 0, (int)runs.size());
+        band_start.resize(2);
+        band_start[0] = 0;
+        band_start[1] = (int)runs.size();
     }
-    else if(points_refinement != NULL)
+    else
     {
-        for(unsigned i=0; i<points_refinement->size(); i++)
+        // I label each band independently, with the run indices local to that
+        // band. The coarser pyramid levels have fewer bands. I never shrink
+        // band_runs: that would free the runs of the other bands, and the next
+        // finer level would allocate them again
+        std::vector<std::vector<run_t> >& band_runs = buffers->band_runs;
+        if((int)band_runs.size() < Nbands)
+            band_runs.resize(Nbands);
+        parallel_for(Nbands, Nthreads,
+                     [&](int i)
+                     {
+                         int y0 = margin + (h - 2*margin) *  i    / Nbands;
+                         int y1 = margin + (h - 2*margin) * (i+1) / Nbands;
+                         find_runs(&band_runs[i], w, mask, margin, y0, y1);
+                         join_runs(band_runs[i], 0, (int)band_runs[i].size());
+                     });
+
+        // I concatenate the bands. The runs end up in the same raster order
+        // as they would in the serial search
+        band_start.resize(Nbands+1);
+        band_start[0] = 0;
+        for(int i=0; i<Nbands; i++)
+            band_start[i+1] = band_start[i] + (int)band_runs[i].size();
+        runs.resize(band_start[Nbands]);
+        for(int i=0; i<Nbands; i++)
+            for(int j=0; j<(int)band_runs[i].size(); j++)
+            {
+                runs[band_start[i] + j]         = band_runs[i][j];
+                runs[band_start[i] + j].parent += band_start[i];
+            }
+
+        // And I join the components across the seams. The rows on either side
+        // of a seam are the last row of one band and the first row of the next
+        for(int i=1; i<Nbands; i++)
         {
-            // I can only refine the current estimate if it was computed at one
-            // level higher than what I'm at now
-            if( level_refinement[i] != image_pyramid_level+1 )
+            if(band_start[i] == 0 || band_start[i] == (int)runs.size())
                 continue;
 
-            PointDouble& pt_full = (*points_refinement)[i];
-
-            // The point pt indexes the full-size image, while the
-            // connected-component stuff looks at a downsampled image. I convert
-            PointDouble pt_downsampled = scale_image_coord(&pt_full, 1.0 / coord_scale);
-
-            int x = (int)(pt_downsampled.x + 0.5);
-            int y = (int)(pt_downsampled.y + 0.5);
-
-            // I seed my refinement from the 3x3 neighborhood around the
-            // previous center point. It is possible for the ChESS response
-            // right in the center to be invalid, and I'll then not be able to
-            // refine the point at all
-            xylist_reset(&l);
-            for(int dx = -1; dx<=1; dx++)
-                for(int dy = -1; dy<=1; dy++)
-                    if( is_valid(x+dx,y+dy,w,h,d, NULL))
-                        xylist_push(&l,x+dx,y+dy);
-
-            PointDouble pt;
-            if(follow_connected_component(&pt,
-                                          &l, w,h,d,
-                                          image,
-                                          margin))
+            int i0 = band_start[i];
+            while(i0 > 0 && runs[i0-1].y == runs[band_start[i]-1].y)
+                i0--;
+            int i1 = band_start[i];
+            while(i1 < (int)runs.size() && runs[i1].y == runs[band_start[i]].y)
+                i1++;
+            join_runs(runs, i0, i1);
+        }
+    }
+
+    const int Nruns = (int)runs.size();
+    components    .resize(Nruns);
+    touched_margin.resize(Nruns);
+    spanning      .resize(Nruns);
+
+    // I point each run directly at its root. The root of each component is
+    // its first run, and each parent comes before its child, so a single
+    // sweep does it. A component spans several bands if any of its runs lives
+    // in a different band from its root
+    for(int iband=0; iband<Nbands; iband++)
+        for(int i=band_start[iband]; i<band_start[iband+1]; i++)
+        {
+            run_t* r  = &runs[i];
+            r->parent = runs[r->parent].parent;
+            if(r->parent == i)
             {
-                pt_full = scale_image_coord(&pt, (double)coord_scale);
-                if( debugfp )
-                    fprintf(debugfp, "%f %f\n", pt_full.x, pt_full.y);
-                level_refinement[i] = image_pyramid_level;
-                N++;
+                components    [i] = connected_component_t({});
+                touched_margin[i] = false;
+                spanning      [i] = false;
             }
+            else if(r->parent < band_start[iband])
+                spanning[r->parent] = true;
         }
-    }
 
-    xylist_free(&l);
+    // Pass 1: the peak of each component, and whether it touched the margin.
+    // Any pixel in the outermost ring of the region touches the margin. I look
+    // at the runs of each component in order, so ties go to the first pixel
+    auto pass1 = [&](int i)
+    {
+        const run_t* r = &runs[i];
+        connected_component_t* c = &components[r->parent];
 
-    if(debug)
+        if( r->y  == margin   || r->y  == h-margin-1 ||
+            r->x0 == margin   || r->x1 == w-margin )
+            touched_margin[r->parent] = true;
+
+        const int16_t* drow = &d[r->y*w];
+        for(int16_t x = r->x0; x < r->x1; x++)
+            if( drow[x] > c->response_max)
+            {
+                c->response_max = drow[x];
+                c->x_peak       = x;
+                c->y_peak       = r->y;
+            }
+    };
+
+    // Pass 2: the centroid of each component that didn't touch the margin
+    auto pass2 = [&](int i)
+    {
+        const run_t* r = &runs[i];
+        if(touched_margin[r->parent])
+            return;
+
+        connected_component_t* c = &components[r->parent];
+        const int16_t threshold = std::max( (int16_t)RESPONSE_MIN_THRESHOLD,
+                                            (int16_t)RESPONSE_MIN_THRESHOLD_RATIO_OF_MAX(c->response_max) );
+
+        const int16_t* drow = &d[r->y*w];
+        uint64_t sum_w = 0, sum_w_x = 0, sum_w_xx = 0;
+        int N = 0;
+        for(int x = r->x0; x < r->x1; x++)
+            if(drow[x] > threshold)
+            {
+                sum_w    += drow[x];
+                sum_w_x  += drow[x] * x;
+                sum_w_xx += (uint64_t)drow[x] * x * x;
+                N++;
+            }
+        c->sum_w    += sum_w;
+        c->sum_w_x  += sum_w_x;
+        c->sum_w_y  += sum_w * r->y;
+        c->sum_w_xx += sum_w_xx;
+        c->sum_w_xy += sum_w_x * r->y;
+        c->sum_w_yy += sum_w * r->y * r->y;
+        c->N        += N;
+    };
+
+    // The components that live within a single band are only touched by the
+    // thread working on that band. The few that cross a seam, I do afterwards
+    // in this thread
+    for(int ipass=1; ipass<=2; ipass++)
     {
-        fclose(debugfp);
-        chmod(debug_filename,
-              S_IRUSR | S_IRGRP | S_IROTH |
-              S_IWUSR | S_IWGRP |
-              S_IXUSR | S_IXGRP | S_IXOTH);
+        parallel_for(Nbands, Nthreads,
+                     [&](int iband)
+                     {
+                         for(int i=band_start[iband]; i<band_start[iband+1]; i++)
+                             if(!spanning[runs[i].parent])
+                             {
+                                 if(ipass == 1) pass1(i);
+                                 else           pass2(i);
+                             }
+                     });
+        if(Nbands > 1)
+            for(int i=0; i<Nruns; i++)
+                if(spanning[runs[i].parent])
+                {
+                    if(ipass == 1) pass1(i);
+                    else           pass2(i);
+                }
     }
 
-    return N;
-}
+    // I report the components in order
+    for(int i=0; i<Nruns; i++)
+    {
+        if(runs[i].parent != i || touched_margin[i])
+            continue;
 
-// returns a scaled image, or NULL on failure
-#define SCALED_PROCESSED_IMAGE_FILENAME   "/tmp/mrgingham-scaled-processed-level%d.png"
-static const cv::Mat*
-apply_image_pyramid_scaling(// out
+        report_connected_component(&components[i], w, h, variance_window,
+                                   coord_scale, debugfp,
+                                   points_scaled_out, strengths_out, polarities_out, covariances_out);
+    }
 
-                            // This MAY be used for the output image. The
-                            // pointer returned by this function is what the
-                            // caller should use. The caller should provide a
-                            // cv::Mat object that this function can use for its
-                            // purposes. When the caller is done with the scaled
-                            // image, they may free this object
-                            cv::Mat& image_buffer_output,
+    if(debug)
+        close_corner_dump(debugfp, debug_filename);
 
-                            // in
-                            const cv::Mat& image_input,
+    return (int)points_scaled_out->size();
+}
 
-                            // set to 0 to just use the image
+// returns a scaled image, or NULL on failure. The image comes from the
+// pyramid, so it's computed only once, no matter how many times it's asked for
+#define SCALED_PROCESSED_IMAGE_FILENAME   "/tmp/mrgingham-scaled-processed-level%d.png"
+static const cv::Mat*
+apply_image_pyramid_scaling(image_pyramid_t* pyramid,
                             int image_pyramid_level,
                             bool debug )
 {
-    if( image_pyramid_level < 0 ||
+    const cv::Mat* image = pyramid->get(image_pyramid_level);
+    if( image == NULL )
+        return NULL;
 
-        // 10 is an arbitrary high number
-        image_pyramid_level > 10 )
+    if( debug )
     {
-        fprintf(stderr, "%s:%d in %s(): Got an unreasonable image_pyramid_level = %d."
-                " Sorry.\n", __FILE__, __LINE__, __func__, image_pyramid_level);
-        return NULL;
+        char filename[256];
+        sprintf(filename, SCALED_PROCESSED_IMAGE_FILENAME, image_pyramid_level);
+        cv::imwrite(filename, *image);
+        fprintf(stderr, "Wrote scaled,processed image to %s\n", filename);
     }
 
-    const cv::Mat* image;
+    return image;
+}
+
+// Returns how many threads the options ask for
+static int get_Nthreads(const mrgingham::options_t& options)
+{
+    return options.Nthreads > 0 ? options.Nthreads : get_Ncores();
+}
 
-    if(image_pyramid_level == 0)
-        image = &image_input;
+// The ChESS kernel for each image type. image_shift is used by the 16-bit
+// images only
+static void ChESS_response( int16_t* response, uint64_t* mask,
+                            const uint8_t* image, int w, int h, int stride,
+                            int image_shift )
+{
+    if(mask == NULL)
+        mrgingham_ChESS_response_5( response, image, w, h, stride );
     else
+        mrgingham_ChESS_response_5_clamp_mask( response, mask, image, w, h, stride,
+                                               RESPONSE_MIN_THRESHOLD );
+}
+static void ChESS_response( int16_t* response, uint64_t* mask,
+                            const uint16_t* image, int w, int h, int stride,
+                            int image_shift )
+{
+    if(mask == NULL)
+        mrgingham_ChESS_response_5_u16( response, image, w, h, stride, image_shift );
+    else
+        mrgingham_ChESS_response_5_u16_clamp_mask( response, mask, image, w, h, stride, image_shift,
+                                                   RESPONSE_MIN_THRESHOLD );
+}
+
+#define CANCEL_BAND_ROWS 64
+
+// Computes the ChESS response in horizontal bands, in parallel. The response
+// in each band depends on the input rows in the band and on a 7-pixel halo
+// above and below it. The bands write disjoint rows, so the result is identical
+// to computing the whole image at once.
+//
+// If mask != NULL, I use the fused kernel: the response is clamped to >= 0 and
+// the mask marks all the pixels with response > RESPONSE_MIN_THRESHOLD. If
+// mask == NULL, I compute the raw response
+//
+// If cancel != NULL, another thread may set it to stop the computation early.
+// I then split the image into bands of at most CANCEL_BAND_ROWS rows, even
+// with Nthreads == 1, and I skip the bands that start after *cancel is set.
+// The response is then incomplete, and the caller must throw it away
+template<typename T>
+static void compute_ChESS_response( // out
+                                    int16_t*  response,
+                                    uint64_t* mask,
+
+                                    // in
+                                    const T* image,
+                                    int w, int h, int stride, int image_shift,
+                                    int Nthreads,
+                                    const std::atomic<bool>* cancel = NULL)
+{
+    const int Nrows_valid = h - 2*7;
+    if(Nrows_valid <= 0)
+        return;
+
+    // I want each band to be tall enough that the halo overhead is small
+    int Nbands = Nthreads;
+    if(Nbands > Nrows_valid / 32) Nbands = Nrows_valid / 32;
+    if(cancel != NULL &&
+       Nbands < (Nrows_valid + CANCEL_BAND_ROWS-1) / CANCEL_BAND_ROWS)
+        Nbands = (Nrows_valid + CANCEL_BAND_ROWS-1) / CANCEL_BAND_ROWS;
+    if(Nbands < 1)                Nbands = 1;
+
+    parallel_for(Nbands, Nthreads,
+                 [&](int i)
+                 {
+                     if(cancel != NULL && cancel->load(std::memory_order_relaxed))
+                         return;
+
+                     int y0 = 7 + Nrows_valid *  i    / Nbands;
+                     int y1 = 7 + Nrows_valid * (i+1) / Nbands;
+
+                     ChESS_response( &response[(y0-7)*w],
+                                     mask == NULL ? NULL : &mask[(y0-7)*MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w)],
+                                     &image[(y0-7)*stride],
+                                     w, y1-y0 + 2*7, stride, image_shift );
+                 });
+}
+
+// The ChESS implementation doesn't write the 7-pixel border of the response.
+// I set it to 0 here, so that the whole response array is valid
+static void zero_response_border(int16_t* response, int w, int h)
+{
+    if(w <= 2*7 || h <= 2*7)
     {
-        double scale = 1.0 / ((double)(1 << image_pyramid_level));
-        cv::resize( image_input, image_buffer_output, cv::Size(), scale, scale, cv::INTER_LINEAR );
-        image = &image_buffer_output;
+        memset(response, 0, w*h*sizeof(response[0]));
+        return;
     }
-    if( debug )
+
+    memset(response,           0, 7*w*sizeof(response[0]));
+    memset(&response[(h-7)*w], 0, 7*w*sizeof(response[0]));
+    for(int y=7; y<h-7; y++)
     {
-        char filename[256];
-        sprintf(filename, SCALED_PROCESSED_IMAGE_FILENAME, image_pyramid_level);
-        cv::imwrite(filename, *image);
-        fprintf(stderr, "Wrote scaled,processed image to %s\n", filename);
+        memset(&response[y*w],     0, 7*sizeof(response[0]));
+        memset(&response[y*w+w-7], 0, 7*sizeof(response[0]));
     }
+}
 
-    if( !image->isContinuous() )
+// The streaming search computes the ChESS response in blocks of this many rows
+#define STREAM_BLOCK_ROWS 16
+
+// Does the work of compute_ChESS_response() and process_connected_components()
+// without ever having the response of the whole image. I compute the response
+// of STREAM_BLOCK_ROWS rows at a time into a small buffer, and I label the runs
+// of candidate pixels one row at a time, merging them into the components of
+// the runs in the row above. A component is finished when a row doesn't extend
+// it. Then I find its peak and its centroid, from the responses it kept. The
+// working memory is O(w) plus the pixels of the components that are still
+// open, instead of O(w*h). I visit the pixels of each component in the same
+// order as process_connected_components(), and I report the components in the
+// same order, so the results are identical. This is serial, and it doesn't
+// write any debug output
+template<typename T>
+static int find_chessboard_corners_streaming(int w, int h,
+                                             const T* image, int image_stride, int image_shift,
+                                             const variance_window_t<T>* variance_window,
+                                             std::vector<PointInt>* points_scaled_out,
+                                             std::vector<int16_t>*  strengths_out,
+                                             std::vector<CornerPolarity>* polarities_out,
+                                             std::vector<CornerCovariance>* covariances_out,
+                                             chessboard_corners_buffers_t* buffers,
+                                             int image_pyramid_level)
+{
+    // The ChESS response is invalid at a 7-pixel margin around the image
+    const int margin = 7;
+    if(w <= 2*margin || h <= 2*margin)
+        return 0;
+
+    uint16_t coord_scale = 1U << image_pyramid_level;
+
+    const int Nmask_words = MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w);
+
+    std::vector<int16_t>&            response   = buffers->stream_response;
+    std::vector<uint64_t>&           mask       = buffers->stream_mask;
+    std::vector<run_t>&              runs_prev  = buffers->stream_runs_prev;
+    std::vector<run_t>&              runs_cur   = buffers->stream_runs_cur;
+    std::vector<stream_component_t>& components = buffers->stream_components;
+    std::vector<int>&                free_slots = buffers->stream_free;
+    std::vector<int>&                absorbed   = buffers->stream_absorbed;
+    std::vector<stream_closed_t>&    closed     = buffers->stream_closed;
+
+    // Each block has a 7-pixel halo above and below it
+    response.resize((STREAM_BLOCK_ROWS + 2*margin) * w);
+    mask    .resize((STREAM_BLOCK_ROWS + 2*margin) * Nmask_words);
+    runs_prev .clear();
+    runs_cur  .clear();
+    components.clear();
+    free_slots.clear();
+    absorbed  .clear();
+    closed    .clear();
+
+    auto find_root_component = [&](int i)
     {
-        fprintf(stderr, "%s:%d in %s(): I can only handle continuous arrays (stride == width) currently."
-                " Sorry.\n", __FILE__, __LINE__, __func__);
-        return NULL;
+        int root = i;
+        while(components[root].parent != root)
+            root = components[root].parent;
+        while(components[i].parent != root)
+        {
+            int next = components[i].parent;
+            components[i].parent = root;
+            i = next;
+        }
+        return root;
+    };
+
+    // Merges two components, and returns the root of the result. I move the
+    // data of the smaller component into the larger one. The absorbed
+    // component stays in the forest until the end of the row, since the runs
+    // in the previous row may still refer to it
+    auto join_components = [&](int a, int b)
+    {
+        a = find_root_component(a);
+        b = find_root_component(b);
+        if(a == b)
+            return a;
+        if(components[a].responses.size() < components[b].responses.size())
+            std::swap(a,b);
+
+        stream_component_t* ca = &components[a];
+        stream_component_t* cb = &components[b];
+        const int offset = (int)ca->responses.size();
+        for(const run_t& r : cb->runs)
+            ca->runs.push_back( run_t({r.y, r.x0, r.x1, r.parent + offset}) );
+        ca->responses.insert(ca->responses.end(),
+                             cb->responses.begin(), cb->responses.end());
+        ca->key             = std::min(ca->key, cb->key);
+        ca->last_y          = std::max(ca->last_y, cb->last_y);
+        ca->touched_margin |= cb->touched_margin;
+
+        cb->runs     .clear();
+        cb->responses.clear();
+        cb->parent = a;
+        absorbed.push_back(b);
+        return a;
+    };
+
+    auto new_component = [&](int key)
+    {
+        int i;
+        if(!free_slots.empty())
+        {
+            i = free_slots.back();
+            free_slots.pop_back();
+        }
+        else
+        {
+            i = (int)components.size();
+            components.push_back(stream_component_t());
+        }
+        components[i].parent         = i;
+        components[i].key            = key;
+        components[i].last_y         = -1;
+        components[i].touched_margin = false;
+        return i;
+    };
+
+    // A finished component. I find its peak and its centroid exactly as
+    // process_connected_components() does: the pixels are visited in raster
+    // order, so the ties in the peak go to the same pixel
+    auto close_component = [&](int i)
+    {
+        stream_component_t* sc = &components[i];
+        if(!sc->touched_margin)
+        {
+            std::sort(sc->runs.begin(), sc->runs.end(),
+                      [](const run_t& a, const run_t& b)
+                      {
+                          return a.y != b.y ? a.y < b.y : a.x0 < b.x0;
+                      });
+
+            connected_component_t c = {};
+            for(const run_t& r : sc->runs)
+            {
+                const int16_t* d = &sc->responses[r.parent];
+                for(int16_t x = r.x0; x < r.x1; x++)
+                    if( d[x - r.x0] > c.response_max)
+                    {
+                        c.response_max = d[x - r.x0];
+                        c.x_peak       = x;
+                        c.y_peak       = r.y;
+                    }
+            }
+
+            const int16_t threshold = std::max( (int16_t)RESPONSE_MIN_THRESHOLD,
+                                                (int16_t)RESPONSE_MIN_THRESHOLD_RATIO_OF_MAX(c.response_max) );
+            for(const run_t& r : sc->runs)
+            {
+                const int16_t* d = &sc->responses[r.parent];
+                uint64_t sum_w = 0, sum_w_x = 0, sum_w_xx = 0;
+                int N = 0;
+                for(int x = r.x0; x < r.x1; x++)
+                    if(d[x - r.x0] > threshold)
+                    {
+                        sum_w    += d[x - r.x0];
+                        sum_w_x  += d[x - r.x0] * x;
+                        sum_w_xx += (uint64_t)d[x - r.x0] * x * x;
+                        N++;
+                    }
+                c.sum_w    += sum_w;
+                c.sum_w_x  += sum_w_x;
+                c.sum_w_y  += sum_w * r.y;
+                c.sum_w_xx += sum_w_xx;
+                c.sum_w_xy += sum_w_x * r.y;
+                c.sum_w_yy += sum_w * r.y * r.y;
+                c.N        += N;
+            }
+            closed.push_back( stream_closed_t({sc->key, c}) );
+        }
+
+        sc->runs     .clear();
+        sc->responses.clear();
+
+        // Marks this component as closed, so that I don't close it again
+        sc->last_y = INT_MAX;
+        free_slots.push_back(i);
+    };
+
+    int yblock0 = 0, yblock1 = 0;
+    for(int y = margin; y < h-margin; y++)
+    {
+        if(y >= yblock1)
+        {
+            // The next block. The ChESS kernel writes the rows 7..(rows-8) of
+            // the buffers it's given
+            yblock0 = y;
+            yblock1 = std::min(y + STREAM_BLOCK_ROWS, h-margin);
+            ChESS_response( response.data(), mask.data(),
+                            &image[(yblock0-margin)*image_stride],
+                            w, yblock1-yblock0 + 2*margin, image_stride, image_shift );
+        }
+        const int16_t*  drow     = &response[(y - yblock0 + margin)*w];
+        const uint64_t* mask_row = &mask    [(y - yblock0 + margin)*Nmask_words];
+
+        runs_cur.clear();
+        find_runs_in_row(&runs_cur, mask_row, margin, w-margin, (int16_t)y);
+
+        // I connect each run to the overlapping runs in the previous row, and
+        // I add its pixels to the resulting component. The runs are sorted by
+        // x, so I sweep through both rows together
+        int iprev0 = 0;
+        for(run_t& r : runs_cur)
+        {
+            while(iprev0 < (int)runs_prev.size() && runs_prev[iprev0].x1 <= r.x0)
+                iprev0++;
+
+            int icomponent = -1;
+            for(int j=iprev0; j<(int)runs_prev.size() && runs_prev[j].x0 < r.x1; j++)
+                icomponent =
+                    icomponent < 0 ?
+                    find_root_component(runs_prev[j].parent) :
+                    join_components(icomponent, runs_prev[j].parent);
+            if(icomponent < 0)
+                icomponent = new_component(y*w + r.x0);
+
+            stream_component_t* sc = &components[icomponent];
+            sc->runs.push_back( run_t({r.y, r.x0, r.x1, (int)sc->responses.size()}) );
+            sc->responses.insert(sc->responses.end(), &drow[r.x0], &drow[r.x1]);
+            sc->last_y = y;
+            if( y    == margin || y    == h-margin-1 ||
+                r.x0 == margin || r.x1 == w-margin )
+                sc->touched_margin = true;
+
+            r.parent = icomponent;
+        }
+
+        // The components of the previous row that this row didn't extend are
+        // finished
+        for(const run_t& r : runs_prev)
+        {
+            int i = find_root_component(r.parent);
+            if(components[i].last_y < y)
+                close_component(i);
+        }
+
+        // Nothing refers to the absorbed components anymore, once the runs of
+        // this row point to their roots
+        for(run_t& r : runs_cur)
+            r.parent = find_root_component(r.parent);
+        free_slots.insert(free_slots.end(), absorbed.begin(), absorbed.end());
+        absorbed.clear();
+
+        std::swap(runs_prev, runs_cur);
     }
 
-    if( image->type() != CV_8U )
+    // Everything still open is finished at the end of the image
+    for(const run_t& r : runs_prev)
     {
-        fprintf(stderr, "%s:%d in %s(): I can only handle CV_8U arrays currently."
-                " Sorry.\n", __FILE__, __LINE__, __func__);
-        return NULL;
+        int i = find_root_component(r.parent);
+        if(components[i].last_y != INT_MAX)
+            close_component(i);
     }
 
-    return image;
+    // I report the components in the raster order of their first pixel, like
+    // process_connected_components() does
+    std::sort(closed.begin(), closed.end(),
+              [](const stream_closed_t& a, const stream_closed_t& b)
+              {
+                  return a.key < b.key;
+              });
+    for(const stream_closed_t& sc : closed)
+        report_connected_component(&sc.c, w, h, variance_window,
+                                   coord_scale, NULL,
+                                   points_scaled_out, strengths_out, polarities_out, covariances_out);
+
+    return (int)points_scaled_out->size();
 }
 
 #define CHESS_RESPONSE_FILENAME                     "/tmp/mrgingham-chess-response%s-level%d.png"
 #define CHESS_RESPONSE_POSITIVE_FILENAME            "/tmp/mrgingham-chess-response%s-level%d-positive.png"
+
+// Reads the pixel type of the image, and the shift needed to bring the pixel
+// values to the 8-bit range. Returns false if the image isn't one I can handle
+static bool get_image_shift(int* image_shift,
+                            const cv::Mat& image,
+                            const mrgingham::options_t& options)
+{
+    if( image.type() == CV_8U )
+    {
+        *image_shift = 0;
+        return true;
+    }
+    if( image.type() != CV_16U )
+    {
+        fprintf(stderr, "%s:%d in %s(): I can only handle CV_8U and CV_16U arrays currently."
+                " Sorry.\n", __FILE__, __LINE__, __func__);
+        return false;
+    }
+    if( options.bit_depth < 8 || options.bit_depth > 16 )
+    {
+        fprintf(stderr, "%s:%d in %s(): CV_16U images must have a bit_depth in [8,16]. Got %d."
+                " Sorry.\n", __FILE__, __LINE__, __func__, options.bit_depth);
+        return false;
+    }
+    *image_shift = options.bit_depth - 8;
+    return true;
+}
+
+static bool variance_window_radius_is_valid(const mrgingham::options_t& options)
+{
+    if( options.variance_window_radius < 1 ||
+        1 + 2*options.variance_window_radius > MRGINGHAM_IMAGE_INTEGRALS_WINDOW_MAX )
+    {
+        fprintf(stderr, "%s:%d in %s(): variance_window_radius must be in [1,%d]. Got %d."
+                " Sorry.\n", __FILE__, __LINE__, __func__,
+                (MRGINGHAM_IMAGE_INTEGRALS_WINDOW_MAX-1)/2,
+                options.variance_window_radius);
+        return false;
+    }
+    return true;
+}
+
+// Does the work of find_chessboard_corners_from_image_array() on an image that
+// has already been scaled. T is the pixel type: uint8_t or uint16_t
+template<typename T>
 static
-int _find_or_refine_chessboard_corners_from_image_array ( // out
-                                                          std::vector<mrgingham::PointInt>* points_scaled_out,
+bool find_chessboard_corners_in_scaled_image( // out
+                                              std::vector<mrgingham::PointInt>* points_scaled_out,
+                                              std::vector<int16_t>* strengths_out,
+                                              std::vector<CornerPolarity>* polarities_out,
+                                              std::vector<CornerCovariance>* covariances_out,
 
-                                                          std::vector<mrgingham::PointDouble>* points_refinement,
-                                                          signed char*                         level_refinement,
+                                              // in
+                                              const cv::Mat* image,
 
-                                                          // in
-                                                          const cv::Mat& image_input,
+                                              // The summed-area tables of the
+                                              // image
+                                              const image_integrals_t* integrals,
 
-                                                          int image_pyramid_level,
-                                                          bool debug,
-                                                          const char* debug_image_filename)
-{
-    cv::Mat _image;
-    const cv::Mat* image = apply_image_pyramid_scaling(_image,
-                                                       image_input, image_pyramid_level,
-                                                       debug);
-    if( image == NULL ) return 0;
+                                              // How many bits to shift the
+                                              // pixel values right to bring
+                                              // them to the 8-bit range
+                                              int image_shift,
 
+                                              int image_pyramid_level,
+                                              bool debug,
+                                              const char* debug_image_filename,
+                                              const mrgingham::options_t& options,
+                                              chessboard_corners_buffers_t* buffers,
+                                              const std::atomic<bool>* cancel)
+{
     const int w = image->cols;
     const int h = image->rows;
 
-    // I don't NEED to zero this out, but it makes the debugging easier.
-    // Otherwise the edges will contain uninitialized garbage, and the actual
-    // data will be hard to see in the debug images
-    cv::Mat response = cv::Mat::zeros( cv::Size(w, h), CV_16S );
+    if(cancel != NULL && cancel->load())
+        return false;
 
-    uint8_t* imageData    = image->data;
-    int16_t* responseData = (int16_t*)response.data;
+    // The streaming search never has the response of the whole image, so it
+    // can't write the debug images. With debug, I always do the full search
+    if(options.streaming && !debug)
+    {
+        const variance_window_t<T> variance_window =
+            { (const T*)image->data, (int)(image->step / sizeof(T)), image_shift,
+              options.variance_window_radius,
+              integrals, 0, 0 };
+        return
+            find_chessboard_corners_streaming(w, h,
+                                              (const T*)image->data,
+                                              (int)(image->step / sizeof(T)),
+                                              image_shift,
+                                              &variance_window,
+                                              points_scaled_out, strengths_out, polarities_out, covariances_out,
+                                              buffers,
+                                              image_pyramid_level) > 0;
+    }
 
-    mrgingham_ChESS_response_5( responseData, imageData, w, h, w );
+    buffers->response.resize(w*h);
+    cv::Mat response( h, w, CV_16S, buffers->response.data() );
+
+    // The image may be a sub-region of a larger buffer, or it may have padded
+    // rows, so I index it with its stride (in pixels). The response is always
+    // dense
+    const T*       imageData    = (const T*)image->data;
+    const int      image_stride = (int)(image->step / sizeof(T));
+    int16_t*       responseData = buffers->response.data();
+
+    // The border of the response isn't computed by ChESS. The connected
+    // component search looks at the response near the edges, so I zero out the
+    // border explicitly. The rest of the response is overwritten
+    zero_response_border(responseData, w, h);
+
+    const int Nthreads = get_Nthreads(options);
 
     if(debug)
     {
+        // The fused kernel below clamps the response, so to see the raw
+        // response I compute it separately here
+        compute_ChESS_response( responseData, NULL, imageData, w, h, image_stride, image_shift, Nthreads );
+
         cv::Mat out;
         cv::normalize(response, out, 0, 255, cv::NORM_MINMAX);
         char filename[256];
-        sprintf(filename, CHESS_RESPONSE_FILENAME,
-                (points_refinement==NULL) ? "" : "-refinement",
-                image_pyramid_level);
+        sprintf(filename, CHESS_RESPONSE_FILENAME, "", image_pyramid_level);
         cv::imwrite(filename, out);
         fprintf(stderr, "Wrote a normalized ChESS response to %s\n", filename);
     }
 
-    // I set all responses <0 to "0". These are not valid as candidates, and
-    // I'll use "0" to mean "visited" in the upcoming connectivity search
-    for( int xy = 0; xy < w*h; xy++ )
-        if(responseData[xy] < 0)
-            responseData[xy] = 0;
+    // I compute the response, and I set all responses <0 to "0". These are not
+    // valid as candidates, and I'll use "0" to mean "visited" in the upcoming
+    // connectivity search. At the same time I mark all the pixels that could
+    // seed a connected component in a bitmask, so that I don't need to scan the
+    // whole response later. The ChESS kernel only writes the mask rows that
+    // have a valid response, so I zero out the rest here
+    const int Nmask_words = MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w);
+    buffers->mask.resize(Nmask_words*h);
+    if(h <= 2*7)
+        memset(buffers->mask.data(), 0, Nmask_words*h*sizeof(uint64_t));
+    else
+    {
+        memset(&buffers->mask[0],                 0, Nmask_words*7*sizeof(uint64_t));
+        memset(&buffers->mask[Nmask_words*(h-7)], 0, Nmask_words*7*sizeof(uint64_t));
+    }
+    compute_ChESS_response( responseData, buffers->mask.data(), imageData, w, h, image_stride, image_shift, Nthreads,
+                            cancel );
+    if(cancel != NULL && cancel->load())
+        return false;
 
     if(debug)
     {
         cv::Mat out;
         cv::normalize(response, out, 0, 255, cv::NORM_MINMAX);
         char filename[256];
-        sprintf(filename, CHESS_RESPONSE_POSITIVE_FILENAME,
-                (points_refinement==NULL) ? "" : "-refinement",
-                image_pyramid_level);
+        sprintf(filename, CHESS_RESPONSE_POSITIVE_FILENAME, "", image_pyramid_level);
         cv::imwrite(filename, out);
         fprintf(stderr, "Wrote positive-only, normalized ChESS response to %s\n", filename);
     }
@@ -548,11 +1465,15 @@ int _find_or_refine_chessboard_corners_from_image_array ( // out
 
     // This serves both to throw away duplicate nearby points at the same corner
     // and to provide sub-pixel-interpolation for the corner location
+    const variance_window_t<T> variance_window =
+        { imageData, image_stride, image_shift,
+          options.variance_window_radius,
+          integrals, 0, 0 };
     return
-        process_connected_components(w, h, responseData,
-                                     (uint8_t*)image->data,
-                                     points_scaled_out,
-                                     points_refinement, level_refinement,
+        process_connected_components(w, h, responseData, buffers->mask.data(),
+                                     &variance_window,
+                                     points_scaled_out, strengths_out, polarities_out, covariances_out,
+                                     buffers,
                                      debug, debug_image_filename,
                                      image_pyramid_level,
 
@@ -561,7 +1482,82 @@ int _find_or_refine_chessboard_corners_from_image_array ( // out
                                      // of the ChESS implementation. Anything that
                                      // needs to touch pixels in this 7-pixel-wide
                                      // ring is invalid
-                                     7);
+                                     7,
+
+                                     Nthreads) > 0;
+}
+
+__attribute__((visibility("default")))
+bool find_chessboard_corners_from_image_array( // out
+
+                                              // integers scaled up by
+                                              // FIND_GRID_SCALE to get more
+                                              // resolution
+                                              std::vector<mrgingham::PointInt>* points_scaled_out,
+
+                                              // in
+                                              image_pyramid_t* pyramid,
+
+                                              // set to 0 to just use the image
+                                              int image_pyramid_level,
+                                              bool debug,
+                                              const char* debug_image_filename,
+                                              const mrgingham::options_t& options,
+                                              chessboard_corners_buffers_t* buffers,
+
+                                              // out
+                                              std::vector<int16_t>* strengths_out,
+                                              std::vector<CornerPolarity>* polarities_out,
+                                              std::vector<CornerCovariance>* covariances_out,
+
+                                              // in
+                                              const std::atomic<bool>* cancel)
+{
+    const cv::Mat* image = apply_image_pyramid_scaling(pyramid, image_pyramid_level,
+                                                       debug);
+    if( image == NULL ) return false;
+
+    int image_shift;
+    if( !get_image_shift(&image_shift, *image, options) )
+        return false;
+    if( !variance_window_radius_is_valid(options) )
+        return false;
+
+    // Each candidate corner needs a variance check. With the summed-area
+    // tables each of those is O(1), no matter how big the window is. The
+    // tables are kept in the pyramid, so I compute them at most once per level.
+    // The tables are as big as the image, so the streaming search doesn't use
+    // them: it sums each window directly
+    const image_integrals_t* integrals = NULL;
+    if( !options.streaming )
+    {
+        integrals = pyramid->get_integrals(image_pyramid_level);
+        if( integrals == NULL ) return false;
+    }
+
+    // If the caller didn't give me any buffers, I make my own
+    chessboard_corners_buffers_t* buffers_local = NULL;
+    if( buffers == NULL )
+        buffers = buffers_local = chessboard_corners_buffers_alloc();
+
+    bool result;
+    if( image->type() == CV_8U )
+        result =
+            find_chessboard_corners_in_scaled_image<uint8_t>(points_scaled_out, strengths_out, polarities_out, covariances_out,
+                                                             image, integrals, image_shift,
+                                                             image_pyramid_level,
+                                                             debug, debug_image_filename,
+                                                             options, buffers, cancel);
+    else
+        result =
+            find_chessboard_corners_in_scaled_image<uint16_t>(points_scaled_out, strengths_out, polarities_out, covariances_out,
+                                                              image, integrals, image_shift,
+                                                              image_pyramid_level,
+                                                              debug, debug_image_filename,
+                                                              options, buffers, cancel);
+
+    chessboard_corners_buffers_free(buffers_local);
+    return result;
 }
 
 __attribute__((visibility("default")))
@@ -578,12 +1574,230 @@ bool find_chessboard_corners_from_image_array( // out
                                               // set to 0 to just use the image
                                               int image_pyramid_level,
                                               bool debug,
-                                              const char* debug_image_filename)
+                                              const char* debug_image_filename,
+                                              const mrgingham::options_t& options)
 {
-    return
-        _find_or_refine_chessboard_corners_from_image_array(points_scaled_out, NULL, NULL,
-                                                            image_input, image_pyramid_level,
-                                                            debug, debug_image_filename) > 0;
+    image_pyramid_t pyramid(image_input, get_Nthreads(options));
+    return find_chessboard_corners_from_image_array(points_scaled_out,
+                                                    &pyramid, image_pyramid_level,
+                                                    debug, debug_image_filename,
+                                                    options);
+}
+
+
+// The refinement looks at a small window around each point, at the pyramid
+// level being refined. These are (2R+1)x(2R+1) pixels in size, where R starts
+// at REFINEMENT_WINDOW_R. This must be large-enough to contain the connected
+// component, the 7-pixel ChESS margin and the variance window. If it's not,
+// I double R, and try again. Unless the window is already cut off by the edge
+// of the image on the side that doesn't fit: then a bigger window can't help
+#define REFINEMENT_WINDOW_R 20
+
+// Refines a single point at the given pyramid level. I only look at a window
+// around the point, cut out of the image at that level of the pyramid. Since
+// each point gets its own window, refining one point has no effect on any
+// other.
+//
+// Within the window I do exactly what the full-image search would do: the
+// ChESS response of a pixel depends only on the pixels within 7 of it. So as
+// long as the connected component and the variance window fit into the
+// refinement window, I get the same result as I would from processing the
+// whole image at this level
+template<typename T>
+static bool refine_point_in_window(// in/out
+                                   PointDouble* pt_full,
+
+                                   // out. The covariance of the refined
+                                   // point. May be NULL
+                                   CornerCovariance* covariance,
+
+                                   // buffers
+                                   chessboard_corners_buffers_t* buffers,
+
+                                   // in
+                                   const cv::Mat& image,
+
+                                   // The summed-area tables of the image, or
+                                   // NULL if they're not available
+                                   const image_integrals_t* integrals,
+                                   int image_shift,
+                                   int variance_window_radius,
+                                   int image_pyramid_level)
+{
+    const int margin      = 7;
+    const int coord_scale = 1 << image_pyramid_level;
+
+    // The size of the whole image at this level
+    const int W = image.cols;
+    const int H = image.rows;
+
+    // The point pt indexes the full-size image, while the connected-component
+    // stuff looks at a downsampled image. I convert
+    PointDouble pt_downsampled = scale_image_coord(pt_full, 1.0 / coord_scale);
+
+    int x = (int)(pt_downsampled.x + 0.5);
+    int y = (int)(pt_downsampled.y + 0.5);
+
+    for(int R = REFINEMENT_WINDOW_R; ; R *= 2)
+    {
+        // The window, in the coordinates of the image at this level
+        const int x0 = std::max(x - R,     0);
+        const int y0 = std::max(y - R,     0);
+        const int x1 = std::min(x + R + 1, W);
+        const int y1 = std::min(y + R + 1, H);
+        if(x0 >= x1 || y0 >= y1)
+            return false;
+
+        // The sides of the window that are the edges of the image. Making the
+        // window bigger doesn't move these
+        const int image_edges =
+            (x0 == 0 ? MARGIN_LEFT   : 0) |
+            (x1 == W ? MARGIN_RIGHT  : 0) |
+            (y0 == 0 ? MARGIN_TOP    : 0) |
+            (y1 == H ? MARGIN_BOTTOM : 0);
+
+        // This is a view into the pyramid; nothing is copied
+        const cv::Mat window(image, cv::Rect(x0, y0, x1-x0, y1-y0));
+
+        const int w = window.cols;
+        const int h = window.rows;
+        const T*  windowData    = (const T*)window.data;
+        const int window_stride = (int)(window.step / sizeof(T));
+
+        buffers->response.resize(w*h);
+        buffers->mask    .resize(MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w)*h);
+        int16_t* d = buffers->response.data();
+
+        zero_response_border(d, w, h);
+        ChESS_response( d, buffers->mask.data(), windowData, w, h, window_stride, image_shift );
+
+        // I seed my refinement from the 3x3 neighborhood around the previous
+        // center point. It is possible for the ChESS response right in the
+        // center to be invalid, and I'll then not be able to refine the point
+        // at all
+        struct xylist_t* l = &buffers->l;
+        xylist_reset(l);
+        for(int dx = -1; dx<=1; dx++)
+            for(int dy = -1; dy<=1; dy++)
+                if( is_valid(x-x0+dx,y-y0+dy,w,h,d, NULL))
+                    xylist_push(l,x-x0+dx,y-y0+dy);
+
+        connected_component_t c = {};
+        int touched_margin = trace_connected_component(&c, l, w,h,d, margin);
+        if(c.N == 0)
+            return false;
+
+        // The sides where the component ran into the edge of the window, or
+        // where the variance window around its peak doesn't fit
+        const int Rv = variance_window_radius;
+        int sides_too_small = touched_margin;
+        if(c.x_peak <  Rv    ) sides_too_small |= MARGIN_LEFT;
+        if(c.x_peak + Rv >= w) sides_too_small |= MARGIN_RIGHT;
+        if(c.y_peak <  Rv    ) sides_too_small |= MARGIN_TOP;
+        if(c.y_peak + Rv >= h) sides_too_small |= MARGIN_BOTTOM;
+        if(sides_too_small)
+        {
+            // If this happened at the edge of the image, the full-image search
+            // would throw out this point too, and a bigger window wouldn't
+            // change that. Otherwise the window was too small, and I try again
+            // with a bigger one
+            if(sides_too_small & image_edges)
+                return false;
+            continue;
+        }
+
+        const variance_window_t<T> variance_window =
+            { windowData, window_stride, image_shift, Rv,
+              integrals, x0, y0 };
+        if( !connected_component_is_valid(&c, w,h, &variance_window) )
+            return false;
+
+        // I shift the sums back to the coordinates of the whole image before
+        // dividing, to get bit-identical results to the whole-image search
+        PointDouble pt( (double)(c.sum_w_x + (uint64_t)x0*c.sum_w) / (double)c.sum_w,
+                        (double)(c.sum_w_y + (uint64_t)y0*c.sum_w) / (double)c.sum_w );
+        *pt_full = scale_image_coord(&pt, (double)coord_scale);
+        if(covariance != NULL)
+            *covariance = component_covariance(&c, (double)coord_scale);
+        return true;
+    }
+}
+
+// Each point is refined independently: it gets its own window, and its own
+// output slot. So I split the points among Nthreads workers, each with its own
+// scratch buffers. When debugging, I stay serial, to write the dump in order
+template<typename T>
+static int refine_chessboard_corners_in_windows( // out/in
+                                                 std::vector<mrgingham::PointDouble>* points,
+                                                 signed char* level,
+                                                 std::vector<CornerCovariance>* covariances,
+
+                                                 // in
+                                                 const cv::Mat& image,
+                                                 const image_integrals_t* integrals,
+                                                 int image_shift,
+                                                 int variance_window_radius,
+                                                 int image_pyramid_level,
+                                                 bool debug,
+                                                 const char* debug_image_filename,
+                                                 int Nthreads,
+                                                 chessboard_corners_buffers_t* buffers)
+{
+    FILE* debugfp = NULL;
+    char  debug_filename[256];
+    if(debug)
+        debugfp = open_corner_dump(debug_filename, sizeof(debug_filename),
+                                   true, image_pyramid_level,
+                                   debug_image_filename);
+
+    const int Npoints = (int)points->size();
+
+    // Each worker should get enough points for the threading overhead to not
+    // matter
+    int Nworkers = Nthreads;
+    if(Nworkers > Npoints / 8) Nworkers = Npoints / 8;
+    if(Nworkers < 1 || debug)  Nworkers = 1;
+
+    while((int)buffers->refinement_workers.size() < Nworkers-1)
+        buffers->refinement_workers.push_back(chessboard_corners_buffers_alloc());
+
+    std::atomic<int> N(0);
+    parallel_for(Nworkers, Nthreads,
+                 [&](int iworker)
+                 {
+                     chessboard_corners_buffers_t* worker_buffers =
+                         iworker == 0 ? buffers : buffers->refinement_workers[iworker-1];
+
+                     int Nrefined = 0;
+                     int i0 = Npoints *  iworker    / Nworkers;
+                     int i1 = Npoints * (iworker+1) / Nworkers;
+                     for(int i=i0; i<i1; i++)
+                     {
+                         // I can only refine the current estimate if it was
+                         // computed at one level higher than what I'm at now
+                         if( level[i] != image_pyramid_level+1 )
+                             continue;
+
+                         if(refine_point_in_window<T>(&(*points)[i],
+                                                      covariances == NULL ? NULL : &(*covariances)[i],
+                                                      worker_buffers,
+                                                      image, integrals, image_shift,
+                                                      variance_window_radius,
+                                                      image_pyramid_level))
+                         {
+                             if( debugfp )
+                                 fprintf(debugfp, "%f %f\n", (*points)[i].x, (*points)[i].y);
+                             level[i] = image_pyramid_level;
+                             Nrefined++;
+                         }
+                     }
+                     N += Nrefined;
+                 });
+
+    if(debug)
+        close_corner_dump(debugfp, debug_filename);
+
+    return N;
 }
 
 // Returns how many points were refined
@@ -604,18 +1818,84 @@ int refine_chessboard_corners_from_image_array( // out/int
                                                 // point, I update level[ipoint]
                                                 signed char* level,
 
+                                                // in
+                                                image_pyramid_t* pyramid,
+
+                                                int image_pyramid_level,
+                                                bool debug,
+                                                const char* debug_image_filename,
+                                                const mrgingham::options_t& options,
+                                                chessboard_corners_buffers_t* buffers,
+
+                                                // out. If non-NULL, this has
+                                                // the covariance of each point.
+                                                // I update it for each point I
+                                                // refine
+                                                std::vector<CornerCovariance>* covariances)
+{
+    const cv::Mat* image = pyramid->get(image_pyramid_level);
+    if( image == NULL )
+        return 0;
+
+    int image_shift;
+    if( !get_image_shift(&image_shift, *image, options) )
+        return 0;
+    if( !variance_window_radius_is_valid(options) )
+        return 0;
+
+    // I only look at a few small windows here, so computing the summed-area
+    // tables of the whole image isn't worth it. But if the search already
+    // computed them for this level, I use them
+    const image_integrals_t* integrals =
+        pyramid->get_integrals_if_available(image_pyramid_level);
+
+    // If the caller didn't give me any buffers, I make my own
+    chessboard_corners_buffers_t* buffers_local = NULL;
+    if( buffers == NULL )
+        buffers = buffers_local = chessboard_corners_buffers_alloc();
+
+    int N;
+    if( image->type() == CV_8U )
+        N =
+            refine_chessboard_corners_in_windows<uint8_t>( points, level, covariances,
+                                                           *image, integrals, image_shift,
+                                                           options.variance_window_radius,
+                                                           image_pyramid_level,
+                                                           debug, debug_image_filename,
+                                                           get_Nthreads(options),
+                                                           buffers);
+    else
+        N =
+            refine_chessboard_corners_in_windows<uint16_t>( points, level, covariances,
+                                                            *image, integrals, image_shift,
+                                                            options.variance_window_radius,
+                                                            image_pyramid_level,
+                                                            debug, debug_image_filename,
+                                                            get_Nthreads(options),
+                                                            buffers);
+
+    chessboard_corners_buffers_free(buffers_local);
+    return N;
+}
+
+__attribute__((visibility("default")))
+int refine_chessboard_corners_from_image_array( // out/int
+                                                std::vector<mrgingham::PointDouble>* points,
+                                                signed char* level,
+
                                                 // in
                                                 const cv::Mat& image_input,
 
                                                 int image_pyramid_level,
                                                 bool debug,
-                                                const char* debug_image_filename)
+                                                const char* debug_image_filename,
+                                                const mrgingham::options_t& options)
 {
-    return
-        _find_or_refine_chessboard_corners_from_image_array( NULL,
-                                                             points, level,
-                                                             image_input, image_pyramid_level,
-                                                             debug, debug_image_filename);
+    image_pyramid_t pyramid(image_input, get_Nthreads(options));
+    return refine_chessboard_corners_from_image_array(points, level,
+                                                      &pyramid, image_pyramid_level,
+                                                      debug, debug_image_filename,
+                                                      options);
 }
 
 
@@ -632,7 +1912,8 @@ bool find_chessboard_corners_from_image_file( // out
 
                                               // set to 0 to just use the image
                                               int image_pyramid_level,
-                                              bool debug )
+                                              bool debug,
+                                              const mrgingham::options_t& options )
 {
     cv::Mat image = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
     if( image.data == NULL )
@@ -642,7 +1923,7 @@ bool find_chessboard_corners_from_image_file( // out
         return false;
     }
 
-    return find_chessboard_corners_from_image_array( points, image, image_pyramid_level, debug, filename );
+    return find_chessboard_corners_from_image_array( points, image, image_pyramid_level, debug, filename, options );
 }
 
 }
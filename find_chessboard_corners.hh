@@ -1,14 +1,20 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
 #include <opencv2/core/core.hpp>
 #include "point.hh"
+#include "mrgingham.hh"
+#include "image_pyramid.hh"
 
 
 namespace mrgingham
 {
 
 // these all output the points scaled by FIND_GRID_SCALE in points[].
+//
+// The images are indexed with their stride (image.step), so they don't need to
+// be continuous: a sub-region of a larger image is processed without a copy
 bool find_chessboard_corners_from_image_array( // out
 
                                                // integers scaled up by
@@ -27,7 +33,8 @@ bool find_chessboard_corners_from_image_array( // out
                                                // is cut down by a factor of 4
                                                int image_pyramid_level,
                                                bool debug = false,
-                                               const char* debug_image_filename = NULL);
+                                               const char* debug_image_filename = NULL,
+                                               const mrgingham::options_t& options = mrgingham::options_t());
 
 bool find_chessboard_corners_from_image_file( // out
 
@@ -46,8 +53,13 @@ bool find_chessboard_corners_from_image_file( // out
                                               // level==2 means each dimension
                                               // is cut down by a factor of 4
                                               int image_pyramid_level,
-                                              bool debug = false);
+                                              bool debug = false,
+                                              const mrgingham::options_t& options = mrgingham::options_t());
 
+// Refines the given points by re-detecting them at a finer pyramid level. Only
+// a small window around each point is searched, so the cost scales with the
+// number of points, not with the size of the image. Each point is refined
+// independently. Returns how many points were refined
 int refine_chessboard_corners_from_image_array( // out/int
 
                                                 // initial coordinates on input,
@@ -69,6 +81,64 @@ int refine_chessboard_corners_from_image_array( // out/int
 
                                                 int image_pyramid_level,
                                                 bool debug = false,
-                                                const char* debug_image_filename = NULL);
+                                                const char* debug_image_filename = NULL,
+                                                const mrgingham::options_t& options = mrgingham::options_t());
+
+// The working buffers of the corner finder and the refinement. A caller that
+// processes many images can allocate these once, and pass them to each call
+// below, to avoid allocating them every time. Each set of buffers may only be
+// used by one thread at a time
+struct chessboard_corners_buffers_t;
+chessboard_corners_buffers_t* chessboard_corners_buffers_alloc(void);
+void chessboard_corners_buffers_free(chessboard_corners_buffers_t* buffers);
+
+// These take the image as an image pyramid. Any levels of the pyramid that
+// have already been computed are reused, and any that are computed here stay in
+// the pyramid for the next call. This is what
+// find_chessboard_from_image_array() uses to avoid downsampling the same image
+// over and over. If buffers is NULL, I allocate my own, temporarily.
+//
+// If strengths_out is non-NULL, I append the peak ChESS response of each
+// corner to it, in the same order as the points. Similarly, if polarities_out
+// is non-NULL, I append the polarity of each corner, and if covariances_out is
+// non-NULL, I append the covariance of each corner. The refinement updates the
+// covariance of each point it refines, if covariances is non-NULL
+//
+// If cancel is non-NULL, another thread may set it to abandon the search. The
+// corner finder then returns false as soon as it notices: it checks between
+// bands of the ChESS response, and before looking for the corners in it. The
+// streaming search only checks before it starts
+bool find_chessboard_corners_from_image_array( std::vector<mrgingham::PointInt>* points_scaled_out,
+                                               image_pyramid_t* pyramid,
+                                               int image_pyramid_level,
+                                               bool debug = false,
+                                               const char* debug_image_filename = NULL,
+                                               const mrgingham::options_t& options = mrgingham::options_t(),
+                                               chessboard_corners_buffers_t* buffers = NULL,
+                                               std::vector<int16_t>* strengths_out = NULL,
+                                               std::vector<CornerPolarity>* polarities_out = NULL,
+                                               std::vector<CornerCovariance>* covariances_out = NULL,
+                                               const std::atomic<bool>* cancel = NULL);
+int refine_chessboard_corners_from_image_array( std::vector<mrgingham::PointDouble>* points,
+                                                signed char* level,
+                                                image_pyramid_t* pyramid,
+                                                int image_pyramid_level,
+                                                bool debug = false,
+                                                const char* debug_image_filename = NULL,
+                                                const mrgingham::options_t& options = mrgingham::options_t(),
+                                                chessboard_corners_buffers_t* buffers = NULL,
+                                                std::vector<CornerCovariance>* covariances = NULL);
+
+// Refines the given points by fitting a quadratic saddle to the full-resolution
+// image in a small window around each one. level[ipoint] is the pyramid level
+// the point was found at; this sets the size of the window. Each point that
+// converges has level[ipoint] set to 0. The others are left alone. The
+// full-resolution ChESS response is never computed. Returns how many points
+// were refined
+int refine_chessboard_corners_saddle( std::vector<mrgingham::PointDouble>* points,
+                                      signed char* level,
+                                      image_pyramid_t* pyramid,
+                                      bool debug = false,
+                                      const mrgingham::options_t& options = mrgingham::options_t());
 
 };
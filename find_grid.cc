@@ -1,6 +1,10 @@
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
 #include <vector>
+#include <algorithm>
 #include <boost/polygon/voronoi.hpp>
 #include <assert.h>
 #include "point.hh"
@@ -33,48 +37,101 @@ namespace boost { namespace polygon {
 typedef voronoi_diagram<double> VORONOI;
 
 
-// hard-coding 10x10 grids
-#define Nwant     10
 
+// The voronoi diagram, flattened into a graph of the points. Walking the
+// diagram itself means chasing pointers through its edges and cells, and the
+// sequence search looks at the same edges over and over. So I convert the
+// diagram once, and the search only looks at this.
+//
+// The neighbors of point i are the edges [edge_start[i], edge_start[i+1]), in
+// the order the diagram lists them. The same edges, sorted by angle, are
+// edges_by_angle[edge_start[i]..edge_start[i+1]). cell_order has the indices
+// of the points that have a voronoi cell, in the order of the cells.
+//
+// next_edge[iedge] memoizes the sequence search: it's the edge that continues a
+// sequence arriving through edge iedge, or -1 if there isn't one, or
+// NEXT_EDGE_UNKNOWN if I haven't looked yet. This only looks at the last step
+// of the sequence, see get_next_edge_along_sequence()
+#define NEXT_EDGE_UNKNOWN -2
+struct neighbor_edge_t
+{
+    // The neighboring point
+    int      i;
+
+    PointInt delta;
+    double   length;
+
+    // atan2(delta.y, delta.x), in [-pi,pi]
+    double   angle;
 
+    // Do the two points have opposite polarities? Always true if I don't know
+    // the polarities
+    bool     opposite;
+};
+struct neighbor_graph_t
+{
+    std::vector<int>             edge_start;
+    std::vector<neighbor_edge_t> edges;
+    std::vector<int>             edges_by_angle;
+    std::vector<int>             cell_order;
+    std::vector<int>             next_edge;
+};
 
-#define FOR_ALL_ADJACENT_CELLS(c) do {                                  \
-    const PointInt*        pt = &points[c->source_index()];                \
-    const VORONOI::edge_type* const e0 = c->incident_edge();            \
-    bool first = true;                                                  \
-    for(const VORONOI::edge_type* e = e0;                               \
-        e0 != NULL && (e != e0 || first);                               \
-        e = e->next(), first=false)                                     \
-    {                                                                   \
-        const VORONOI::cell_type* c_adjacent = e->twin()->cell();       \
-                                                                        \
-        const PointInt* pt_adjacent = &points[c_adjacent->source_index()]; \
-                                                                        \
-        PointInt delta( pt_adjacent->x - pt->x,                            \
-                        pt_adjacent->y - pt->y );
+// The uniform grid of cells used to find the nearest neighbors of each point
+// with NEIGHBOR_GRAPH_KNN, and the scratch space of that search
+struct spatial_hash_t
+{
+    // A copy of each point, so that a query reads contiguous memory
+    struct entry_t
+    {
+        uint32_t code;
+        int      i;
+        int      x, y;
+    };
 
-#define FOR_ALL_ADJACENT_CELLS_END() }} while(0)
+    long x0, y0, cell_size;
+    int  Ncx, Ncy;
+
+    // The points, sorted by the Morton code of their cell. The points in cell
+    // (cx,cy) are sorted[cell_first[icell]..+cell_count[icell]), with
+    // icell = cx + cy*Ncx
+    std::vector<entry_t> sorted;
+    std::vector<int>     cell_first;
+    std::vector<int>     cell_count;
+
+    // The nearest neighbors of point i that pass the Gabriel test are
+    // knn[i*KNN_K..+Nknn[i]), at the squared distances in knn_d2[]
+    std::vector<int>     knn;
+    std::vector<long>    knn_d2;
+    std::vector<int>     Nknn;
+
+    // The links of all the points, in both directions, before I sort them and
+    // drop the duplicates
+    struct link_t
+    {
+        long d2;
+        int  i;
+    };
+    std::vector<link_t>  links;
+    std::vector<int>     fill;
+};
 
 
 
 
 
 
+// The state of a sequence search, apart from the last step. The last step is
+// an edge of the neighbor graph
 struct HypothesisStatistics
 {
-    PointInt  delta_last;
-
     double length_ratio_sum;
     int    length_ratio_N;
 };
 
 static void fill_initial_hypothesis_statistics(// out
-                                               HypothesisStatistics* stats,
-
-                                               // in
-                                               const PointInt* delta0)
+                                               HypothesisStatistics* stats)
 {
-    stats->delta_last       = *delta0;
     stats->length_ratio_sum = 0.0;
     stats->length_ratio_N   = 0;
 }
@@ -82,20 +139,6 @@ static void fill_initial_hypothesis_statistics(// out
 
 
 
-#define FOR_MATCHING_ADJACENT_CELLS(debug_sequence_pointscale) do {     \
-    HypothesisStatistics stats;                                         \
-    fill_initial_hypothesis_statistics(&stats, delta);                  \
-    for(int i=0; i<N_remaining; i++)                                    \
-    {                                                                   \
-        const VORONOI::cell_type* c_adjacent = get_adjacent_cell_along_sequence(&stats, c, points, debug_sequence_pointscale);
-
-
-#define FOR_MATCHING_ADJACENT_CELLS_END() \
-        c = c_adjacent; }} while(0)
-
-
-
-
 // tight bound on angle error, loose bound on length error. This is because
 // perspective distortion can vary the lengths, but NOT the orientations
 #define THRESHOLD_SPACING_LENGTH                 (80.*FIND_GRID_SCALE)
@@ -104,175 +147,660 @@ static void fill_initial_hypothesis_statistics(// out
 #define THRESHOLD_SPACING_LENGTH_RATIO_MAX       1.4
 #define THRESHOLD_SPACING_LENGTH_RATIO_DEVIATION 0.25
 
-static const VORONOI::cell_type*
-get_adjacent_cell_along_sequence( // out,in.
-                                 HypothesisStatistics* stats,
+// The angle search looks at the neighbors within this many radians of the
+// expected direction. This is a bit wider than acos(THRESHOLD_SPACING_COS), so
+// the cosine test has the final word
+#define THRESHOLD_SPACING_ANGLE_SEARCH           (11.0 * M_PI/180.0)
 
-                                 // in
-                                 const VORONOI::cell_type* c,
-                                 const std::vector<PointInt>& points,
-                                 int debug_sequence_pointscale /* <=0 means "no debugging" */ )
+// Adjacent corners along a row or column of a chessboard have opposite
+// polarities. If I don't know the polarities, any two corners could be adjacent
+static bool polarities_are_opposite(const std::vector<CornerPolarity>* polarities,
+                                    int i0, int i1)
 {
-    // We're given a voronoi cell, and some properties that a potential next
-    // cell in the sequence should match. I look through all the voronoi
-    // neighbors of THIS cell, and return the first one that matches all my
-    // requirements. Multiple neighboring cells COULD match, but I'm assuming
-    // clean data, so this possibility is ignored.
-    //
-    // A matching next cell should have the following properties, all
-    // established by the previous cells in the sequence. The next cell should
-    // match all of these:
-    //
-    // - located along an expected direction (tight bound on angle)
-    //
-    // - should be an expected distance away (loose bound on absolute distance)
-    //
-    // - the ratio of successive distances in a sequence should be constant-ish
-    //
-    // The points in a sequence come from projections of equidistantly-spaced
-    // points in a straight line, so the projected DIRECTIONS should match very
-    // well. The distances may not, if the observed object is tilted and is
-    // relatively close to the camera, but each successive distance will vary ~
-    // geometrically due to perspective effects, or it the distances will all be
-    // roughly constant, which is still geometric, technically
+    if(polarities == NULL)
+        return true;
 
-    const PointInt& delta_last = stats->delta_last;
+    const CornerPolarity& p0 = (*polarities)[i0];
+    const CornerPolarity& p1 = (*polarities)[i1];
+    return (int64_t)p0.c*(int64_t)p1.c + (int64_t)p0.s*(int64_t)p1.s < 0;
+}
 
-    double delta_last_length = hypot((double)delta_last.x, (double)delta_last.y);
+// The topology of the graph from the voronoi diagram: two points are neighbors
+// if their cells share an edge. The geometry of each edge is filled in by
+// finish_neighbor_graph()
+static void build_neighbor_graph_voronoi( // out
+                                          neighbor_graph_t* graph,
 
-    FOR_ALL_ADJACENT_CELLS(c)
+                                          // in
+                                          const VORONOI* voronoi,
+                                          int Npoints)
+{
+    // I count the neighbors of each point, and then I fill them in
+    graph->edge_start.assign(Npoints+1, 0);
+    graph->cell_order.clear();
+    for (auto it = voronoi->cells().begin(); it != voronoi->cells().end(); it++ )
     {
-        if(debug_sequence_pointscale > 0)
-            fprintf(stderr, "Considering connection in sequence from (%d,%d) -> (%d,%d); delta (%d,%d) ..... \n",
-                    pt->x          / debug_sequence_pointscale,
-                    pt->y          / debug_sequence_pointscale,
-                    pt_adjacent->x / debug_sequence_pointscale,
-                    pt_adjacent->y / debug_sequence_pointscale,
-                    delta.x        / debug_sequence_pointscale,
-                    delta.y        / debug_sequence_pointscale);
-
-        double delta_length = hypot( (double)delta.x, (double)delta.y );
-
-        double cos_err =
-            ((double)delta_last.x * (double)delta.x +
-             (double)delta_last.y * (double)delta.y) /
-            (delta_last_length * delta_length);
-        if( cos_err < THRESHOLD_SPACING_COS )
+        const VORONOI::cell_type* c = &(*it);
+        graph->cell_order.push_back((int)c->source_index());
+
+        int Nedges = 0;
+        const VORONOI::edge_type* const e0 = c->incident_edge();
+        bool first = true;
+        for(const VORONOI::edge_type* e = e0;
+            e0 != NULL && (e != e0 || first);
+            e = e->next(), first=false)
+            Nedges++;
+        graph->edge_start[c->source_index()+1] = Nedges;
+    }
+    for(int i=0; i<Npoints; i++)
+        graph->edge_start[i+1] += graph->edge_start[i];
+
+    graph->edges.resize(graph->edge_start[Npoints]);
+    for (auto it = voronoi->cells().begin(); it != voronoi->cells().end(); it++ )
+    {
+        const VORONOI::cell_type* c = &(*it);
+
+        int iedge = graph->edge_start[c->source_index()];
+        const VORONOI::edge_type* const e0 = c->incident_edge();
+        bool first = true;
+        for(const VORONOI::edge_type* e = e0;
+            e0 != NULL && (e != e0 || first);
+            e = e->next(), first=false, iedge++)
+            graph->edges[iedge].i = (int)e->twin()->cell()->source_index();
+    }
+}
+
+// Morton code of a cell of the spatial hash: the bits of x and y, interleaved.
+// Cells that are close in the plane are mostly close in this order too
+static uint32_t morton_code(uint32_t x, uint32_t y)
+{
+    uint32_t code = 0;
+    for(int i=0; i<16; i++)
+        code |=
+            ((x >> i) & 1) << (2*i) |
+            ((y >> i) & 1) << (2*i+1);
+    return code;
+}
+
+// Puts the points into a uniform grid of cells, about KNN_POINTS_PER_CELL per
+// cell. The points are stored sorted by the Morton code of their cell, so a
+// query looking at a neighborhood of cells touches nearby memory
+#define KNN_POINTS_PER_CELL 2
+static void build_spatial_hash( // out
+                                spatial_hash_t* hash,
+
+                                // in
+                                const std::vector<PointInt>& points)
+{
+    const int Npoints = (int)points.size();
+
+    int x0 = points[0].x, x1 = points[0].x;
+    int y0 = points[0].y, y1 = points[0].y;
+    for(int i=1; i<Npoints; i++)
+    {
+        if(points[i].x < x0) x0 = points[i].x;
+        if(points[i].x > x1) x1 = points[i].x;
+        if(points[i].y < y0) y0 = points[i].y;
+        if(points[i].y > y1) y1 = points[i].y;
+    }
+
+    double area = ((double)x1 - (double)x0 + 1.) * ((double)y1 - (double)y0 + 1.);
+    long   cell_size = (long)ceil(sqrt(area * KNN_POINTS_PER_CELL / (double)Npoints));
+    if(cell_size < 1) cell_size = 1;
+
+    // The Morton codes have 16 bits per axis
+    while( ((long)x1 - (long)x0) / cell_size >= (1L << 16) ||
+           ((long)y1 - (long)y0) / cell_size >= (1L << 16) )
+        cell_size *= 2;
+
+    hash->x0        = x0;
+    hash->y0        = y0;
+    hash->cell_size = cell_size;
+    hash->Ncx       = (int)(((long)x1 - (long)x0) / cell_size) + 1;
+    hash->Ncy       = (int)(((long)y1 - (long)y0) / cell_size) + 1;
+
+    hash->sorted.resize(Npoints);
+    for(int i=0; i<Npoints; i++)
+    {
+        int cx = (int)(((long)points[i].x - (long)x0) / cell_size);
+        int cy = (int)(((long)points[i].y - (long)y0) / cell_size);
+        hash->sorted[i] = spatial_hash_t::entry_t({ morton_code(cx, cy), i,
+                                                    points[i].x, points[i].y });
+    }
+    std::sort(hash->sorted.begin(), hash->sorted.end(),
+              [](const spatial_hash_t::entry_t& a, const spatial_hash_t::entry_t& b)
+              {
+                  if(a.code != b.code) return a.code < b.code;
+                  return a.i < b.i;
+              });
+
+    // Each cell's points are contiguous in the sorted list
+    const int Ncells = hash->Ncx * hash->Ncy;
+    hash->cell_first.resize(Ncells);
+    hash->cell_count.assign(Ncells, 0);
+    for(int k=0; k<Npoints; k++)
+    {
+        int cx = (int)(((long)hash->sorted[k].x - (long)x0) / cell_size);
+        int cy = (int)(((long)hash->sorted[k].y - (long)y0) / cell_size);
+        int icell = cx + cy*hash->Ncx;
+        if(hash->cell_count[icell] == 0)
+            hash->cell_first[icell] = k;
+        hash->cell_count[icell]++;
+    }
+}
+
+// The topology of the graph from the KNN_K nearest neighbors of each point.
+// Points at the same spot aren't neighbors.
+//
+// A sequence must not jump over a point: the voronoi diagram never links two
+// points with another one between them, and a board in clutter relies on that.
+// So I only keep the links that pass the Gabriel test: no other point may lie
+// inside the circle whose diameter is the link. Every point inside that circle
+// is closer than the far end of the link, so it's among the nearest neighbors
+// I already have, and the test is exact. These links are a subset of the
+// voronoi links, and for a grid seen in perspective they're the rows, the
+// columns and maybe a diagonal, just like the voronoi links.
+//
+// The relation is made symmetric: a point is linked to another if either is
+// among the nearest neighbors of the other, and the link passes the test. The
+// neighbors of each point are listed nearest-first. finish_neighbor_graph()
+// fills in the geometry of each edge
+#define KNN_K 8
+static void build_neighbor_graph_knn( // out
+                                      neighbor_graph_t* graph,
+
+                                      // buffers
+                                      spatial_hash_t* hash,
+
+                                      // in
+                                      const std::vector<PointInt>& points)
+{
+    const int Npoints = (int)points.size();
+
+    graph->edge_start.assign(Npoints+1, 0);
+    graph->cell_order.clear();
+    graph->edges.clear();
+    if(Npoints == 0)
+        return;
+
+    build_spatial_hash(hash, points);
+
+    // I find the nearest neighbors of each point, in the Morton order
+    hash->knn   .resize((size_t)Npoints * KNN_K);
+    hash->knn_d2.resize((size_t)Npoints * KNN_K);
+    hash->Nknn  .resize(Npoints);
+    for(int k=0; k<Npoints; k++)
+    {
+        const int       i0 = hash->sorted[k].i;
+        const PointInt& pt = points[i0];
+        graph->cell_order.push_back(i0);
+
+        // best[] is sorted nearest-first. Ties go to the lower index, so the
+        // result doesn't depend on the order I visit the cells
+        int   best   [KNN_K];
+        long  best_d2[KNN_K];
+        long  best_dx[KNN_K];
+        long  best_dy[KNN_K];
+        int   Nbest = 0;
+
+        const int cx = (int)(((long)pt.x - hash->x0) / hash->cell_size);
+        const int cy = (int)(((long)pt.y - hash->y0) / hash->cell_size);
+
+        // I look at rings of cells around the point's cell, until the
+        // remaining points are all further than my KNN_K-th neighbor
+        for(int r=0;; r++)
         {
-            if(debug_sequence_pointscale > 0)
-                fprintf(stderr, "..... rejecting. Angle is wrong. I wanted cos_err>=threshold, but saw %f<%f\n",
-                        cos_err, THRESHOLD_SPACING_COS);
-            continue;
+            for(int y = cy-r; y <= cy+r; y++)
+            {
+                if(y < 0 || y >= hash->Ncy) continue;
+                const bool edge_row = (y == cy-r || y == cy+r);
+                for(int x = cx-r; x <= cx+r; x += (edge_row || r == 0) ? 1 : 2*r)
+                {
+                    if(x < 0 || x >= hash->Ncx) continue;
+
+                    const int icell = x + y*hash->Ncx;
+                    const spatial_hash_t::entry_t* e = &hash->sorted[hash->cell_first[icell]];
+                    for(int j=0; j<hash->cell_count[icell]; j++)
+                    {
+                        const int  i1 = e[j].i;
+                        const long dx = (long)e[j].x - (long)pt.x;
+                        const long dy = (long)e[j].y - (long)pt.y;
+                        const long d2 = dx*dx + dy*dy;
+                        if(d2 == 0)
+                            continue;
+                        if(Nbest == KNN_K &&
+                           (d2 > best_d2[KNN_K-1] ||
+                            (d2 == best_d2[KNN_K-1] && i1 > best[KNN_K-1])))
+                            continue;
+
+                        int ins = (Nbest < KNN_K) ? Nbest++ : KNN_K-1;
+                        while(ins > 0 &&
+                              (best_d2[ins-1] > d2 ||
+                               (best_d2[ins-1] == d2 && best[ins-1] > i1)))
+                        {
+                            best_d2[ins] = best_d2[ins-1];
+                            best_dx[ins] = best_dx[ins-1];
+                            best_dy[ins] = best_dy[ins-1];
+                            best   [ins] = best   [ins-1];
+                            ins--;
+                        }
+                        best_d2[ins] = d2;
+                        best_dx[ins] = dx;
+                        best_dy[ins] = dy;
+                        best   [ins] = i1;
+                    }
+                }
+            }
+
+            // The distance to the nearest side of the searched square. There
+            // are no points past the sides at the edges of the grid
+            long reach = LONG_MAX;
+            if(cx-r > 0)
+                reach = std::min(reach, (long)pt.x - (hash->x0 + (long)(cx-r)  *hash->cell_size));
+            if(cx+r < hash->Ncx-1)
+                reach = std::min(reach, hash->x0 + (long)(cx+r+1)*hash->cell_size - (long)pt.x);
+            if(cy-r > 0)
+                reach = std::min(reach, (long)pt.y - (hash->y0 + (long)(cy-r)  *hash->cell_size));
+            if(cy+r < hash->Ncy-1)
+                reach = std::min(reach, hash->y0 + (long)(cy+r+1)*hash->cell_size - (long)pt.y);
+            if(reach == LONG_MAX)
+                break;
+            if(Nbest == KNN_K && best_d2[KNN_K-1] <= reach*reach)
+                break;
         }
 
-        double length_err = delta_last_length - delta_length;
-        if( length_err < -THRESHOLD_SPACING_LENGTH ||
-            length_err >  THRESHOLD_SPACING_LENGTH )
+        // The Gabriel test. Only the closer neighbors can be inside the circle.
+        // Neighbor m is inside the circle if it sees the two ends of the link
+        // at an obtuse angle: if (pt-ptm).(pt1-ptm) < 0. Relative to pt, that's
+        // dm.d1 > |dm|^2
+        int*  knn   = &hash->knn   [(size_t)i0 * KNN_K];
+        long* knn_d2 = &hash->knn_d2[(size_t)i0 * KNN_K];
+        int   Nkept = 0;
+        for(int j=0; j<Nbest; j++)
         {
-            if(debug_sequence_pointscale > 0)
-                fprintf(stderr, "..... rejecting. Lengths are wrong. I wanted abs(length_err)<=threshold, but saw %f>%f\n",
-                        fabs(length_err), THRESHOLD_SPACING_LENGTH);
-            continue;
+            bool blocked = false;
+            for(int m=0; m<j && !blocked; m++)
+                blocked =
+                    best_dx[m]*best_dx[j] + best_dy[m]*best_dy[j] > best_d2[m];
+            if(!blocked)
+            {
+                knn   [Nkept] = best   [j];
+                knn_d2[Nkept] = best_d2[j];
+                Nkept++;
+            }
         }
+        hash->Nknn[i0] = Nkept;
+    }
 
-        double length_ratio = delta_length / delta_last_length;
-        if( length_ratio < THRESHOLD_SPACING_LENGTH_RATIO_MIN ||
-            length_ratio > THRESHOLD_SPACING_LENGTH_RATIO_MAX )
+    // Each nearest-neighbor relation links both points. I count, fill in, and
+    // then sort each point's list, dropping the duplicates
+    for(int i0=0; i0<Npoints; i0++)
+        for(int j=0; j<hash->Nknn[i0]; j++)
         {
-            if(debug_sequence_pointscale > 0)
-                fprintf(stderr, "..... rejecting. Lengths are wrong. I wanted abs(length_ratio)<=threshold, but saw %f<%f or %f>%f\n",
-                        length_ratio, THRESHOLD_SPACING_LENGTH_RATIO_MIN,
-                        length_ratio, THRESHOLD_SPACING_LENGTH_RATIO_MAX);
-            continue;
+            graph->edge_start[i0+1]++;
+            graph->edge_start[hash->knn[(size_t)i0*KNN_K + j] + 1]++;
         }
+    for(int i=0; i<Npoints; i++)
+        graph->edge_start[i+1] += graph->edge_start[i];
 
-        // I compute the mean and look at the deviation from the CURRENT mean. I
-        // ignore the first few points, since the mean is unstable then. This is
-        // OK, however, since I'm going to find and analyze the same sequence in
-        // the reverse order, and this will cover the other end
-        if( stats->length_ratio_N > 2 )
+    hash->links.resize(graph->edge_start[Npoints]);
+    hash->fill.assign(graph->edge_start.begin(), graph->edge_start.end()-1);
+    for(int i0=0; i0<Npoints; i0++)
+        for(int j=0; j<hash->Nknn[i0]; j++)
         {
-            double length_ratio_mean = stats->length_ratio_sum / (double)stats->length_ratio_N;
+            const int  i1 = hash->knn   [(size_t)i0*KNN_K + j];
+            const long d2 = hash->knn_d2[(size_t)i0*KNN_K + j];
+            hash->links[hash->fill[i0]++] = spatial_hash_t::link_t({ d2, i1 });
+            hash->links[hash->fill[i1]++] = spatial_hash_t::link_t({ d2, i0 });
+        }
 
-            double length_ratio_deviation = length_ratio - length_ratio_mean;
-            if( length_ratio_deviation < -THRESHOLD_SPACING_LENGTH_RATIO_DEVIATION ||
-                length_ratio_deviation >  THRESHOLD_SPACING_LENGTH_RATIO_DEVIATION )
-            {
-                if(debug_sequence_pointscale > 0)
-                    fprintf(stderr, "..... rejecting. Lengths are wrong. I wanted abs(length_ratio_deviation)<=threshold, but saw %f>%f\n",
-                            fabs(length_ratio_deviation), THRESHOLD_SPACING_LENGTH_RATIO_DEVIATION);
-                continue;
-            }
+    graph->edges.resize(graph->edge_start[Npoints]);
+    int iedge_out = 0;
+    for(int i0=0; i0<Npoints; i0++)
+    {
+        spatial_hash_t::link_t* l0 = &hash->links[graph->edge_start[i0]];
+        spatial_hash_t::link_t* l1 = &hash->links[graph->edge_start[i0+1]];
+        std::sort(l0, l1,
+                  [](const spatial_hash_t::link_t& a, const spatial_hash_t::link_t& b)
+                  {
+                      if(a.d2 != b.d2) return a.d2 < b.d2;
+                      return a.i < b.i;
+                  });
+
+        graph->edge_start[i0] = iedge_out;
+        for(spatial_hash_t::link_t* l = l0; l < l1; l++)
+            if(l == l0 || l->i != l[-1].i)
+                graph->edges[iedge_out++].i = l->i;
+    }
+    graph->edge_start[Npoints] = iedge_out;
+    graph->edges.resize(iedge_out);
+}
+
+// Fills in the geometry of each edge, and sorts the edges of each point by
+// angle
+static void finish_neighbor_graph( // out
+                                   neighbor_graph_t* graph,
+
+                                   // in
+                                   const std::vector<PointInt>& points,
+                                   const std::vector<CornerPolarity>* polarities)
+{
+    const int Npoints = (int)points.size();
+
+    graph->edges_by_angle.resize(graph->edges.size());
+    graph->next_edge.assign(graph->edges.size(), NEXT_EDGE_UNKNOWN);
+    for(int i0=0; i0<Npoints; i0++)
+    {
+        const PointInt* pt = &points[i0];
+        for(int iedge = graph->edge_start[i0]; iedge < graph->edge_start[i0+1]; iedge++)
+        {
+            neighbor_edge_t* edge        = &graph->edges[iedge];
+            const PointInt*  pt_adjacent = &points[edge->i];
+
+            edge->delta    = PointInt( pt_adjacent->x - pt->x,
+                                       pt_adjacent->y - pt->y );
+            edge->length   = hypot( (double)edge->delta.x, (double)edge->delta.y );
+            edge->angle    = atan2( (double)edge->delta.y, (double)edge->delta.x );
+            edge->opposite = polarities_are_opposite(polarities, i0, edge->i);
+            graph->edges_by_angle[iedge] = iedge;
         }
 
-        stats->length_ratio_sum += length_ratio;
-        stats->length_ratio_N++;
+        std::sort( &graph->edges_by_angle[graph->edge_start[i0]],
+                   &graph->edges_by_angle[graph->edge_start[i0+1]],
+                   [&](int a, int b)
+                   {
+                       return graph->edges[a].angle < graph->edges[b].angle;
+                   });
+    }
+}
+
+// Could edge e be the next step of a sequence whose last step was edge_last?
+// This only looks at those two steps, so the answer never changes, and
+// get_next_edge_along_sequence() memoizes it. length_ratio_fits_sequence()
+// looks at the rest of the sequence
+static bool edge_continues_sequence( const neighbor_edge_t* edge_last,
+                                     const neighbor_edge_t* e,
+                                     const PointInt* pt,
+                                     const PointInt* pt_adjacent,
+                                     int debug_sequence_pointscale /* <=0 means "no debugging" */ )
+{
+    const PointInt& delta_last = edge_last->delta;
+    const PointInt& delta      = e->delta;
+
+    if(debug_sequence_pointscale > 0)
+        fprintf(stderr, "Considering connection in sequence from (%d,%d) -> (%d,%d); delta (%d,%d) ..... \n",
+                pt->x          / debug_sequence_pointscale,
+                pt->y          / debug_sequence_pointscale,
+                pt_adjacent->x / debug_sequence_pointscale,
+                pt_adjacent->y / debug_sequence_pointscale,
+                delta.x        / debug_sequence_pointscale,
+                delta.y        / debug_sequence_pointscale);
+
+    if( !e->opposite )
+    {
+        if(debug_sequence_pointscale > 0)
+            fprintf(stderr, "..... rejecting. Polarities are the same\n");
+        return false;
+    }
+
+    double delta_last_length = edge_last->length;
+    double delta_length      = e->length;
 
-        stats->delta_last        = delta;
+    double cos_err =
+        ((double)delta_last.x * (double)delta.x +
+         (double)delta_last.y * (double)delta.y) /
+        (delta_last_length * delta_length);
+    if( cos_err < THRESHOLD_SPACING_COS )
+    {
+        if(debug_sequence_pointscale > 0)
+            fprintf(stderr, "..... rejecting. Angle is wrong. I wanted cos_err>=threshold, but saw %f<%f\n",
+                    cos_err, THRESHOLD_SPACING_COS);
+        return false;
+    }
 
+    double length_err = delta_last_length - delta_length;
+    if( length_err < -THRESHOLD_SPACING_LENGTH ||
+        length_err >  THRESHOLD_SPACING_LENGTH )
+    {
         if(debug_sequence_pointscale > 0)
-            fprintf(stderr, "..... accepting!\n");
-        return c_adjacent;
+            fprintf(stderr, "..... rejecting. Lengths are wrong. I wanted abs(length_err)<=threshold, but saw %f>%f\n",
+                    fabs(length_err), THRESHOLD_SPACING_LENGTH);
+        return false;
+    }
 
-    } FOR_ALL_ADJACENT_CELLS_END();
+    double length_ratio = delta_length / delta_last_length;
+    if( length_ratio < THRESHOLD_SPACING_LENGTH_RATIO_MIN ||
+        length_ratio > THRESHOLD_SPACING_LENGTH_RATIO_MAX )
+    {
+        if(debug_sequence_pointscale > 0)
+            fprintf(stderr, "..... rejecting. Lengths are wrong. I wanted abs(length_ratio)<=threshold, but saw %f<%f or %f>%f\n",
+                    length_ratio, THRESHOLD_SPACING_LENGTH_RATIO_MIN,
+                    length_ratio, THRESHOLD_SPACING_LENGTH_RATIO_MAX);
+        return false;
+    }
 
-    return NULL;
+    return true;
+}
+
+// Does the length ratio of edge e match the ratios seen so far in the sequence?
+static bool length_ratio_fits_sequence( const HypothesisStatistics* stats,
+                                        const neighbor_edge_t* edge_last,
+                                        const neighbor_edge_t* e,
+                                        int debug_sequence_pointscale /* <=0 means "no debugging" */ )
+{
+    // I compute the mean and look at the deviation from the CURRENT mean. I
+    // ignore the first few points, since the mean is unstable then. This is
+    // OK, however, since I'm going to find and analyze the same sequence in
+    // the reverse order, and this will cover the other end
+    if( stats->length_ratio_N > 2 )
+    {
+        double length_ratio      = e->length / edge_last->length;
+        double length_ratio_mean = stats->length_ratio_sum / (double)stats->length_ratio_N;
+
+        double length_ratio_deviation = length_ratio - length_ratio_mean;
+        if( length_ratio_deviation < -THRESHOLD_SPACING_LENGTH_RATIO_DEVIATION ||
+            length_ratio_deviation >  THRESHOLD_SPACING_LENGTH_RATIO_DEVIATION )
+        {
+            if(debug_sequence_pointscale > 0)
+                fprintf(stderr, "..... rejecting. Lengths are wrong. I wanted abs(length_ratio_deviation)<=threshold, but saw %f>%f\n",
+                        fabs(length_ratio_deviation), THRESHOLD_SPACING_LENGTH_RATIO_DEVIATION);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Returns the first edge in the order of the diagram that continues a sequence
+// whose last step was edge iedge_last, or <0 if there isn't one. If stats is
+// NULL, I only look at the last step
+static int find_next_edge_by_angle( const neighbor_graph_t* graph,
+                                    int iedge_last,
+                                    const HypothesisStatistics* stats )
+{
+    const neighbor_edge_t* edge_last = &graph->edges[iedge_last];
+
+    const int iedge0 = graph->edge_start[edge_last->i];
+    const int iedge1 = graph->edge_start[edge_last->i+1];
+
+    // Only the neighbors near the expected direction can match, and the edges
+    // sorted by angle give me those with a binary search. Of the neighbors
+    // that match, I take the first one in the order of the diagram, exactly
+    // like the exhaustive search in get_next_edge_along_sequence()
+    const int* by_angle = &graph->edges_by_angle[iedge0];
+    const int  Nedges   = iedge1 - iedge0;
+
+    int iedge_found = -1;
+    auto search_angles = [&](double angle0, double angle1)
+    {
+        int k =
+            std::lower_bound(by_angle, by_angle + Nedges, angle0,
+                             [&](int iedge, double angle)
+                             {
+                                 return graph->edges[iedge].angle < angle;
+                             }) - by_angle;
+        for(; k<Nedges && graph->edges[by_angle[k]].angle <= angle1; k++)
+        {
+            const int iedge = by_angle[k];
+            if((iedge_found < 0 || iedge < iedge_found) &&
+               edge_continues_sequence(edge_last, &graph->edges[iedge],
+                                       NULL, NULL, -1) &&
+               (stats == NULL ||
+                length_ratio_fits_sequence(stats, edge_last, &graph->edges[iedge], -1)))
+                iedge_found = iedge;
+        }
+    };
+
+    // The window may wrap around at +-pi
+    const double angle0 = edge_last->angle - THRESHOLD_SPACING_ANGLE_SEARCH;
+    const double angle1 = edge_last->angle + THRESHOLD_SPACING_ANGLE_SEARCH;
+    search_angles(angle0, angle1);
+    if(angle0 < -M_PI) search_angles(angle0 + 2.0*M_PI, M_PI);
+    if(angle1 >  M_PI) search_angles(-M_PI, angle1 - 2.0*M_PI);
+
+    return iedge_found;
+}
+
+// Returns the edge that continues a sequence whose last step was edge
+// iedge_last, or <0 if there isn't one
+static int
+get_next_edge_along_sequence( // out,in.
+                              HypothesisStatistics* stats,
+
+                              // in. graph->next_edge is updated
+                              neighbor_graph_t* graph,
+                              int iedge_last,
+                              const std::vector<PointInt>& points,
+                              int debug_sequence_pointscale /* <=0 means "no debugging" */ )
+{
+    // We're given a point, and some properties that a potential next point in
+    // the sequence should match. I look through all the voronoi neighbors of
+    // THIS point, and return the first one that matches all my requirements.
+    // Multiple neighboring points COULD match, but I'm assuming clean data, so
+    // this possibility is ignored.
+    //
+    // A matching next point should have the following properties, all
+    // established by the previous points in the sequence. The next point
+    // should match all of these:
+    //
+    // - opposite polarity, if the polarities are known. This is the cheapest
+    //   test, and it throws out most of the wrong neighbors right away
+    //
+    // - located along an expected direction (tight bound on angle)
+    //
+    // - should be an expected distance away (loose bound on absolute distance)
+    //
+    // - the ratio of successive distances in a sequence should be constant-ish
+    //
+    // The points in a sequence come from projections of equidistantly-spaced
+    // points in a straight line, so the projected DIRECTIONS should match very
+    // well. The distances may not, if the observed object is tilted and is
+    // relatively close to the camera, but each successive distance will vary ~
+    // geometrically due to perspective effects, or it the distances will all be
+    // roughly constant, which is still geometric, technically
+    //
+    // Sequences from different starting points run into each other all the
+    // time, and walk the same edges from there on. All the tests except the
+    // last one look only at the last step, so I remember the edge they pick in
+    // graph->next_edge. If that edge passes the last test too, it's the answer:
+    // every edge before it fails the other tests. If it doesn't, I look again
+    // at the later edges, without the memo. That's rare
+
+    const neighbor_edge_t* edge_last = &graph->edges[iedge_last];
+    const int              ipt       = edge_last->i;
+
+    int iedge_found = -1;
+    if(debug_sequence_pointscale > 0)
+    {
+        // When debugging I look at all the neighbors, in order, to report on
+        // each one
+        for(int iedge=graph->edge_start[ipt]; iedge<graph->edge_start[ipt+1]; iedge++)
+            if(edge_continues_sequence(edge_last, &graph->edges[iedge],
+                                       &points[ipt], &points[graph->edges[iedge].i],
+                                       debug_sequence_pointscale) &&
+               length_ratio_fits_sequence(stats, edge_last, &graph->edges[iedge],
+                                          debug_sequence_pointscale))
+            {
+                iedge_found = iedge;
+                break;
+            }
+    }
+    else
+    {
+        int* next_edge = &graph->next_edge[iedge_last];
+        if(*next_edge == NEXT_EDGE_UNKNOWN)
+            *next_edge = find_next_edge_by_angle(graph, iedge_last, NULL);
+
+        iedge_found = *next_edge;
+        if(iedge_found >= 0 &&
+           !length_ratio_fits_sequence(stats, edge_last, &graph->edges[iedge_found], -1))
+            iedge_found = find_next_edge_by_angle(graph, iedge_last, stats);
+    }
+
+    if(iedge_found < 0)
+        return -1;
+
+    const neighbor_edge_t* e = &graph->edges[iedge_found];
+    stats->length_ratio_sum += e->length / edge_last->length;
+    stats->length_ratio_N++;
+
+    if(debug_sequence_pointscale > 0)
+        fprintf(stderr, "..... accepting!\n");
+    return iedge_found;
 }
 
-static bool search_along_sequence( // out
+// Follows the sequence that starts with edge iedge for up to N_remaining more
+// steps, and writes the indices of the points it finds into sequence_points.
+// Returns the number of steps taken
+static int search_along_sequence( // out
                                   PointDouble* delta_mean,
+                                  int* sequence_points,
 
                                   // in
-                                  const PointInt* delta,
-                                  const VORONOI::cell_type* c,
+                                  int iedge,
                                   int N_remaining,
 
                                   const std::vector<PointInt>& points,
+                                  neighbor_graph_t* graph,
                                   int debug_sequence_pointscale )
 {
-    delta_mean->x = (double)delta->x;
-    delta_mean->y = (double)delta->y;
+    delta_mean->x = (double)graph->edges[iedge].delta.x;
+    delta_mean->y = (double)graph->edges[iedge].delta.y;
 
-    FOR_MATCHING_ADJACENT_CELLS(debug_sequence_pointscale)
+    HypothesisStatistics stats;
+    fill_initial_hypothesis_statistics(&stats);
+    int i;
+    for(i=0; i<N_remaining; i++)
     {
-        if( c_adjacent == NULL )
-            return false;
-        delta_mean->x += (double)stats.delta_last.x;
-        delta_mean->y += (double)stats.delta_last.y;
+        iedge = get_next_edge_along_sequence(&stats, graph, iedge, points,
+                                             debug_sequence_pointscale);
+        if( iedge < 0 )
+            break;
+
+        const neighbor_edge_t* e = &graph->edges[iedge];
+        sequence_points[i] = e->i;
+        delta_mean->x += (double)e->delta.x;
+        delta_mean->y += (double)e->delta.y;
     }
-    FOR_MATCHING_ADJACENT_CELLS_END();
 
-    delta_mean->x /= (double)(N_remaining+1);
-    delta_mean->y /= (double)(N_remaining+1);
+    delta_mean->x /= (double)(i+1);
+    delta_mean->y /= (double)(i+1);
 
-    return true;
+    return i;
 }
 
-static void write_cell_center( std::vector<PointDouble>& points_out,
-                               const VORONOI::cell_type* c,
-                               const std::vector<PointInt>& points )
+static void write_point( std::vector<PointDouble>& points_out,
+                         int ipt,
+                         const std::vector<PointInt>& points )
 {
-    const PointInt* pt = &points[c->source_index()];
+    const PointInt* pt = &points[ipt];
     points_out.push_back( PointDouble( (double)pt->x / (double)FIND_GRID_SCALE,
                                        (double)pt->y / (double)FIND_GRID_SCALE) );
 }
 
-static void write_along_sequence( std::vector<PointDouble>& points_out,
-                                  const PointInt* delta,
-                                  const VORONOI::cell_type* c,
-                                  int N_remaining,
-
-                                  const std::vector<PointInt>& points)
-{
-    FOR_MATCHING_ADJACENT_CELLS(-1)
-    {
-        write_cell_center(points_out, c_adjacent, points);
-    } FOR_MATCHING_ADJACENT_CELLS_END();
-}
-
 // dumps the voronoi diagram to a self-plotting vnlog
 #define DUMP_FILENAME_VORONOI "/tmp/mrgingham-2-voronoi.vnl"
-static void dump_voronoi( const VORONOI* voronoi,
+static void dump_voronoi( const neighbor_graph_t* graph,
                           const std::vector<PointInt>& points )
 {
     FILE* fp = fopen(DUMP_FILENAME_VORONOI, "w");
@@ -283,19 +811,12 @@ static void dump_voronoi( const VORONOI* voronoi,
     fprintf(fp, "# x id_edge y\n");
 
     int i_edge = 0;
-    for (auto it = voronoi->cells().begin(); it != voronoi->cells().end(); it++ )
+    for(int ipt : graph->cell_order)
     {
-        const VORONOI::cell_type* c = &(*it);
-
-        const PointInt*        pt0 = &points[c->source_index()];
-        const VORONOI::edge_type* const e0 = c->incident_edge();
-        bool first = true;
-        for(const VORONOI::edge_type* e = e0;
-            e0 != NULL && (e != e0 || first);
-            e = e->next(), first=false)
+        const PointInt* pt0 = &points[ipt];
+        for(int iedge = graph->edge_start[ipt]; iedge < graph->edge_start[ipt+1]; iedge++)
         {
-            const VORONOI::cell_type* c_adjacent = e->twin()->cell();
-            const PointInt* pt1 = &points[c_adjacent->source_index()];
+            const PointInt* pt1 = &points[graph->edges[iedge].i];
             fprintf(fp, "%f %d %f\n", pt0->x/(double)FIND_GRID_SCALE, i_edge, pt0->y/(double)FIND_GRID_SCALE);
             fprintf(fp, "%f %d %f\n", pt1->x/(double)FIND_GRID_SCALE, i_edge, pt1->y/(double)FIND_GRID_SCALE);
             i_edge++;
@@ -312,12 +833,12 @@ static void dump_voronoi( const VORONOI* voronoi,
 static void dump_interval( FILE* fp,
                            const int i_candidate,
                            const int i_pt,
-                           const VORONOI::cell_type* c0,
-                           const VORONOI::cell_type* c1,
+                           int ipt0,
+                           int ipt1,
                            const std::vector<PointInt>& points )
 {
-    const PointInt* pt0 = &points[c0->source_index()];
-    const PointInt* pt1 = &points[c1->source_index()];
+    const PointInt* pt0 = &points[ipt0];
+    const PointInt* pt1 = &points[ipt1];
 
     double dx = (double)(pt1->x - pt0->x) / (double)FIND_GRID_SCALE;
     double dy = (double)(pt1->y - pt0->y) / (double)FIND_GRID_SCALE;
@@ -331,20 +852,6 @@ static void dump_interval( FILE* fp,
            dx, dy, length, angle);
 }
 
-static void dump_intervals_along_sequence( FILE* fp,
-                                           int i_candidate,
-                                           const PointInt* delta,
-                                           const VORONOI::cell_type* c,
-                                           int N_remaining,
-
-                                           const std::vector<PointInt>& points)
-{
-    FOR_MATCHING_ADJACENT_CELLS(-1)
-    {
-        dump_interval(fp, i_candidate, i+1, c, c_adjacent, points);
-    } FOR_MATCHING_ADJACENT_CELLS_END();
-}
-
 
 #define CLASSIFICATION_TYPE_LIST(_)             \
     _(UNCLASSIFIED, = 0)                        \
@@ -368,10 +875,13 @@ static const char* type_string(ClassificationType type)
     }
 }
 
+// Each sequence is traced once, in get_sequence_candidates(). Its Npoints
+// points are stored in sequence_points[ipoints..ipoints+Npoints), and
+// everything after that reads them from there
 struct CandidateSequence
 {
-    const VORONOI::cell_type* c0;
-    const VORONOI::cell_type* c1;
+    int ipoints;
+    int Npoints;
 
     PointDouble delta_mean;
     double      spacing_angle;
@@ -393,17 +903,32 @@ double get_spacing_angle( double y, double x )
 
 typedef std::vector<CandidateSequence> v_CS;
 
+// What sort_candidates() sorts
+struct candidate_sort_key_t
+{
+    int type_rank;
+    int coord;
+    int i;
+};
+
 static void get_sequence_candidates( // out
                                      v_CS* sequence_candidates,
+                                     std::vector<int>* sequence_points,
 
-                                     // in
-                                     const VORONOI* voronoi,
+                                     // in. graph->next_edge is updated
+                                     neighbor_graph_t* graph,
                                      const std::vector<PointInt>& points,
 
+                                     // The sequences are at least
+                                     // Npoints_min long. I follow each one
+                                     // for at most Npoints_max points
+                                     int Npoints_min,
+                                     int Npoints_max,
+
                                      // for debugging
                                      const debug_sequence_t& debug_sequence)
 {
-    const VORONOI::cell_type* tracing_c = NULL;
+    int tracing_ipt = -1;
 
     int debug_sequence_pointscale = -1;
     if(debug_sequence.dodebug)
@@ -412,50 +937,65 @@ static void get_sequence_candidates( // out
         // debug_sequence that
         unsigned long d2 = (unsigned long)(-1L); // max at first
         debug_sequence_pointscale = FIND_GRID_SCALE;
-        for (auto it = voronoi->cells().begin(); it != voronoi->cells().end(); it++ )
+        for(int ipt : graph->cell_order)
         {
-            const VORONOI::cell_type* c  = &(*it);
-            const PointInt*           pt = &points[c->source_index()];
+            const PointInt* pt = &points[ipt];
             long dx = (long)(pt->x - debug_sequence_pointscale*debug_sequence.pt.x);
             long dy = (long)(pt->y - debug_sequence_pointscale*debug_sequence.pt.y);
             unsigned long d2_here = (unsigned long)(dx*dx + dy*dy);
             if(d2_here < d2)
             {
                 d2 = d2_here;
-                tracing_c = c;
+                tracing_ipt = ipt;
             }
         }
-        const PointInt* pt = &points[tracing_c->source_index()];
+        const PointInt* pt = &points[tracing_ipt];
         fprintf(stderr, "============== Looking at sequences from (%d,%d)\n",
                 pt->x / debug_sequence_pointscale,
                 pt->y / debug_sequence_pointscale);
     }
 
-    for (auto it = voronoi->cells().begin(); it != voronoi->cells().end(); it++ )
+    for(int ipt : graph->cell_order)
     {
-        const VORONOI::cell_type* c  = &(*it);
-
-        bool debug_sequence = ( c == tracing_c );
-
-        FOR_ALL_ADJACENT_CELLS(c)
+        for(int iedge = graph->edge_start[ipt]; iedge < graph->edge_start[ipt+1]; iedge++)
         {
-            if(c == tracing_c)
+            const neighbor_edge_t* e = &graph->edges[iedge];
+
+            if(ipt == tracing_ipt)
                 fprintf(stderr, "====== Looking at adjacent point (%d,%d)\n",
-                        pt_adjacent->x / debug_sequence_pointscale,
-                        pt_adjacent->y / debug_sequence_pointscale);
+                        points[e->i].x / debug_sequence_pointscale,
+                        points[e->i].y / debug_sequence_pointscale);
+
+            if( !e->opposite )
+            {
+                if(ipt == tracing_ipt)
+                    fprintf(stderr, "====== Polarities are the same. Not a sequence\n");
+                continue;
+            }
+
+            const int ipoints = (int)sequence_points->size();
+            sequence_points->resize(ipoints + Npoints_max);
+            int* cs_points = &(*sequence_points)[ipoints];
+            cs_points[0] = ipt;
+            cs_points[1] = e->i;
 
             PointDouble delta_mean;
-            if( search_along_sequence( &delta_mean,
-                                       &delta, c_adjacent, Nwant-2, points,
-                                       (c == tracing_c) ? debug_sequence_pointscale : -1 ) )
+            int Npoints = 2 +
+                search_along_sequence( &delta_mean, &cs_points[2],
+                                       iedge, Npoints_max-2, points, graph,
+                                       (ipt == tracing_ipt) ? debug_sequence_pointscale : -1 );
+            if( Npoints >= Npoints_min )
             {
                 double spacing_angle  = get_spacing_angle(delta_mean.y, delta_mean.x);
                 double spacing_length = hypot(delta_mean.x, delta_mean.y);
 
-                sequence_candidates->push_back( CandidateSequence({c, c_adjacent, delta_mean,
+                sequence_points->resize(ipoints + Npoints);
+                sequence_candidates->push_back( CandidateSequence({ipoints, Npoints, delta_mean,
                                                                    spacing_angle, spacing_length}) );
             }
-        } FOR_ALL_ADJACENT_CELLS_END();
+            else
+                sequence_points->resize(ipoints);
+        }
     }
 }
 
@@ -571,7 +1111,11 @@ static void mark_orientation( v_CS* sequence_candidates,
     }
 }
 
-static bool cluster_sequence_candidates( v_CS* sequence_candidates )
+static bool cluster_sequence_candidates( v_CS* sequence_candidates,
+
+                                         // Each orientation should have at
+                                         // least this many sequences
+                                         int Nsequences_min )
 {
     // I looked through all my points, and I have candidate sets of points that
     // are
@@ -592,7 +1136,7 @@ static bool cluster_sequence_candidates( v_CS* sequence_candidates )
         ClassificationBin* bin = &bins[bin_index];
         int Nremaining = gather_unclassified( bin, sequence_candidates, bin_index );
 
-        if( bin->N < Nwant*2 ) // should have enough for both directions
+        if( bin->N < Nsequences_min*2 ) // should have enough for both directions
         {
             // this is a bin full of outliers
             mark_outliers( sequence_candidates, bin_index );
@@ -611,7 +1155,7 @@ static bool cluster_sequence_candidates( v_CS* sequence_candidates )
         }
 
         bin_index++;
-        if( Nremaining < Nwant*2 ) // should have enough for both directions
+        if( Nremaining < Nsequences_min*2 ) // should have enough for both directions
         {
             // only stragglers left. Mark them as outliers and call it good.
             mark_outliers(sequence_candidates, -1);
@@ -645,70 +1189,34 @@ static bool cluster_sequence_candidates( v_CS* sequence_candidates )
 }
 
 
-static void get_candidate_point( unsigned int* cs_point,
-                                 const VORONOI::cell_type* c )
-{
-    *cs_point = c->source_index();
-}
-static void get_candidate_points_along_sequence( unsigned int* cs_points,
-
-                                                 const PointInt* delta,
-                                                 const VORONOI::cell_type* c,
-                                                 int N_remaining,
-
-                                                 const std::vector<PointInt>& points)
-{
-    FOR_MATCHING_ADJACENT_CELLS(-1)
-    {
-        get_candidate_point(cs_points, c_adjacent);
-        cs_points++;
-    } FOR_MATCHING_ADJACENT_CELLS_END();
-}
-static void get_candidate_points( unsigned int* cs_points,
-                                  const CandidateSequence* cs,
-                                  const std::vector<PointInt>& points )
-{
-    get_candidate_point( &cs_points[0], cs->c0 );
-    get_candidate_point( &cs_points[1], cs->c1 );
-
-    const PointInt* pt0 = &points[cs->c0->source_index()];
-    const PointInt* pt1 = &points[cs->c1->source_index()];
-
-    PointInt delta({ pt1->x - pt0->x,
-                  pt1->y - pt0->y});
-    get_candidate_points_along_sequence(&cs_points[2], &delta, cs->c1, Nwant-2, points);
-}
-
-static bool compare_reverse_along_sequence( const unsigned int* cs_points_other,
-
-                                            const PointInt* delta,
-                                            const VORONOI::cell_type* c,
-                                            int N_remaining,
-
-                                            const std::vector<PointInt>& points)
+// Is cs_points the sequence cs_points_other, in the opposite order? Both have
+// Npoints points
+static bool is_reverse_sequence( const int* cs_points_other,
+                                 const int* cs_points,
+                                 int Npoints )
 {
-    FOR_MATCHING_ADJACENT_CELLS(-1)
-    {
-        if(*cs_points_other != c_adjacent->source_index())
+    for(int i=0; i<Npoints; i++)
+        if( cs_points[i] != cs_points_other[Npoints-1-i] )
             return false;
-        cs_points_other--;
-    } FOR_MATCHING_ADJACENT_CELLS_END();
-
     return true;
 }
-static bool is_reverse_sequence( const unsigned int* cs_points_other,
-                                 const CandidateSequence* cs,
-                                 const std::vector<PointInt>& points )
-{
-    if( cs->c0->source_index() != cs_points_other[Nwant-1] ) return false;
-    if( cs->c1->source_index() != cs_points_other[Nwant-2] ) return false;
 
-    const PointInt* pt0 = &points[cs->c0->source_index()];
-    const PointInt* pt1 = &points[cs->c1->source_index()];
+// The sequences are traced as far as the longer side of the grid allows. Once
+// I know which sequences are rows and which are columns, I cut them down to
+// the length of their side. The ones that are too short start in the middle of
+// a row or column, and I throw them out
+static void filter_length( v_CS* sequence_candidates,
+                           ClassificationType orientation,
+                           int Npoints )
+{
+    for( auto it = sequence_candidates->begin(); it != sequence_candidates->end(); it++ )
+    {
+        CandidateSequence* cs = &(*it);
+        if(cs->type != orientation) continue;
 
-    PointInt delta({ pt1->x - pt0->x,
-                  pt1->y - pt0->y});
-    return compare_reverse_along_sequence(&cs_points_other[Nwant-3], &delta, cs->c1, Nwant-2, points);
+        if( cs->Npoints < Npoints ) cs->type    = OUTLIER;
+        else                        cs->Npoints = Npoints;
+    }
 }
 
 static bool matches_direction(CandidateSequence* cs,
@@ -718,54 +1226,115 @@ static bool matches_direction(CandidateSequence* cs,
     return cs->delta_mean.y > 0.0;
 }
 
+// Where a sequence with these endpoints lives in the lookup table of
+// filter_bidirectional(). The table has 2^Nbits slots
+static uint32_t endpoints_slot(int ifirst, int ilast, int Nbits)
+{
+    uint64_t key = ((uint64_t)(uint32_t)ifirst << 32) | (uint64_t)(uint32_t)ilast;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - Nbits));
+}
+
 static void filter_bidirectional( v_CS* sequence_candidates,
-                                  const std::vector<PointInt>& points,
-                                  ClassificationType orientation )
+                                  const std::vector<int>& sequence_points,
+                                  ClassificationType orientation,
+
+                                  // buffers
+                                  std::vector<int>* endpoints_lookup )
 {
     // I loop through the candidates list, and try to find a matching other
     // candidate that is THIS candidate in the opposite order.
     //
     // If no such match is found, I throw away the candidate.
     // If such match IS found, I throw away one of the two
+    //
+    // The reverse of a candidate starts where the candidate ends, and ends
+    // where it starts. So I index the candidates by their endpoints, and look
+    // only at the ones with the right endpoints, instead of at all the others.
+    // The index is a hash table with open addressing: each slot has the index
+    // of a candidate, or -1. Several candidates can share their endpoints, and
+    // different endpoints can land in the same slot. I only compare the full
+    // sequences of the candidates I find there
     int N = sequence_candidates->size();
+
+    int Norientation = 0;
+    for( int i=0; i<N; i++ )
+        if((*sequence_candidates)[i].type == orientation)
+            Norientation++;
+
+    // At most half the slots are used
+    int Nbits = 4;
+    while( (1 << Nbits) < 2*Norientation )
+        Nbits++;
+    const uint32_t mask = (1U << Nbits) - 1;
+
+    endpoints_lookup->assign(1 << Nbits, -1);
+    int* lookup = endpoints_lookup->data();
+    for( int i=0; i<N; i++ )
+    {
+        const CandidateSequence* cs = &(*sequence_candidates)[i];
+        if(cs->type != orientation) continue;
+
+        const int* cs_points = &sequence_points[cs->ipoints];
+        uint32_t slot = endpoints_slot(cs_points[0], cs_points[cs->Npoints-1], Nbits);
+        while(lookup[slot] >= 0)
+            slot = (slot + 1) & mask;
+        lookup[slot] = i;
+    }
+
     for( int i=0; i<N; i++ )
     {
         CandidateSequence* cs0 = &(*sequence_candidates)[i];
         if(cs0->type != orientation) continue;
 
-        unsigned int cs0_points[Nwant];
-        get_candidate_points(cs0_points, cs0, points);
+        const int* cs0_points = &sequence_points[cs0->ipoints];
 
-        bool found = false;
-        for( int j=i+1; j<N; j++ )
+        // I want the first matching candidate after this one. The candidates
+        // I look at here were indexed before anything changed: only the ones
+        // before this one have been touched
+        int j_found = -1;
+        for( uint32_t slot = endpoints_slot(cs0_points[cs0->Npoints-1], cs0_points[0], Nbits);
+             lookup[slot] >= 0;
+             slot = (slot + 1) & mask )
         {
+            const int j = lookup[slot];
+            if( j <= i || (j_found >= 0 && j > j_found) ) continue;
+
             CandidateSequence* cs1 = &(*sequence_candidates)[j];
             if(cs1->type != orientation) continue;
 
-            if( !is_reverse_sequence( cs0_points, cs1, points ) )
+            if( cs1->Npoints != cs0->Npoints ||
+                !is_reverse_sequence( cs0_points, &sequence_points[cs1->ipoints],
+                                      cs0->Npoints ) )
                 continue;
 
-            // bam. found reverse sequence. Throw away one of the matches. I
-            // keep the one that matches the canonical direction the best ([1,0]
-            // for "horizontal" and [0,1] for "vertical")
-            if( !matches_direction(cs0, orientation) )
-                *cs0 = *cs1;
-            cs1->type = OUTLIER;
-            found = true;
-            break;
+            j_found = j;
         }
-        if( !found )
+
+        if( j_found < 0 )
+        {
             // this candidate doesn't have a match. Throw out self
             cs0->type = OUTLIER;
+            continue;
+        }
+
+        // bam. found reverse sequence. Throw away one of the matches. I keep
+        // the one that matches the canonical direction the best ([1,0] for
+        // "horizontal" and [0,1] for "vertical")
+        CandidateSequence* cs1 = &(*sequence_candidates)[j_found];
+        if( !matches_direction(cs0, orientation) )
+            *cs0 = *cs1;
+        cs1->type = OUTLIER;
     }
 }
 
 
 // Looks through our classification and determines whether things look valid or
 // not. Makes no changes to anything
-static bool validate_clasification(const v_CS* sequence_candidates)
+static bool validate_clasification(const v_CS* sequence_candidates,
+                                   int gridn_width, int gridn_height)
 {
-    // I should have exactly Nwant horizontal lines and Nwant vertical lines
+    // I should have exactly gridn_height horizontal lines and gridn_width
+    // vertical lines
     int Nhorizontal = 0;
     int Nvertical   = 0;
 
@@ -774,8 +1343,8 @@ static bool validate_clasification(const v_CS* sequence_candidates)
         if(      it->type == HORIZONTAL ) Nhorizontal++;
         else if( it->type == VERTICAL   ) Nvertical++;
     }
-    if( Nhorizontal != Nwant ) return false;
-    if( Nvertical   != Nwant ) return false;
+    if( Nhorizontal != gridn_height ) return false;
+    if( Nvertical   != gridn_width  ) return false;
 
 
     // OK then. The horizontal lines should each
@@ -793,6 +1362,7 @@ static bool validate_clasification(const v_CS* sequence_candidates)
 #define DUMP_FILENAME_SEQUENCE_CANDIDATES_SPARSE_AFTER  "/tmp/mrgingham-4-candidates.vnl"
 #define DUMP_FILENAME_SEQUENCE_CANDIDATES_DENSE_AFTER   "/tmp/mrgingham-4-candidates-detailed.vnl"
 static void dump_candidates(const v_CS* sequence_candidates,
+                            const std::vector<int>& sequence_points,
                             const std::vector<PointInt>& points,
                             bool post_filter)
 {
@@ -813,7 +1383,7 @@ static void dump_candidates(const v_CS* sequence_candidates,
     for( auto it = sequence_candidates->begin(); it != sequence_candidates->end(); it++ )
     {
         const CandidateSequence* cs = &(*it);
-        const PointInt*             pt = &points[cs->c0->source_index()];
+        const PointInt*             pt = &points[sequence_points[cs->ipoints]];
 
         fprintf(fp,
                 "%f %s %f %f %f\n",
@@ -840,76 +1410,85 @@ static void dump_candidates(const v_CS* sequence_candidates,
     int N = sequence_candidates->size();
     for( int i=0; i<N; i++ )
     {
-        const CandidateSequence* cs = &(*sequence_candidates)[i];
+        const CandidateSequence* cs        = &(*sequence_candidates)[i];
+        const int*               cs_points = &sequence_points[cs->ipoints];
 
-        dump_interval(fp, i, 0, cs->c0, cs->c1, points);
-
-        const PointInt* pt0 = &points[cs->c0->source_index()];
-        const PointInt* pt1 = &points[cs->c1->source_index()];
-
-        PointInt delta({ pt1->x - pt0->x,
-                      pt1->y - pt0->y});
-        dump_intervals_along_sequence( fp, i, &delta, cs->c1, Nwant-2, points);
+        for(int j=0; j<cs->Npoints-1; j++)
+            dump_interval(fp, i, j, cs_points[j], cs_points[j+1], points);
     }
     fclose(fp);
     fprintf(stderr, "Wrote detailed sequence-candidate dump to %s\n",
             dump_filename_sequence_candidates_dense);
 }
 
+// If indices_out is non-NULL, I also report the index into points of each
+// point I write
 static void write_output( std::vector<PointDouble>& points_out,
+                          std::vector<int>* indices_out,
                           const v_CS* sequence_candidates,
+                          const std::vector<int>& sequence_points,
                           const std::vector<PointInt>& points )
 {
+    if(indices_out != NULL)
+        indices_out->clear();
     for( auto it = sequence_candidates->begin(); it != sequence_candidates->end(); it++ )
     {
         if( it->type == HORIZONTAL )
         {
-            write_cell_center(points_out, it->c0, points);
-            write_cell_center(points_out, it->c1, points);
-
-            const PointInt* pt0 = &points[it->c0->source_index()];
-            const PointInt* pt1 = &points[it->c1->source_index()];
-
-            PointInt delta({ pt1->x - pt0->x,
-                          pt1->y - pt0->y});
-            write_along_sequence( points_out, &delta, it->c1, Nwant-2, points);
+            for(int i=0; i<it->Npoints; i++)
+            {
+                write_point(points_out, sequence_points[it->ipoints + i], points);
+                if(indices_out != NULL)
+                    indices_out->push_back(sequence_points[it->ipoints + i]);
+            }
         }
     }
 }
 
 static void sort_candidates(v_CS* sequence_candidates,
+
+                            // buffers
+                            v_CS* sequence_candidates_sorted,
+                            std::vector<candidate_sort_key_t>* sort_keys,
+
+                            // in
+                            const std::vector<int>& sequence_points,
                             const std::vector<PointInt>& points )
 {
     // I sort my vertical sequences in order of increasing x
     //
     // I sort my horizontal sequences in order of increasing y
+    //
+    // HORIZONTAL is 1st, VERTICAL is 2nd, and I don't care about the others:
+    // they stay in the order they were in. I sort small keys, and then move
+    // each candidate once
+    sort_keys->clear();
+    int N = sequence_candidates->size();
+    for( int i=0; i<N; i++ )
+    {
+        const CandidateSequence* cs = &(*sequence_candidates)[i];
+        const PointInt*          pt = &points[sequence_points[cs->ipoints]];
 
+        if(      cs->type == HORIZONTAL ) sort_keys->push_back( candidate_sort_key_t({0, pt->y, i}) );
+        else if( cs->type == VERTICAL   ) sort_keys->push_back( candidate_sort_key_t({1, pt->x, i}) );
+    }
 
-    struct S{
-        bool operator() ( const CandidateSequence& a,
-                          const CandidateSequence& b) const
-        {
-            if( a.type != b.type )
-            {
-                // HORIZONTAL is 1st, VERTICAL is 2nd, and I don't care about the others
-                if( a.type == HORIZONTAL ) return true;
-                if( b.type == HORIZONTAL ) return false;
-                if( a.type == VERTICAL   ) return true;
-                if( b.type == VERTICAL   ) return false;
-                return a.type < b.type;
-            }
-
-            if( a.type == HORIZONTAL )
-                return _points[a.c0->source_index()].y < _points[b.c0->source_index()].y;
-            return _points[a.c0->source_index()].x < _points[b.c0->source_index()].x;
-        }
-
-        const std::vector<PointInt>& _points;
-        S(const std::vector<PointInt>& __points) : _points(__points) {}
-    } sequence_comparator(points);
+    std::sort( sort_keys->begin(), sort_keys->end(),
+               [](const candidate_sort_key_t& a, const candidate_sort_key_t& b)
+               {
+                   if( a.type_rank != b.type_rank ) return a.type_rank < b.type_rank;
+                   if( a.coord     != b.coord     ) return a.coord     < b.coord;
+                   return a.i < b.i;
+               });
+
+    sequence_candidates_sorted->clear();
+    for( auto it = sort_keys->begin(); it != sort_keys->end(); it++ )
+        sequence_candidates_sorted->push_back( (*sequence_candidates)[it->i] );
+    for( auto it = sequence_candidates->begin(); it != sequence_candidates->end(); it++ )
+        if( it->type != HORIZONTAL && it->type != VERTICAL )
+            sequence_candidates_sorted->push_back( *it );
 
-    std::sort( sequence_candidates->begin(), sequence_candidates->end(),
-               sequence_comparator );
+    sequence_candidates->swap(*sequence_candidates_sorted);
 }
 
 static CandidateSequence* get_first(v_CS* sequence_candidates,
@@ -926,7 +1505,7 @@ static CandidateSequence* get_first(v_CS* sequence_candidates,
 
 static bool filter_bounds(v_CS* sequence_candidates,
                           ClassificationType orientation,
-                          const std::vector<PointInt>& points)
+                          const std::vector<int>& sequence_points)
 {
     // I look at the first horizontal sequence and make sure that it consists of
     // the first points of all the vertical sequences, in order. And vice versa
@@ -942,26 +1521,131 @@ static bool filter_bounds(v_CS* sequence_candidates,
     if( cs_ref    == NULL ) return false;
     if( cs_others == NULL ) return false;
 
-    unsigned int cs_ref_points[Nwant];
-    get_candidate_points( cs_ref_points, cs_ref, points );
+    const CandidateSequence* cs_end =
+        sequence_candidates->data() + sequence_candidates->size();
+
+    const int* cs_ref_points = &sequence_points[cs_ref->ipoints];
     int i;
-    for(i=0; i<Nwant; i++, cs_others++)
+    for(i=0; i<cs_ref->Npoints; i++, cs_others++)
     {
-        if( cs_others->type != orientation_other )
+        if( cs_others == cs_end || cs_others->type != orientation_other )
             // no more valid other sequences to follow
             break;
 
-        if( cs_ref_points[i] != cs_others->c0->source_index() )
+        if( cs_ref_points[i] != sequence_points[cs_others->ipoints] )
         {
             // mismatch! One of these sequences is an outlier
 #warning handle this
             return false;
         }
     }
-    return i == Nwant;
+    return i == cs_ref->Npoints;
+}
+
+
+
+// The working buffers of find_grid_from_points(). Clearing these keeps their
+// storage, so reusing them from call to call avoids most of the allocations
+struct mrgingham::find_grid_buffers_t
+{
+    VORONOI                           voronoi;
+    spatial_hash_t                    spatial_hash;
+    neighbor_graph_t                  graph;
+    v_CS                              sequence_candidates;
+    std::vector<int>                  sequence_points;
+    std::vector<int>                  endpoints_lookup;
+    v_CS                              sequence_candidates_sorted;
+    std::vector<candidate_sort_key_t> sort_keys;
+
+    // For a board that isn't square: the clustered candidates, to try again
+    // with the board rotated by 90 degrees, and the grid found that way,
+    // before I transpose it
+    v_CS                              sequence_candidates_clustered;
+    std::vector<PointDouble>          points_rotated;
+    std::vector<int>                  indices_rotated;
+};
+
+__attribute__((visibility("default")))
+find_grid_buffers_t* mrgingham::find_grid_buffers_alloc(void)
+{
+    return new find_grid_buffers_t;
+}
+
+__attribute__((visibility("default")))
+void mrgingham::find_grid_buffers_free(find_grid_buffers_t* buffers)
+{
+    delete buffers;
+}
+
+// The rest of the search, once the candidates are clustered into HORIZONTAL
+// and VERTICAL sequences: I look for gridn_height rows of gridn_width points
+// each. On success the rows are the HORIZONTAL candidates, sorted top to bottom
+static bool find_grid_among_clustered( // in/out
+                                       v_CS* sequence_candidates,
+
+                                       // buffers
+                                       find_grid_buffers_t* buffers,
+
+                                       // in
+                                       const std::vector<int>& sequence_points,
+                                       const std::vector<PointInt>& points,
+                                       bool debug,
+                                       int gridn_width, int gridn_height)
+{
+    // The rows have gridn_width points, and the columns have gridn_height
+    filter_length(sequence_candidates, HORIZONTAL, gridn_width);
+    filter_length(sequence_candidates, VERTICAL,   gridn_height);
+
+    filter_bidirectional(sequence_candidates, sequence_points, HORIZONTAL,
+                         &buffers->endpoints_lookup);
+    filter_bidirectional(sequence_candidates, sequence_points, VERTICAL,
+                         &buffers->endpoints_lookup);
+
+    if(debug)
+        dump_candidates(sequence_candidates, sequence_points, points, true);
+
+    sort_candidates(sequence_candidates,
+                    &buffers->sequence_candidates_sorted, &buffers->sort_keys,
+                    sequence_points, points);
+
+    if( !filter_bounds(sequence_candidates, HORIZONTAL, sequence_points) )
+    {
+        if(debug)
+            fprintf(stderr, "Horizontal sequence candidates out of bounds. No grid detected\n");
+        return false;
+    }
+    if( !filter_bounds(sequence_candidates, VERTICAL,   sequence_points) )
+    {
+        if(debug)
+            fprintf(stderr, "Vertical sequence candidates out of bounds. No grid detected\n");
+        return false;
+    }
+    if(!validate_clasification(sequence_candidates, gridn_width, gridn_height))
+    {
+        if(debug)
+            fprintf(stderr, "validate_clasification() failed. No grid detected\n");
+        return false;
+    }
+
+    return true;
 }
 
+__attribute__((visibility("default")))
+bool mrgingham::find_grid_from_points( // out
+                                      std::vector<PointDouble>& points_out,
 
+                                      // in
+                                      const std::vector<PointInt>& points,
+                                      bool     debug,
+                                      const debug_sequence_t& debug_sequence,
+                                      int gridn_width,
+                                      int gridn_height)
+{
+    find_grid_buffers_t buffers;
+    return find_grid_from_points(points_out, points, debug, debug_sequence,
+                                 &buffers, NULL, NEIGHBOR_GRAPH_VORONOI,
+                                 gridn_width, gridn_height);
+}
 
 __attribute__((visibility("default")))
 bool mrgingham::find_grid_from_points( // out
@@ -970,65 +1654,119 @@ bool mrgingham::find_grid_from_points( // out
                                       // in
                                       const std::vector<PointInt>& points,
                                       bool     debug,
-                                      const debug_sequence_t& debug_sequence)
+                                      const debug_sequence_t& debug_sequence,
+
+                                      // buffers
+                                      find_grid_buffers_t* buffers,
+
+                                      // in
+                                      const std::vector<CornerPolarity>* polarities,
+                                      neighbor_graph_method_t neighbor_graph,
+                                      int gridn_width,
+                                      int gridn_height,
+
+                                      // out
+                                      std::vector<int>* indices_out)
 {
-    VORONOI voronoi;
-    construct_voronoi(points.begin(), points.end(), &voronoi);
+    if( gridn_width < 3 || gridn_height < 3 )
+    {
+        fprintf(stderr, "%s:%d in %s(): The grid must have at least 3 points in each direction. Got %dx%d."
+                " Sorry.\n", __FILE__, __LINE__, __func__, gridn_width, gridn_height);
+        return false;
+    }
 
-    if(debug)
-        dump_voronoi(&voronoi, points);
+    neighbor_graph_t* graph = &buffers->graph;
+    if(neighbor_graph == NEIGHBOR_GRAPH_KNN)
+        build_neighbor_graph_knn(graph, &buffers->spatial_hash, points);
+    else
+    {
+        // Note that boost builds the voronoi diagram with a temporary std::map,
+        // so this allocates, even with reused buffers
+        VORONOI& voronoi = buffers->voronoi;
+        voronoi.clear();
+        construct_voronoi(points.begin(), points.end(), &voronoi);
 
-    v_CS sequence_candidates;
-    get_sequence_candidates(&sequence_candidates, &voronoi, points,
+        build_neighbor_graph_voronoi(graph, &voronoi, (int)points.size());
+    }
+    finish_neighbor_graph(graph, points, polarities);
+
+    if(debug)
+        dump_voronoi(graph, points);
+
+    v_CS&             sequence_candidates = buffers->sequence_candidates;
+    std::vector<int>& sequence_points     = buffers->sequence_points;
+    sequence_candidates.clear();
+    sequence_points.clear();
+    get_sequence_candidates(&sequence_candidates, &sequence_points, graph, points,
+                            std::min(gridn_width, gridn_height),
+                            std::max(gridn_width, gridn_height),
                             debug_sequence);
 
 
     if(debug)
     {
-        dump_candidates(&sequence_candidates, points, false);
+        dump_candidates(&sequence_candidates, sequence_points, points, false);
 
         fprintf(stderr, "got %zd points\n", points.size());
         fprintf(stderr, "got %zd sequence candidates\n", sequence_candidates.size());
     }
 
-    if( !cluster_sequence_candidates(&sequence_candidates))
+    if( !cluster_sequence_candidates(&sequence_candidates,
+                                     std::min(gridn_width, gridn_height)))
     {
         if(debug)
             fprintf(stderr, "cluster_sequence_candidates() failed. No grid detected\n");
         return false;
     }
 
-    filter_bidirectional(&sequence_candidates, points, HORIZONTAL);
-    filter_bidirectional(&sequence_candidates, points, VERTICAL);
+    // A board that isn't square may be rotated, with its rows seen as the
+    // roughly-vertical lines in the image. If I can't find the board as given,
+    // I try it that way too, starting again from the clustered candidates
+    const bool try_rotated = gridn_width != gridn_height;
+    if(try_rotated)
+        buffers->sequence_candidates_clustered = sequence_candidates;
 
-    if(debug)
-        dump_candidates(&sequence_candidates, points, true);
-
-    // This is relatively slow (I'm moving lots of stuff around by value), but
-    // I'm likely to not feel it anyway
-    sort_candidates(&sequence_candidates, points);
-
-    if( !filter_bounds(&sequence_candidates, HORIZONTAL, points) )
+    if(find_grid_among_clustered(&sequence_candidates, buffers,
+                                 sequence_points, points, debug,
+                                 gridn_width, gridn_height))
     {
+        write_output(points_out, indices_out, &sequence_candidates, sequence_points, points);
         if(debug)
-            fprintf(stderr, "Horizontal sequence candidates out of bounds. No grid detected\n");
-        return false;
+            fprintf(stderr, "Success. Found grid\n");
+        return true;
     }
-    if( !filter_bounds(&sequence_candidates, VERTICAL,   points) )
-    {
-        if(debug)
-            fprintf(stderr, "Vertical sequence candidates out of bounds. No grid detected\n");
+    if(!try_rotated)
         return false;
-    }
-    if(!validate_clasification(&sequence_candidates))
-    {
-        if(debug)
-            fprintf(stderr, "validate_clasification() failed. No grid detected\n");
+
+    if(debug)
+        fprintf(stderr, "Trying again with the board rotated by 90 degrees\n");
+    sequence_candidates = buffers->sequence_candidates_clustered;
+    if(!find_grid_among_clustered(&sequence_candidates, buffers,
+                                  sequence_points, points, debug,
+                                  gridn_height, gridn_width))
         return false;
-    }
 
-    write_output(points_out, &sequence_candidates, points);
+    // I found gridn_width image rows of gridn_height points each: these are
+    // the board columns. I report the board row by row, as if the rotation was
+    // undone. Turning a board clockwise by 90 degrees makes its first row the
+    // rightmost image column, so board row i is image column gridn_height-1-i,
+    // and board column j is image row j. This is a rotation, not a reflection,
+    // so the board keeps its handedness
+    std::vector<PointDouble>& points_rotated  = buffers->points_rotated;
+    std::vector<int>&         indices_rotated = buffers->indices_rotated;
+    points_rotated.clear();
+    write_output(points_rotated, &indices_rotated, &sequence_candidates, sequence_points, points);
+    if(indices_out != NULL)
+        indices_out->clear();
+    for(int i=0; i<gridn_height; i++)
+        for(int j=0; j<gridn_width; j++)
+        {
+            const int k = j*gridn_height + gridn_height-1-i;
+            points_out.push_back(points_rotated[k]);
+            if(indices_out != NULL)
+                indices_out->push_back(indices_rotated[k]);
+        }
     if(debug)
-        fprintf(stderr, "Success. Found grid\n");
+        fprintf(stderr, "Success. Found grid, rotated by 90 degrees\n");
     return true;
 }
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "image_pyramid.hh"
+#include "thread_pool.hh"
+
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+namespace mrgingham
+{
+
+// Each of these computes one row of the downsampled image from two rows of the
+// input. All the flavors produce bit-identical output
+typedef void (downsample_row_8u_function_t)(      uint8_t* out,
+                                            const uint8_t* in0,
+                                            const uint8_t* in1,
+                                            int w_out);
+
+static void downsample_row_8u_scalar(      uint8_t* out,
+                                     const uint8_t* in0,
+                                     const uint8_t* in1,
+                                     int w_out)
+{
+    for(int x=0; x<w_out; x++)
+        out[x] = (uint8_t)(( in0[2*x] + in0[2*x+1] +
+                             in1[2*x] + in1[2*x+1] + 2 ) >> 2);
+}
+
+#ifdef HAVE_X86_SIMD
+// I sum adjacent pairs of pixels with pmaddubsw, add the two rows, and round.
+// The sums fit into 16 bits easily, so this is exact
+__attribute__((target("sse4.1")))
+static void downsample_row_8u_sse41(      uint8_t* out,
+                                    const uint8_t* in0,
+                                    const uint8_t* in1,
+                                    int w_out)
+{
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i two  = _mm_set1_epi16(2);
+
+    int x = 0;
+    for(; x+16 <= w_out; x += 16)
+    {
+        __m128i s0 =
+            _mm_add_epi16( _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)&in0[2*x]),    ones),
+                           _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)&in1[2*x]),    ones));
+        __m128i s1 =
+            _mm_add_epi16( _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)&in0[2*x+16]), ones),
+                           _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)&in1[2*x+16]), ones));
+        s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+        s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+        _mm_storeu_si128((__m128i*)&out[x], _mm_packus_epi16(s0, s1));
+    }
+    downsample_row_8u_scalar(&out[x], &in0[2*x], &in1[2*x], w_out - x);
+}
+
+__attribute__((target("avx2")))
+static void downsample_row_8u_avx2(      uint8_t* out,
+                                   const uint8_t* in0,
+                                   const uint8_t* in1,
+                                   int w_out)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i two  = _mm256_set1_epi16(2);
+
+    int x = 0;
+    for(; x+32 <= w_out; x += 32)
+    {
+        __m256i s0 =
+            _mm256_add_epi16( _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)&in0[2*x]),    ones),
+                              _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)&in1[2*x]),    ones));
+        __m256i s1 =
+            _mm256_add_epi16( _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)&in0[2*x+32]), ones),
+                              _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)&in1[2*x+32]), ones));
+        s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+        s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+
+        // packus works within each 128-bit lane, so I put the 64-bit chunks
+        // back in order afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(s0, s1), 0xD8);
+        _mm256_storeu_si256((__m256i*)&out[x], packed);
+    }
+    downsample_row_8u_sse41(&out[x], &in0[2*x], &in1[2*x], w_out - x);
+}
+#endif
+
+static downsample_row_8u_function_t* best_downsample_row_8u_function(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))   return &downsample_row_8u_avx2;
+    if(__builtin_cpu_supports("sse4.1")) return &downsample_row_8u_sse41;
+#endif
+    return &downsample_row_8u_scalar;
+}
+
+// The 16-bit images are less common, so I leave the vectorization of this to
+// the compiler
+static void downsample_row_16u(      uint16_t* out,
+                               const uint16_t* in0,
+                               const uint16_t* in1,
+                               int w_out)
+{
+    for(int x=0; x<w_out; x++)
+        out[x] = (uint16_t)(( (uint32_t)in0[2*x] + (uint32_t)in0[2*x+1] +
+                              (uint32_t)in1[2*x] + (uint32_t)in1[2*x+1] + 2 ) >> 2);
+}
+
+__attribute__((visibility("default")))
+bool image_pyramid_downsample_2x2(cv::Mat& out, const cv::Mat& in,
+                                  int Nthreads)
+{
+    if( in.type() != CV_8U && in.type() != CV_16U )
+    {
+        fprintf(stderr, "%s:%d in %s(): I can only handle CV_8U and CV_16U arrays currently."
+                " Sorry.\n", __FILE__, __LINE__, __func__);
+        return false;
+    }
+
+    const int w_out = in.cols / 2;
+    const int h_out = in.rows / 2;
+    if( w_out <= 0 || h_out <= 0 )
+    {
+        fprintf(stderr, "%s:%d in %s(): The image is too small to downsample: (%d,%d)."
+                " Sorry.\n", __FILE__, __LINE__, __func__, in.cols, in.rows);
+        return false;
+    }
+
+    out.create(h_out, w_out, in.type());
+
+    // I split the work into bands of rows. Each band should be big-enough for
+    // the threading overhead to not matter
+    int Nbands = Nthreads;
+    if(Nbands > h_out / 32) Nbands = h_out / 32;
+    if(Nbands < 1)          Nbands = 1;
+
+    if(in.type() == CV_8U)
+    {
+        downsample_row_8u_function_t* downsample_row = best_downsample_row_8u_function();
+        parallel_for(Nbands, Nthreads,
+                     [&](int i)
+                     {
+                         int y0 = h_out *  i    / Nbands;
+                         int y1 = h_out * (i+1) / Nbands;
+                         for(int y=y0; y<y1; y++)
+                             downsample_row( out.ptr<uint8_t>(y),
+                                             in.ptr<uint8_t>(2*y),
+                                             in.ptr<uint8_t>(2*y+1),
+                                             w_out );
+                     });
+    }
+    else
+        parallel_for(Nbands, Nthreads,
+                     [&](int i)
+                     {
+                         int y0 = h_out *  i    / Nbands;
+                         int y1 = h_out * (i+1) / Nbands;
+                         for(int y=y0; y<y1; y++)
+                             downsample_row_16u( out.ptr<uint16_t>(y),
+                                                 in.ptr<uint16_t>(2*y),
+                                                 in.ptr<uint16_t>(2*y+1),
+                                                 w_out );
+                     });
+    return true;
+}
+
+const cv::Mat* image_pyramid_t::get(int image_pyramid_level)
+{
+    if( image_pyramid_level < 0 ||
+        image_pyramid_level > MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX )
+    {
+        fprintf(stderr, "%s:%d in %s(): Got an unreasonable image_pyramid_level = %d."
+                " Sorry.\n", __FILE__, __LINE__, __func__, image_pyramid_level);
+        return NULL;
+    }
+    if( Nlevels_valid <= 0 )
+    {
+        fprintf(stderr, "%s:%d in %s(): The pyramid has no image. Call reset() first."
+                " Sorry.\n", __FILE__, __LINE__, __func__);
+        return NULL;
+    }
+
+    while(Nlevels_valid <= image_pyramid_level)
+    {
+        if(!image_pyramid_downsample_2x2(level[Nlevels_valid],
+                                         level[Nlevels_valid-1],
+                                         Nthreads))
+            return NULL;
+        Nlevels_valid++;
+    }
+    return &level[image_pyramid_level];
+}
+
+template<typename T, typename Tsq>
+static void compute_integrals(uint32_t* sum, Tsq* sum_sq,
+                              const cv::Mat& image)
+{
+    const int w      = image.cols;
+    const int h      = image.rows;
+    const int stride = w+1;
+
+    // The first row and column are 0
+    memset(sum,    0, stride*sizeof(sum[0]));
+    memset(sum_sq, 0, stride*sizeof(sum_sq[0]));
+
+    for(int y=0; y<h; y++)
+    {
+        const T*  row            = image.ptr<T>(y);
+        uint32_t* sum_row        = &sum   [(y+1)*stride];
+        Tsq*      sum_sq_row     = &sum_sq[(y+1)*stride];
+        const uint32_t* sum_prev    = &sum   [y*stride];
+        const Tsq*      sum_sq_prev = &sum_sq[y*stride];
+
+        uint32_t s  = 0;
+        Tsq      s2 = 0;
+        sum_row   [0] = 0;
+        sum_sq_row[0] = 0;
+        for(int x=0; x<w; x++)
+        {
+            s  += (uint32_t)row[x];
+            s2 += (Tsq)row[x] * (Tsq)row[x];
+            sum_row   [x+1] = sum_prev   [x+1] + s;
+            sum_sq_row[x+1] = sum_sq_prev[x+1] + s2;
+        }
+    }
+}
+
+__attribute__((visibility("default")))
+bool image_integrals_compute(image_integrals_t* integrals, const cv::Mat& image)
+{
+    const int stride = image.cols+1;
+    const int N      = stride*(image.rows+1);
+
+    integrals->stride = stride;
+    integrals->sum.resize(N);
+
+    if( image.type() == CV_8U )
+    {
+        integrals->sum_sq_u32.resize(N);
+        compute_integrals<uint8_t>(integrals->sum.data(), integrals->sum_sq_u32.data(),
+                                   image);
+        return true;
+    }
+    if( image.type() == CV_16U )
+    {
+        integrals->sum_sq_u64.resize(N);
+        compute_integrals<uint16_t>(integrals->sum.data(), integrals->sum_sq_u64.data(),
+                                    image);
+        return true;
+    }
+
+    fprintf(stderr, "%s:%d in %s(): I can only handle CV_8U and CV_16U arrays currently."
+            " Sorry.\n", __FILE__, __LINE__, __func__);
+    return false;
+}
+
+const image_integrals_t* image_pyramid_t::get_integrals(int image_pyramid_level)
+{
+    const image_integrals_t* integrals = get_integrals_if_available(image_pyramid_level);
+    if(integrals != NULL)
+        return integrals;
+
+    const cv::Mat* image = get(image_pyramid_level);
+    if(image == NULL)
+        return NULL;
+
+    if(!image_integrals_compute(&this->integrals[image_pyramid_level], *image))
+        return NULL;
+    integrals_valid[image_pyramid_level] = true;
+    return &this->integrals[image_pyramid_level];
+}
+
+};
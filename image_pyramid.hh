@@ -0,0 +1,121 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <stdint.h>
+#include <vector>
+
+// The image pyramid used by the chessboard detector. Level l of the pyramid is
+// the input image cut down by a factor of 2**l in each dimension. Each level is
+// computed from the previous one with a 2x2 box filter: each output pixel is
+// the rounded mean of a 2x2 block of input pixels. Odd rows and columns at the
+// end are dropped. So pixel (x,y) at level l covers exactly the full-resolution
+// pixels [x*2**l, (x+1)*2**l) x [y*2**l, (y+1)*2**l).
+//
+// The levels are computed lazily, the first time they're asked for, and are
+// then kept around. So the auto-level search and the refinement share all
+// their downsampled images, and each is computed at most once per image.
+//
+// Each level can also have summed-area tables, for O(1) sums over any window.
+// These are also computed lazily, and kept.
+//
+// A pyramid isn't thread-safe in general. But once the levels themselves have
+// been computed, the tables of different levels may be asked for from
+// different threads at the same time.
+//
+// This is internal to mrgingham; it's not a part of the public API
+
+namespace mrgingham
+{
+    // 10 is an arbitrary high number. The rest of mrgingham rejects any
+    // image_pyramid_level above this
+#define MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX 10
+
+    // Cuts down a CV_8U or CV_16U image by a factor of 2 in each dimension.
+    // The output is (floor(w/2), floor(h/2)) pixels, each the rounded mean of
+    // the 2x2 block of input pixels it covers. The input may have any stride;
+    // the output is reallocated with cv::Mat::create(), so its storage is
+    // reused if it's already the right size. Up to Nthreads threads are used.
+    // Returns false if the input is too small or has an unsupported type
+    bool image_pyramid_downsample_2x2(cv::Mat& out, const cv::Mat& in,
+                                      int Nthreads = 1);
+
+    // The largest window the summed-area tables can sum over, in each dimension
+#define MRGINGHAM_IMAGE_INTEGRALS_WINDOW_MAX 255
+
+    // Summed-area tables of an image: the sums of the pixels and of their
+    // squares. Entry (x,y) is the sum over all pixels (x',y') with x' < x and
+    // y' < y, so the tables are (w+1)x(h+1). I accumulate with unsigned
+    // wraparound, so the tables don't need more bits than the window sums do:
+    // the sum over a window, computed from 4 entries, is exact as long as the
+    // window is at most MRGINGHAM_IMAGE_INTEGRALS_WINDOW_MAX pixels on a side.
+    // The squares of 8-bit pixels use 32 bits; the squares of 16-bit pixels
+    // use 64 bits
+    struct image_integrals_t
+    {
+        int stride; // w+1
+
+        std::vector<uint32_t> sum;
+        std::vector<uint32_t> sum_sq_u32; // for CV_8U images
+        std::vector<uint64_t> sum_sq_u64; // for CV_16U images
+    };
+
+    // Computes the summed-area tables of a CV_8U or CV_16U image. The storage
+    // of the tables is reused if it's big enough. Returns false if the image
+    // has an unsupported type
+    bool image_integrals_compute(image_integrals_t* integrals, const cv::Mat& image);
+
+    struct image_pyramid_t
+    {
+        // The input image. This is a view of the caller's data; it is not
+        // copied. The caller must keep it alive while the pyramid is in use
+        cv::Mat level[MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX+1];
+
+        // level[l] is valid for l <= Nlevels_valid-1
+        int Nlevels_valid;
+
+        int Nthreads;
+
+        // integrals[l] is valid if integrals_valid[l]. These are separate
+        // flags, so that different levels can be updated concurrently
+        image_integrals_t integrals      [MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX+1];
+        bool              integrals_valid[MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX+1];
+
+        image_pyramid_t() : Nlevels_valid(0), Nthreads(1), integrals_valid() {}
+
+        image_pyramid_t(const cv::Mat& image, int _Nthreads = 1)
+        {
+            reset(image, _Nthreads);
+        }
+
+        // Starts a new pyramid for a new image. The buffers of the old levels
+        // are kept, and reused if the new image is the same size as the old
+        void reset(const cv::Mat& image, int _Nthreads = 1)
+        {
+            level[0]      = image;
+            Nlevels_valid = 1;
+            Nthreads      = _Nthreads;
+            for(int l=0; l<=MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX; l++)
+                integrals_valid[l] = false;
+        }
+
+        // Returns the given level of the pyramid, computing it (and any levels
+        // in-between) if needed. Returns NULL on error
+        __attribute__((visibility("default")))
+        const cv::Mat* get(int image_pyramid_level);
+
+        // Returns the summed-area tables of the given level, computing them
+        // (and the level itself) if needed. Returns NULL on error
+        const image_integrals_t* get_integrals(int image_pyramid_level);
+
+        // Returns the summed-area tables of the given level if they have
+        // already been computed, and NULL otherwise
+        const image_integrals_t* get_integrals_if_available(int image_pyramid_level) const
+        {
+            if( image_pyramid_level < 0 ||
+                image_pyramid_level > MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX ||
+                !integrals_valid[image_pyramid_level] )
+                return NULL;
+            return &integrals[image_pyramid_level];
+        }
+    };
+};
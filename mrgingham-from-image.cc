@@ -1,5 +1,6 @@
 #include "mrgingham.hh"
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 #include <glob.h>
 #include <pthread.h>
@@ -18,9 +19,11 @@ struct mrgingham_thread_context_t
     int           blur_radius;
     bool          doblobs;
     bool          do_refine;
+    bool          do_covariance;
     bool          debug;
     debug_sequence_t debug_sequence;
     int           image_pyramid_level;
+    options_t     options;
 } ctx;
 
 static void* worker( void* _ijob )
@@ -38,8 +41,12 @@ static void* worker( void* _ijob )
         clahe->setClipLimit(8);
     }
 
-    // The buffer. I'll realloc() this as I go. MUST free at the end
-    signed char* refinement_level = NULL;
+    // Each worker has its own detector, with its own buffers. These are reused
+    // from image to image
+    ChessboardDetector       detector(ctx.options);
+    std::vector<PointDouble> points_out;
+    std::vector<signed char> refinement_level;
+    std::vector<CornerCovariance> covariances;
 
     for(int i_image=ijob; i_image<(int)ctx._glob->gl_pathc; i_image += ctx.Njobs)
     {
@@ -108,27 +115,30 @@ static void* worker( void* _ijob )
 
             } while(0);
         }
-        std::vector<PointDouble> points_out;
         bool result;
         int found_pyramid_level; // need this because ctx.image_pyramid_level could be -1
 
         if(ctx.doblobs)
         {
+            points_out.clear();
             result = find_circle_grid_from_image_array(points_out,
                                                        image,
-                                                       ctx.debug, ctx.debug_sequence);
+                                                       ctx.debug, ctx.debug_sequence,
+                                                       ctx.options.gridn_width,
+                                                       ctx.options.gridn_height);
             // ctx.image_pyramid_level == 0 here. cmdline parser makes sure.
             found_pyramid_level = 0;
         }
         else
         {
             found_pyramid_level =
-                find_chessboard_from_image_array (points_out,
-                                                  ctx.do_refine ? &refinement_level : NULL,
-                                                  image,
-                                                  ctx.image_pyramid_level,
-                                                  ctx.debug, ctx.debug_sequence,
-                                                  filename);
+                detector.find_chessboard_from_image_array (points_out,
+                                                           ctx.do_refine ? &refinement_level : NULL,
+                                                           image,
+                                                           ctx.image_pyramid_level,
+                                                           ctx.debug, ctx.debug_sequence,
+                                                           filename,
+                                                           ctx.do_covariance ? &covariances : NULL);
             result = (found_pyramid_level >= 0);
         }
 
@@ -137,19 +147,35 @@ static void* worker( void* _ijob )
             if( result )
             {
                 for(int i=0; i<(int)points_out.size(); i++)
-                    printf( "%s %f %f %d\n", filename,
+                {
+                    printf( "%s %f %f %d", filename,
                             points_out[i].x,
                             points_out[i].y,
-                            (refinement_level == NULL) ? found_pyramid_level : (int)refinement_level[i]);
+                            (ctx.doblobs || !ctx.do_refine) ? found_pyramid_level : (int)refinement_level[i]);
+                    if(ctx.do_covariance)
+                        printf(" %f %f %f",
+                               covariances[i].xx, covariances[i].xy, covariances[i].yy);
+                    printf("\n");
+                }
             }
             else
+            {
+                if(!ctx.doblobs)
+                {
+                    const prefilter_details_t& details = detector.get_prefilter_details();
+                    if(details.result != PREFILTER_NOT_RUN &&
+                       details.result != PREFILTER_ACCEPTED)
+                        printf("## %s: prefilter %s. Nsharp_pixels=%d\n",
+                               filename,
+                               prefilter_result_string(details.result),
+                               details.Nsharp_pixels);
+                }
                 printf("%s - -\n", filename);
+            }
         }
         funlockfile(stdout);
     }
 
-    free(refinement_level);
-
     return NULL;
 }
 
@@ -157,8 +183,12 @@ int main(int argc, char* argv[])
 {
     const char* usage =
         "Usage: %s [--debug] [--debug-sequence x,y]\n"
-        "                   [--jobs N] [--noclahe] [--blur radius]\n"
-        "                   [--level l] [--blobs] imageglobs imageglobs ...\n"
+        "                   [--jobs N] [--noclahe] [--blur radius] [--gridn N|WxH]\n"
+        "                   [--level l] [--level-hint l] [--remember-level]\n"
+        "                   [--speculative-levels] [--max-grid-candidates K]\n"
+        "                   [--prefilter] [--streaming] [--neighbor-graph voronoi|knn]\n"
+        "                   [--no-refine] [--refine-method chess|saddle] [--covariance]\n"
+        "                   [--blobs] imageglobs imageglobs ...\n"
         "\n"
         "  By default we look for a chessboard. By default we apply adaptive histogram\n"
         "  equalization, then blur with a radius of 1. We then use an adaptive level of\n"
@@ -173,18 +203,74 @@ int main(int argc, char* argv[])
         "  --blur radius   applies a blur (after CLAHE) to the image before processing.\n"
         "  By default we will blur with a radius of 1. To disable, set the radius to <= 0\n"
         "\n"
+        "  --gridn N|WxH  selects the size of the grid of corners (or circles) we look\n"
+        "  for. N means NxN. WxH means rows of W corners each, and H rows. The points are\n"
+        "  reported row by row. Normally the rows are the roughly-horizontal lines of\n"
+        "  corners in the image. A board that isn't square may also be rotated by 90\n"
+        "  degrees: its rows are then reported from right to left in the image, each\n"
+        "  from top to bottom. By default we look for 10x10 corners\n"
+        "\n"
         "  --level l   applies a downsampling to the image before processing it (after\n"
         "  CLAHE and --blur, if given) to the image before processing. Level 0 means\n"
         "  'use the original image'. Level > 0 means downsample by 2**level. Level < 0\n"
         "  means 'try several different levels until we find one that works. This is the\n"
         "  default.\n"
         "\n"
+        "  --level-hint l  When searching for the level (no --level given), try level l\n"
+        "  first. If all the images come from the same camera, with the board at a\n"
+        "  similar distance, the same level usually works for all of them. This skips\n"
+        "  the levels that would fail. If level l doesn't work, the usual search follows\n"
+        "\n"
+        "  --remember-level  When searching for the level, use the level that worked for\n"
+        "  the previous image as the hint for the next one. Each job processes its images\n"
+        "  in order, so the results depend on --jobs\n"
+        "\n"
+        "  --speculative-levels  When searching for the level, search all the levels at\n"
+        "  the same time, using the threads of each job. The coarsest level that works is\n"
+        "  used, as if trying levels 3,2,1,0 in order, but the latency is lower if there\n"
+        "  are spare cores. --level-hint and --remember-level aren't used for this\n"
+        "  search. With --debug, the levels are searched in order\n"
+        "\n"
+        "  --max-grid-candidates K  If more than K candidate corners are found, look for\n"
+        "  the chessboard among the K strongest ones first. Only if that fails are all\n"
+        "  the candidates used. This bounds the time spent on cluttered scenes. By\n"
+        "  default all the candidates are always used\n"
+        "\n"
+        "  --prefilter  When searching for the level, give up early on images that can't\n"
+        "  contain a chessboard: blank, out-of-focus or badly blurred ones. These have too\n"
+        "  few sharp edges at every level. This is much faster on footage where the board\n"
+        "  is often blurred away or absent. The reason for each rejection is reported in\n"
+        "  a comment\n"
+        "\n"
+        "  --streaming  Find the corners a few rows at a time, without storing the ChESS\n"
+        "  response of a whole image. This bounds the memory used for very large images.\n"
+        "  The results are the same\n"
+        "\n"
+        "  --neighbor-graph voronoi|knn  selects how the corners are linked to their\n"
+        "  neighbors before the rows and columns of the board are traced. 'voronoi' (the\n"
+        "  default) uses the voronoi diagram of the corners. 'knn' links each corner to\n"
+        "  its nearest few corners. This is faster with many corners, but a board in very\n"
+        "  dense clutter could be missed\n"
+        "\n"
         "  --no-refine  By default, the coordinates of reported corners are re-detected at\n"
         "  less-downsampled zoom levels to improve their accuracy. If we do not want to do\n"
         "  that, pass --no-refine\n"
         "\n"
+        "  --refine-method chess|saddle  selects how the corners are refined. 'chess'\n"
+        "  (the default) re-detects them at less-downsampled zoom levels, down to the\n"
+        "  full-resolution image. 'saddle' fits a quadratic saddle to the full-resolution\n"
+        "  image around each corner instead. This never computes a full-resolution ChESS\n"
+        "  response. The 'level' column is 0 for each corner whose saddle fit converged\n"
+        "\n"
+        "  --covariance  Adds the columns cov_xx, cov_xy, cov_yy to the output: the\n"
+        "  covariance of the ChESS response around each corner, in pixels^2. This is a\n"
+        "  relative measure of how well each corner is localized, from the same sums\n"
+        "  that give the corner position. The saddle refinement doesn't update it\n"
+        "\n"
         "  --jobs N  will parallelize the processing N-ways. -j is a synonym. This is like\n"
-        "  GNU make, except you're required to explicitly specify a job count.\n"
+        "  GNU make, except you're required to explicitly specify a job count. The images\n"
+        "  are distributed among the jobs. If there are more jobs than images, the extra\n"
+        "  jobs are used to process each image in parallel\n"
         "\n"
         "  The images are given as (multiple) globs. The output is a vnlog with columns\n"
         "  filename,x,y. All filenames matched in the glob will appear in the output.\n"
@@ -204,6 +290,16 @@ int main(int argc, char* argv[])
         { "noclahe",           no_argument,       NULL, 'C' },
         { "level",             required_argument, NULL, 'l' },
         { "no-refine",         no_argument,       NULL, 'R' },
+        { "refine-method",     required_argument, NULL, 'M' },
+        { "covariance",        no_argument,       NULL, 'V' },
+        { "level-hint",        required_argument, NULL, 'H' },
+        { "remember-level",    no_argument,       NULL, 'E' },
+        { "speculative-levels",no_argument,       NULL, 'S' },
+        { "max-grid-candidates",required_argument,NULL, 'K' },
+        { "prefilter",         no_argument,       NULL, 'P' },
+        { "streaming",         no_argument,       NULL, 'T' },
+        { "neighbor-graph",    required_argument, NULL, 'N' },
+        { "gridn",             required_argument, NULL, 'G' },
         { "jobs",              required_argument, NULL, 'j' },
         { "debug",             no_argument,       NULL, 'd' },
         { "debug-sequence",    required_argument, NULL, 'D' },
@@ -215,12 +311,23 @@ int main(int argc, char* argv[])
     bool        doblobs             = false;
     bool        doclahe             = true;
     bool        do_refine           = true;
+    bool        do_covariance       = false;
     bool        debug               = false;
     bool        debug_sequence      = false;
     PointInt    debug_sequence_pt;
     int         blur_radius         = 1;
     int         image_pyramid_level = -1;
     int         jobs                = 1;
+    refinement_method_t refinement_method = REFINEMENT_CHESS;
+    neighbor_graph_method_t neighbor_graph = NEIGHBOR_GRAPH_VORONOI;
+    int         level_hint          = -1;
+    bool        remember_level      = false;
+    bool        speculative_levels  = false;
+    int         grid_candidates_max = 0;
+    bool        prefilter           = false;
+    bool        streaming           = false;
+    int         gridn_width         = MRGINGHAM_GRIDN_DEFAULT;
+    int         gridn_height        = MRGINGHAM_GRIDN_DEFAULT;
 
     int opt;
     do
@@ -248,6 +355,18 @@ int main(int argc, char* argv[])
             do_refine = false;
             break;
 
+        case 'M':
+            if(     0 == strcmp(optarg, "chess"))  refinement_method = REFINEMENT_CHESS;
+            else if(0 == strcmp(optarg, "saddle")) refinement_method = REFINEMENT_SADDLE;
+            else
+            {
+                fprintf(stderr, "--refine-method must be 'chess' or 'saddle'. Got '%s'\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+
         case 'd':
             debug = true;
             break;
@@ -277,6 +396,69 @@ int main(int argc, char* argv[])
             jobs = atoi(optarg);
             break;
 
+        case 'H':
+            level_hint = atoi(optarg);
+            break;
+
+        case 'E':
+            remember_level = true;
+            break;
+
+        case 'S':
+            speculative_levels = true;
+            break;
+
+        case 'K':
+            grid_candidates_max = atoi(optarg);
+            break;
+
+        case 'P':
+            prefilter = true;
+            break;
+
+        case 'T':
+            streaming = true;
+            break;
+
+        case 'V':
+            do_covariance = true;
+            break;
+
+        case 'N':
+            if     (0 == strcmp(optarg, "voronoi")) neighbor_graph = NEIGHBOR_GRAPH_VORONOI;
+            else if(0 == strcmp(optarg, "knn"))     neighbor_graph = NEIGHBOR_GRAPH_KNN;
+            else
+            {
+                fprintf(stderr, "--neighbor-graph must be 'voronoi' or 'knn'. Got '%s'\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'G':
+        {
+            char x;
+            int Nread = sscanf(optarg, "%d%c%d", &gridn_width, &x, &gridn_height);
+            if(Nread == 1)
+                gridn_height = gridn_width;
+            else if(Nread != 3 || x != 'x')
+            {
+                fprintf(stderr, "I could not parse 'N' or 'WxH' from --gridn '%s'. Giving up\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            if(gridn_width < 3 || gridn_height < 3)
+            {
+                fprintf(stderr, "The grid must have at least 3 points in each direction. Got %dx%d\n",
+                        gridn_width, gridn_height);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+        }
+
         case '?':
             fprintf(stderr, "Unknown option\n");
             fprintf(stderr, usage, argv[0]);
@@ -301,6 +483,17 @@ int main(int argc, char* argv[])
         fprintf(stderr, "ERROR: 'image_pyramid_level' only implemented for chessboards.\n");
         return 1;
     }
+    if( doblobs && (streaming || do_covariance || neighbor_graph != NEIGHBOR_GRAPH_VORONOI) )
+    {
+        fprintf(stderr, "ERROR: --streaming, --covariance and --neighbor-graph only make sense when looking for a chessboard.\n");
+        return 1;
+    }
+    if( (level_hint >= 0 || remember_level || speculative_levels || prefilter) &&
+        (doblobs || image_pyramid_level >= 0) )
+    {
+        fprintf(stderr, "ERROR: --level-hint, --remember-level, --speculative-levels and --prefilter only make sense when searching for the level of a chessboard.\n");
+        return 1;
+    }
 
     glob_t _glob;
     int doappend = 0;
@@ -339,7 +532,10 @@ int main(int argc, char* argv[])
         printf(" %s", argv[i]);
     printf("\n");
 
-    printf("# filename x y level\n");
+    if(do_covariance)
+        printf("# filename x y level cov_xx cov_xy cov_yy\n");
+    else
+        printf("# filename x y level\n");
 
     // I'm done with the preliminaries. I now spawn the child threads. Note that
     // in this implementation it is important that these are THREADS and not a
@@ -347,11 +543,11 @@ int main(int argc, char* argv[])
     // use flockfile(), and each child thread writes directly to stdout.
     // flockfile() does not work in a fork, but does work in a thread
     ctx._glob               = &_glob;
-    ctx.Njobs               = jobs;
     ctx.doclahe             = doclahe;
     ctx.blur_radius         = blur_radius;
     ctx.doblobs             = doblobs;
     ctx.do_refine           = do_refine;
+    ctx.do_covariance       = do_covariance;
     ctx.debug               = debug;
 
     ctx.debug_sequence.dodebug = debug_sequence;
@@ -359,6 +555,26 @@ int main(int argc, char* argv[])
 
     ctx.image_pyramid_level = image_pyramid_level;
 
+    ctx.options.refinement_method        = refinement_method;
+    ctx.options.image_pyramid_level_hint = level_hint;
+    ctx.options.remember_pyramid_level   = remember_level;
+    ctx.options.speculative_levels       = speculative_levels;
+    ctx.options.grid_candidates_max      = grid_candidates_max;
+    ctx.options.prefilter                = prefilter;
+    ctx.options.streaming                = streaming;
+    ctx.options.neighbor_graph           = neighbor_graph;
+    ctx.options.gridn_width              = gridn_width;
+    ctx.options.gridn_height             = gridn_height;
+
+    // I have one worker thread per image, at most. If there are more jobs than
+    // that, the rest are used inside each image
+    int Nworkers = jobs;
+    if(Nworkers > (int)_glob.gl_pathc)
+        Nworkers = (int)_glob.gl_pathc;
+    ctx.Njobs            = Nworkers;
+    ctx.options.Nthreads = jobs / Nworkers;
+
+    jobs = Nworkers;
     pthread_t thread[jobs];
     for(int i=0; i<jobs; i++)
         pthread_create(&thread[i], NULL, &worker, (void*)i);
@@ -2,3 +2,33 @@
 
 #define FIND_GRID_SCALE 1000 /* Voronoi diagram is integer-only, so I scale-up
                                 to get more resolution */
+
+#include <vector>
+#include "point.hh"
+#include "mrgingham.hh"
+
+namespace mrgingham
+{
+    // The working buffers of find_grid_from_points(). Callers that find many
+    // grids can allocate these once, and pass them to every call
+    struct find_grid_buffers_t;
+    find_grid_buffers_t* find_grid_buffers_alloc(void);
+    void                 find_grid_buffers_free(find_grid_buffers_t* buffers);
+
+    // If polarities is non-NULL, it has the polarity of each point, and I only
+    // link points with opposite polarities into the rows and columns of the
+    // grid. neighbor_graph selects how I decide which points are neighbors. The
+    // grid has gridn_height rows of gridn_width points each. If indices_out is
+    // non-NULL, I return in it the index into points of each point in
+    // points_out
+    bool find_grid_from_points( std::vector<mrgingham::PointDouble>& points_out,
+                                const std::vector<mrgingham::PointInt>& points,
+                                bool     debug,
+                                const debug_sequence_t& debug_sequence,
+                                find_grid_buffers_t* buffers,
+                                const std::vector<mrgingham::CornerPolarity>* polarities = NULL,
+                                neighbor_graph_method_t neighbor_graph = NEIGHBOR_GRAPH_VORONOI,
+                                int gridn_width  = MRGINGHAM_GRIDN_DEFAULT,
+                                int gridn_height = MRGINGHAM_GRIDN_DEFAULT,
+                                std::vector<int>* indices_out = NULL);
+};
@@ -1,6 +1,13 @@
 #include "mrgingham.hh"
 #include "find_blobs.hh"
 #include "find_chessboard_corners.hh"
+#include "thread_pool.hh"
+#include "mrgingham-internal.h"
+
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
 
 #include <opencv2/highgui/highgui.hpp>
 
@@ -11,48 +18,359 @@ namespace mrgingham
     bool find_circle_grid_from_image_array( std::vector<PointDouble>& points_out,
                                             const cv::Mat& image,
                                             bool     debug,
-                                            debug_sequence_t debug_sequence)
+                                            debug_sequence_t debug_sequence,
+                                            int      gridn_width,
+                                            int      gridn_height)
     {
         std::vector<PointInt> points;
         find_blobs_from_image_array(&points, image);
         return find_grid_from_points(points_out, points,
-                                     debug, debug_sequence);
+                                     debug, debug_sequence,
+                                     gridn_width, gridn_height);
     }
 
     __attribute__((visibility("default")))
     bool find_circle_grid_from_image_file( std::vector<PointDouble>& points_out,
                                            const char* filename,
                                            bool     debug,
-                                           debug_sequence_t debug_sequence)
+                                           debug_sequence_t debug_sequence,
+                                           int      gridn_width,
+                                           int      gridn_height)
     {
         std::vector<PointInt> points;
         find_blobs_from_image_file(&points, filename);
         return find_grid_from_points(points_out, points,
-                                     debug, debug_sequence);
+                                     debug, debug_sequence,
+                                     gridn_width, gridn_height);
     }
 
-    // *refinement_level is managed by realloc(). IT IS THE CALLER'S
-    // *RESPONSIBILITY TO free() IT
-    static bool _find_chessboard_from_image_array( std::vector<PointDouble>& points_out,
-                                                   signed char** refinement_level,
-                                                   const cv::Mat& image,
-                                                   int image_pyramid_level,
-                                                   bool     debug,
-                                                   debug_sequence_t debug_sequence,
-                                                   const char* debug_image_filename)
+    // The automatic level search starts at this level, unless it has a hint
+#define LEVEL_SEARCH_START 3
+
+    // The scratch space of find_grid_staged()
+    struct grid_candidates_t
+    {
+        std::vector<int16_t>          strengths;
+        std::vector<CornerPolarity>   polarities;
+        std::vector<CornerCovariance> covariances;
+        std::vector<int>              order;
+        std::vector<PointInt>         points_strongest;
+        std::vector<CornerPolarity>   polarities_strongest;
+
+        // The index of the candidate each grid point came from
+        std::vector<int>              grid_indices;
+    };
+
+    // The grid finder tells me which candidate each grid point came from, so I
+    // look up its covariance directly
+    static void get_grid_covariances(std::vector<CornerCovariance>* covariances_out,
+                                     const grid_candidates_t& candidates)
+    {
+        const int N = (int)candidates.grid_indices.size();
+        covariances_out->resize(N);
+        for(int i=0; i<N; i++)
+            (*covariances_out)[i] = candidates.covariances[candidates.grid_indices[i]];
+    }
+
+    // The working memory of the search at one pyramid level, when several
+    // levels are searched concurrently
+    struct speculative_slot_t
+    {
+        chessboard_corners_buffers_t* corners_buffers;
+        find_grid_buffers_t*          grid_buffers;
+        std::vector<PointInt>         points;
+        grid_candidates_t             candidates;
+        std::vector<PointDouble>      points_out;
+
+        // Set when a coarser level has succeeded. The corner finder at this
+        // level then gives up
+        std::atomic<bool>             cancelled;
+    };
+
+    // Looks for the grid among the given candidate points. If there are more
+    // than options.grid_candidates_max of them, I look among the strongest
+    // ones first, and fall back to the full set if that fails. The strongest
+    // candidates are passed to the grid finder in their original order. On
+    // success, candidates->grid_indices has the index into points of each grid
+    // point
+    static bool find_grid_staged( std::vector<PointDouble>& points_out,
+                                  const std::vector<PointInt>& points,
+                                  grid_candidates_t* candidates,
+                                  const options_t& options,
+                                  bool debug,
+                                  const debug_sequence_t& debug_sequence,
+                                  find_grid_buffers_t* grid_buffers)
+    {
+        const int N = (int)points.size();
+        const int K = options.grid_candidates_max;
+        if(K > 0 && N > K)
+        {
+            const std::vector<int16_t>& strengths = candidates->strengths;
+            std::vector<int>&           order     = candidates->order;
+
+            order.resize(N);
+            for(int i=0; i<N; i++)
+                order[i] = i;
+
+            // Strongest first. Ties go to the earlier point, so the selection
+            // is deterministic
+            std::nth_element(order.begin(), order.begin() + K, order.end(),
+                             [&](int a, int b)
+                             {
+                                 if(strengths[a] != strengths[b])
+                                     return strengths[a] > strengths[b];
+                                 return a < b;
+                             });
+            std::sort(order.begin(), order.begin() + K);
+
+            candidates->points_strongest    .resize(K);
+            candidates->polarities_strongest.resize(K);
+            for(int i=0; i<K; i++)
+            {
+                candidates->points_strongest    [i] = points[order[i]];
+                candidates->polarities_strongest[i] = candidates->polarities[order[i]];
+            }
+
+            if(find_grid_from_points(points_out, candidates->points_strongest,
+                                     debug, debug_sequence,
+                                     grid_buffers,
+                                     &candidates->polarities_strongest,
+                                     options.neighbor_graph,
+                                     options.gridn_width, options.gridn_height,
+                                     &candidates->grid_indices))
+            {
+                for(int& i : candidates->grid_indices)
+                    i = order[i];
+                return true;
+            }
+            if(debug)
+                fprintf(stderr, "Didn't find the grid among the %d strongest of %d candidates. Trying all of them\n",
+                        K, N);
+        }
+
+        return find_grid_from_points(points_out, points,
+                                     debug, debug_sequence,
+                                     grid_buffers,
+                                     &candidates->polarities,
+                                     options.neighbor_graph,
+                                     options.gridn_width, options.gridn_height,
+                                     &candidates->grid_indices);
+    }
+
+    // Everything a ChessboardDetector keeps from image to image
+    struct ChessboardDetector::context_t
+    {
+        image_pyramid_t               pyramid;
+        chessboard_corners_buffers_t* corners_buffers;
+        find_grid_buffers_t*          grid_buffers;
+        std::vector<PointInt>         points;
+
+        grid_candidates_t             candidates;
+
+        // The pyramid level of the last successful detection, or <0 if there
+        // wasn't one yet
+        int                           last_found_level;
+
+        // What the prefilter thought of the last image
+        prefilter_details_t           prefilter_details;
+
+        // For options_t::speculative_levels. One slot per level. The buffers
+        // are allocated the first time they're needed
+        speculative_slot_t            speculative[LEVEL_SEARCH_START+1];
+    };
+
+    // The prefilter. A pixel is sharp if it differs from its right or lower
+    // neighbor by at least PREFILTER_SHARP_CONTRAST (in 8-bit units). A
+    // chessboard has lots of these along the edges of its squares at one level
+    // or another: small squares at the fine levels, and blurry squares at the
+    // coarse levels, where the blur is narrower. I count them at each level
+    // the search looks at, starting with the coarsest one, which is the
+    // cheapest. I stop at the first level with at least
+    // PREFILTER_SHARP_PIXELS_MIN sharp pixels, and then the full search runs.
+    // If no level has that many, the image is blank, or too blurry for the
+    // corner finder at any level, and I give up on it. The edges of small
+    // squares are sharp at the fine levels, so small boards aren't rejected
+#define PREFILTER_SHARP_CONTRAST      32
+#define PREFILTER_SHARP_PIXELS_MIN    100
+
+    __attribute__((visibility("default")))
+    const char* prefilter_result_string(prefilter_result_t result)
+    {
+        switch(result)
+        {
+        case PREFILTER_NOT_RUN:              return "not run";
+        case PREFILTER_ACCEPTED:             return "accepted";
+        case PREFILTER_REJECTED_NOT_SHARP:   return "rejected: too few sharp edges";
+        }
+        return "unknown";
+    }
+
+    // I stop counting once I've seen PREFILTER_SHARP_PIXELS_MIN
+    template<typename T>
+    static int count_sharp_pixels_typed(const cv::Mat& image, int contrast)
+    {
+        int N = 0;
+        for(int y=0; y<image.rows-1 && N < PREFILTER_SHARP_PIXELS_MIN; y++)
+        {
+            const T* row  = image.ptr<T>(y);
+            const T* next = image.ptr<T>(y+1);
+            for(int x=0; x<image.cols-1; x++)
+            {
+                int v = (int)row[x];
+                if(abs((int)row[x+1] - v) >= contrast ||
+                   abs((int)next[x]  - v) >= contrast)
+                    N++;
+            }
+        }
+        return N;
+    }
+
+    // Returns the number of sharp pixels in the given level, or <0 on error
+    static int count_sharp_pixels(image_pyramid_t* pyramid, int image_pyramid_level,
+                                  const options_t& options)
+    {
+        const cv::Mat* image = pyramid->get(image_pyramid_level);
+        if(image == NULL)
+            return -1;
+
+        if(image->type() == CV_8U)
+            return count_sharp_pixels_typed<uint8_t>(*image, PREFILTER_SHARP_CONTRAST);
+        if(image->type() == CV_16U)
+        {
+            // An invalid bit depth is reported by the corner finder
+            int image_shift = options.bit_depth - 8;
+            if(image_shift < 0) image_shift = 0;
+            if(image_shift > 8) image_shift = 8;
+            return count_sharp_pixels_typed<uint16_t>(*image, PREFILTER_SHARP_CONTRAST << image_shift);
+        }
+        return -1;
+    }
+
+    // Runs the prefilter. Returns false if the image should be rejected
+    static bool prefilter_is_sharp(prefilter_details_t* details,
+                                   image_pyramid_t* pyramid,
+                                   const options_t& options,
+                                   bool debug)
+    {
+        details->result = PREFILTER_ACCEPTED;
+        for(int level = LEVEL_SEARCH_START; level >= 0; level--)
+        {
+            int Nsharp_pixels = count_sharp_pixels(pyramid, level, options);
+            if(debug)
+                fprintf(stderr, "Prefilter: %d sharp pixels at level %d\n",
+                        Nsharp_pixels, level);
+
+            // If I couldn't count, I let the search report the problem
+            if(Nsharp_pixels < 0)
+                return true;
+
+            if(Nsharp_pixels > details->Nsharp_pixels)
+                details->Nsharp_pixels = Nsharp_pixels;
+            if(Nsharp_pixels >= PREFILTER_SHARP_PIXELS_MIN)
+            {
+                details->sharp_level = level;
+                return true;
+            }
+        }
+
+        details->result = PREFILTER_REJECTED_NOT_SHARP;
+        return false;
+    }
+
+    __attribute__((visibility("default")))
+    ChessboardDetector::ChessboardDetector(const options_t& _options) :
+        ctx(new context_t),
+        options(_options)
+    {
+        ctx->corners_buffers  = chessboard_corners_buffers_alloc();
+        ctx->grid_buffers     = find_grid_buffers_alloc();
+        ctx->last_found_level = -1;
+        for(int l=0; l<=LEVEL_SEARCH_START; l++)
+        {
+            ctx->speculative[l].corners_buffers = NULL;
+            ctx->speculative[l].grid_buffers    = NULL;
+        }
+    }
+
+    __attribute__((visibility("default")))
+    ChessboardDetector::~ChessboardDetector()
+    {
+        chessboard_corners_buffers_free(ctx->corners_buffers);
+        find_grid_buffers_free         (ctx->grid_buffers);
+        for(int l=0; l<=LEVEL_SEARCH_START; l++)
+        {
+            chessboard_corners_buffers_free(ctx->speculative[l].corners_buffers);
+            find_grid_buffers_free         (ctx->speculative[l].grid_buffers);
+        }
+        delete ctx;
+    }
+
+    bool ChessboardDetector::find_chessboard_at_level( std::vector<PointDouble>& points_out,
+                                                       std::vector<signed char>* refinement_level,
+                                                       std::vector<CornerCovariance>* covariances_out,
+                                                       int image_pyramid_level,
+                                                       bool     debug,
+                                                       const debug_sequence_t& debug_sequence,
+                                                       const char* debug_image_filename)
     {
         const bool do_refine = (refinement_level != NULL);
 
-        std::vector<PointInt> points;
-        find_chessboard_corners_from_image_array(&points, image, image_pyramid_level, debug, debug_image_filename);
-        if(!find_grid_from_points(points_out, points,
-                                  debug, debug_sequence))
+        std::vector<PointInt>& points = ctx->points;
+        points.clear();
+        ctx->candidates.strengths  .clear();
+        ctx->candidates.polarities .clear();
+        ctx->candidates.covariances.clear();
+        find_chessboard_corners_from_image_array(&points, &ctx->pyramid, image_pyramid_level,
+                                                 debug, debug_image_filename,
+                                                 options, ctx->corners_buffers,
+                                                 &ctx->candidates.strengths,
+                                                 &ctx->candidates.polarities,
+                                                 covariances_out == NULL ? NULL : &ctx->candidates.covariances);
+        if(!find_grid_staged(points_out, points, &ctx->candidates,
+                             options, debug, debug_sequence,
+                             ctx->grid_buffers))
             return false;
 
-        // we found a grid! If we're not trying to refine the locations, or if
-        // we can't refine them, we're done
-        if(!do_refine || image_pyramid_level == 0)
-            return true;
+        if(covariances_out != NULL)
+            get_grid_covariances(covariances_out, ctx->candidates);
+        if(do_refine)
+            refine_from_level(points_out, refinement_level, covariances_out,
+                              image_pyramid_level,
+                              debug, debug_image_filename);
+        return true;
+    }
+
+    // Refines the points found at the given level. The pyramid level of each
+    // point is returned in (*refinement_level)[i]
+    void ChessboardDetector::refine_from_level( std::vector<PointDouble>& points_out,
+                                                std::vector<signed char>* refinement_level,
+                                                std::vector<CornerCovariance>* covariances_out,
+                                                int image_pyramid_level,
+                                                bool debug,
+                                                const char* debug_image_filename)
+    {
+        int N = points_out.size();
+        refinement_level->resize(N);
+        for(int i=0; i<N; i++)
+            (*refinement_level)[i] = (signed char)image_pyramid_level;
+
+        if(options.refinement_method == REFINEMENT_SADDLE)
+        {
+            // I go straight to the full-resolution image. Even the points found
+            // at level 0 are improved by this
+            int Nrefined =
+                refine_chessboard_corners_saddle( &points_out,
+                                                  refinement_level->data(),
+                                                  &ctx->pyramid,
+                                                  debug, options );
+            if(debug)
+                fprintf(stderr, "Saddle refinement: Nrefined=%d/%d\n", Nrefined, N);
+            return;
+        }
+
+        // we found a grid! If we can't refine the locations, we're done
+        if(image_pyramid_level == 0)
+            return;
 
         // Alright, I need to refine each intersection. Big-picture logic:
         //
@@ -74,27 +392,208 @@ namespace mrgingham
         //       if( no points remain refinable )
         //           break;
         //   }
-
-        int N = points_out.size();
-        *refinement_level = (signed char*)realloc((void*)*refinement_level, N*sizeof(**refinement_level));
-        assert(*refinement_level);
-        for(int i=0; i<N; i++)
-            (*refinement_level)[i] = (signed char)image_pyramid_level;
-
         while(image_pyramid_level--)
         {
             int Nrefined =
                 mrgingham::
                 refine_chessboard_corners_from_image_array( &points_out,
-                                                            *refinement_level,
-                                                            image, image_pyramid_level,
-                                                            debug, debug_image_filename);
+                                                            refinement_level->data(),
+                                                            &ctx->pyramid, image_pyramid_level,
+                                                            debug, debug_image_filename,
+                                                            options, ctx->corners_buffers,
+                                                            covariances_out);
             if(debug)
                 fprintf(stderr, "Refining to level %d... Nrefined=%d\n", image_pyramid_level, Nrefined);
             if(Nrefined <= 0)
                 break;
         }
-        return true;
+    }
+
+    // Searches all the levels LEVEL_SEARCH_START..0 at the same time. Each level
+    // has its own buffers, and the pyramid is fully built before I start, so
+    // the searches don't share anything they write to. When a level succeeds,
+    // the finer levels are cancelled: the ones that haven't started yet don't
+    // start, and the corner finders that are running give up at their next
+    // band of the ChESS response. Once all the searches are done, the coarsest
+    // successful level wins, just like in the sequential search. Then I refine
+    // the winner
+    int ChessboardDetector::find_chessboard_speculatively( std::vector<PointDouble>& points_out,
+                                                           std::vector<signed char>* refinement_level,
+                                                           std::vector<CornerCovariance>* covariances_out,
+                                                           bool debug,
+                                                           const debug_sequence_t& debug_sequence,
+                                                           const char* debug_image_filename)
+    {
+        if(ctx->pyramid.get(LEVEL_SEARCH_START) == NULL)
+            return -1;
+
+        for(int l=0; l<=LEVEL_SEARCH_START; l++)
+        {
+            speculative_slot_t* slot = &ctx->speculative[l];
+            if(slot->corners_buffers == NULL)
+                slot->corners_buffers = chessboard_corners_buffers_alloc();
+            if(slot->grid_buffers == NULL)
+                slot->grid_buffers = find_grid_buffers_alloc();
+            slot->cancelled = false;
+        }
+
+        // The coarsest level that has succeeded so far
+        std::atomic<int> level_found(-1);
+
+        const int Nthreads = options.Nthreads > 0 ? options.Nthreads : get_Ncores();
+        parallel_for(LEVEL_SEARCH_START+1, Nthreads,
+                     [&](int i)
+                     {
+                         // I start the coarse levels first: they're the
+                         // cheapest, and they win if they succeed
+                         const int level = LEVEL_SEARCH_START - i;
+                         speculative_slot_t* slot = &ctx->speculative[level];
+
+                         slot->points.clear();
+                         slot->points_out.clear();
+                         slot->candidates.strengths  .clear();
+                         slot->candidates.polarities .clear();
+                         slot->candidates.covariances.clear();
+
+                         // With Nthreads == 1 the levels run one after
+                         // another, so a coarser level may already have won
+                         if(level_found.load() > level)
+                             return;
+
+                         find_chessboard_corners_from_image_array(&slot->points,
+                                                                  &ctx->pyramid, level,
+                                                                  debug, debug_image_filename,
+                                                                  options, slot->corners_buffers,
+                                                                  &slot->candidates.strengths,
+                                                                  &slot->candidates.polarities,
+                                                                  covariances_out == NULL ? NULL : &slot->candidates.covariances,
+                                                                  &slot->cancelled);
+                         if(level_found.load() > level)
+                             return;
+
+                         if(!find_grid_staged(slot->points_out, slot->points,
+                                              &slot->candidates,
+                                              options, debug, debug_sequence,
+                                              slot->grid_buffers))
+                             return;
+
+                         int l = level_found.load();
+                         while(l < level &&
+                               !level_found.compare_exchange_weak(l, level))
+                             ;
+
+                         // The finer levels can't win anymore
+                         for(int l_finer=0; l_finer<level; l_finer++)
+                             ctx->speculative[l_finer].cancelled = true;
+                     });
+
+        int level = level_found.load();
+        if(level < 0)
+            return -1;
+
+        points_out.swap(ctx->speculative[level].points_out);
+        if(covariances_out != NULL)
+            get_grid_covariances(covariances_out, ctx->speculative[level].candidates);
+        if(refinement_level != NULL)
+            refine_from_level(points_out, refinement_level, covariances_out,
+                              level,
+                              debug, debug_image_filename);
+        return level;
+    }
+
+    __attribute__((visibility("default")))
+    int ChessboardDetector::find_chessboard_from_image_array( std::vector<PointDouble>& points_out,
+                                                              std::vector<signed char>* refinement_level,
+                                                              const cv::Mat& image,
+                                                              int image_pyramid_level,
+                                                              bool debug,
+                                                              debug_sequence_t debug_sequence,
+                                                              const char* debug_image_filename,
+                                                              std::vector<CornerCovariance>* covariances_out)
+    {
+        points_out.clear();
+        if(covariances_out != NULL)
+            covariances_out->clear();
+        ctx->prefilter_details = prefilter_details_t();
+
+        // All the levels I look at share this pyramid, so each downsampled
+        // image is computed at most once, whether it's used for the search or
+        // for the refinement
+        ctx->pyramid.reset(image, options.Nthreads > 0 ? options.Nthreads : get_Ncores());
+
+        if( image_pyramid_level >= 0)
+            return
+                find_chessboard_at_level( points_out,
+                                          refinement_level,
+                                          covariances_out,
+                                          image_pyramid_level,
+                                          debug, debug_sequence,
+                                          debug_image_filename)
+                ? image_pyramid_level : -1;
+
+        if(options.prefilter &&
+           !prefilter_is_sharp(&ctx->prefilter_details, &ctx->pyramid, options, debug))
+        {
+            if(debug)
+                fprintf(stderr, "Prefilter %s\n",
+                        prefilter_result_string(ctx->prefilter_details.result));
+            return -1;
+        }
+
+        // The concurrent searches would all write the same debug files, and
+        // interleave their messages. With debug, I search the levels in order
+        if(options.speculative_levels && !debug)
+        {
+            int level = find_chessboard_speculatively( points_out,
+                                                       refinement_level,
+                                                       covariances_out,
+                                                       debug, debug_sequence,
+                                                       debug_image_filename );
+            if(level >= 0)
+                ctx->last_found_level = level;
+            return level;
+        }
+
+        // I try the levels in order until one works. Each level is tried at
+        // most once
+        bool tried[MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX+1] = {};
+        auto try_level = [&](int level)
+        {
+            if(level < 0 || level > MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX || tried[level])
+                return false;
+            tried[level] = true;
+            if(debug)
+                fprintf(stderr, "Looking for a chessboard at level %d\n", level);
+            if(!find_chessboard_at_level( points_out,
+                                          refinement_level,
+                                          covariances_out,
+                                          level,
+                                          debug, debug_sequence,
+                                          debug_image_filename))
+                return false;
+            ctx->last_found_level = level;
+            return true;
+        };
+
+        int level_hint = options.image_pyramid_level_hint;
+        if(options.remember_pyramid_level && ctx->last_found_level >= 0)
+            level_hint = ctx->last_found_level;
+
+        if(try_level(level_hint))
+            return level_hint;
+
+        // Then the usual search, from the coarsest level. If the hint was one
+        // of these levels, it isn't tried again
+        for( image_pyramid_level=LEVEL_SEARCH_START; image_pyramid_level>=0; image_pyramid_level--)
+            if(try_level(image_pyramid_level))
+                return image_pyramid_level;
+        return -1;
+    }
+
+    __attribute__((visibility("default")))
+    const prefilter_details_t& ChessboardDetector::get_prefilter_details() const
+    {
+        return ctx->prefilter_details;
     }
 
     // *refinement_level is managed by realloc(). IT IS THE CALLER'S
@@ -106,31 +605,29 @@ namespace mrgingham
                                           int image_pyramid_level,
                                           bool debug,
                                           debug_sequence_t debug_sequence,
-                                          const char* debug_image_filename)
+                                          const char* debug_image_filename,
+                                          const options_t& options,
+                                          std::vector<CornerCovariance>* covariances_out)
 
     {
-        if( image_pyramid_level >= 0)
-            return
-                _find_chessboard_from_image_array( points_out,
-                                                   refinement_level,
-                                                   image,
-                                                   image_pyramid_level,
-                                                   debug, debug_sequence,
-                                                   debug_image_filename)
-                ? image_pyramid_level : -1;
+        ChessboardDetector detector(options);
 
-        for( image_pyramid_level=3; image_pyramid_level>=0; image_pyramid_level--)
+        std::vector<signed char> level;
+        int result =
+            detector.find_chessboard_from_image_array( points_out,
+                                                       refinement_level ? &level : NULL,
+                                                       image, image_pyramid_level,
+                                                       debug, debug_sequence,
+                                                       debug_image_filename,
+                                                       covariances_out );
+        if(result >= 0 && refinement_level != NULL)
         {
-            int result = _find_chessboard_from_image_array( points_out,
-                                                            refinement_level,
-                                                            image,
-                                                            image_pyramid_level,
-                                                            debug, debug_sequence,
-                                                            debug_image_filename)
-                ? image_pyramid_level : -1;
-            if(result >= 0) return result;
+            int N = level.size();
+            *refinement_level = (signed char*)realloc((void*)*refinement_level, N*sizeof(**refinement_level));
+            assert(*refinement_level);
+            memcpy(*refinement_level, level.data(), N*sizeof(**refinement_level));
         }
-        return -1;
+        return result;
     }
 
     // *refinement_level is managed by realloc(). IT IS THE CALLER'S
@@ -141,7 +638,8 @@ namespace mrgingham
                                          const char* filename,
                                          int image_pyramid_level,
                                          bool debug,
-                                         debug_sequence_t debug_sequence)
+                                         debug_sequence_t debug_sequence,
+                                         const options_t& options)
     {
         cv::Mat image = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
         if( image.data == NULL )
@@ -156,6 +654,7 @@ namespace mrgingham
                                                 refinement_level,
                                                 image, image_pyramid_level,
                                                 debug, debug_sequence,
-                                                filename);
+                                                filename,
+                                                options);
     }
 };
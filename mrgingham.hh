@@ -8,6 +8,9 @@
 // I look for white-on-black dots
 
 
+// The grid I look for, unless asked for something else: 10x10 points
+#define MRGINGHAM_GRIDN_DEFAULT 10
+
 namespace mrgingham
 {
 
@@ -21,14 +24,191 @@ namespace mrgingham
         {}
     };
 
+    // How the detected corners are refined
+    enum refinement_method_t
+    {
+        // Re-detect each corner with ChESS at finer and finer pyramid levels,
+        // down to the full-resolution image
+        REFINEMENT_CHESS,
+
+        // Fit a quadratic saddle to the full-resolution image around each
+        // corner. This never computes a full-resolution ChESS response
+        REFINEMENT_SADDLE
+    };
+
+    // How the grid finder decides which corners are neighbors. It then traces
+    // the rows and columns of the grid along these links
+    enum neighbor_graph_method_t
+    {
+        // Two corners are neighbors if their cells in the voronoi diagram
+        // touch. Boost builds the diagram
+        NEIGHBOR_GRAPH_VORONOI,
+
+        // Each corner is linked to its few nearest corners (of the opposite
+        // polarity, if known), found with a uniform grid of cells. This is
+        // cheaper to build than the voronoi diagram, and it doesn't allocate
+        // once the buffers are warmed-up. With very dense clutter around the
+        // board, the grid neighbors of a corner might not be among its nearest
+        // ones, and the board could be missed
+        NEIGHBOR_GRAPH_KNN
+    };
+
+    // What the no-board prefilter (options_t::prefilter) concluded about an
+    // image
+    enum prefilter_result_t
+    {
+        // The prefilter is off, or it doesn't apply to this search
+        PREFILTER_NOT_RUN,
+
+        // The image might contain a chessboard, so the full search ran
+        PREFILTER_ACCEPTED,
+
+        // Too few sharp edges at every level: the image is blank, out of
+        // focus or badly motion-blurred
+        PREFILTER_REJECTED_NOT_SHARP
+    };
+
+    struct prefilter_details_t
+    {
+        prefilter_result_t result;
+
+        // The most pixels with a strong intensity gradient that the prefilter
+        // saw at any one level. It stops counting once a level has enough
+        int Nsharp_pixels;
+
+        // The first level, from the coarsest, with enough of those pixels, or
+        // <0 if there wasn't one
+        int sharp_level;
+
+        prefilter_details_t() :
+            result(PREFILTER_NOT_RUN),
+            Nsharp_pixels(0),
+            sharp_level(-1)
+        {}
+    };
+
+    // A short human-readable description of a prefilter result
+    const char* prefilter_result_string(prefilter_result_t result);
+
+    // Knobs that control how the chessboard detector does its work. The
+    // defaults are reasonable; the caller can construct one of these, and
+    // modify whatever they care about
+    struct options_t
+    {
+        // How many threads to use to process a single image. 1 means "do
+        // everything in the calling thread". <= 0 means "use all the cores".
+        // Each parallel_for() in the processing of an image uses at most this
+        // many threads
+        int Nthreads;
+
+        // CV_16U images are accepted as well as CV_8U ones. This is the number
+        // of significant bits in each pixel of such images: 12 for a 12-bit
+        // sensor, for instance. Must be in [8,16]. Ignored for CV_8U images
+        int bit_depth;
+
+        // Each candidate corner must sit in a region of high intensity
+        // variance; this rejects false detections inside the chessboard
+        // squares. This is the radius of the square window where the variance
+        // is computed. The variance comes from summed-area tables, so a bigger
+        // window doesn't cost more. Must be in [1,127]
+        int variance_window_radius;
+
+        // How the corners are refined, if the caller asks for refinement
+        refinement_method_t refinement_method;
+
+        // When searching for the pyramid level (image_pyramid_level < 0), try
+        // this level first. If the camera and the board distance don't change
+        // much from image to image, the same level works for all of them, and
+        // this skips the levels that would fail. <0 means "no hint"
+        int image_pyramid_level_hint;
+
+        // If true, a ChessboardDetector searching for the pyramid level uses
+        // the level of its last successful detection as the hint for the next
+        // image. Until it has found a chessboard, image_pyramid_level_hint is
+        // used
+        bool remember_pyramid_level;
+
+        // If true, the level search (image_pyramid_level < 0) looks at all the
+        // levels at the same time, on up to Nthreads threads, instead of one
+        // after another. When a level succeeds, the finer levels still being
+        // searched are cancelled. The coarsest successful level wins, as it
+        // would if the levels were tried in order: 3,2,1,0. But the latency is
+        // roughly that of the slowest level, not the sum of the failed levels.
+        // The level hint isn't used in this mode. With debug output, the
+        // levels are searched in order, as if this was false
+        bool speculative_levels;
+
+        // In cluttered scenes the corner finder can report thousands of
+        // candidates, and the grid search over all of them is slow. If
+        // grid_candidates_max > 0 and there are more candidates than that, I
+        // first look for the grid among the grid_candidates_max candidates
+        // with the strongest ChESS response. Only if that fails do I look
+        // among all of them. <= 0 means "always use all the candidates"
+        int grid_candidates_max;
+
+        // If true, the level search (image_pyramid_level < 0) gives up early on
+        // images that can't contain a chessboard the search would find: blank,
+        // out-of-focus and badly blurred ones. Before any corners are found, I
+        // count the sharp edges at each level of the search, from the coarsest
+        // one, and I stop as soon as a level has enough of them. If none does,
+        // I give up on the image. A board of any size has enough sharp edges at
+        // one of the levels, so this doesn't reject boards the search can find.
+        // Images with sharp clutter, but no board, still get the full search
+        bool prefilter;
+
+        // If true, the corner finder works on a few rows of the image at a
+        // time: it never stores the ChESS response or the summed-area tables
+        // of a whole pyramid level. This bounds the working memory by the
+        // width of the image, which matters for very large images on small
+        // machines. The results are identical, but each corner's variance
+        // check then sums its window directly, and the search is serial. The
+        // debug output always comes from the full-image search
+        bool streaming;
+
+        // How the grid finder links the corners to their neighbors
+        neighbor_graph_method_t neighbor_graph;
+
+        // The grid of corners I look for: rows of gridn_width corners each,
+        // and gridn_height rows. The gridn_width*gridn_height points are
+        // reported row by row. Normally the rows are the roughly-horizontal
+        // lines of corners in the image. A board that isn't square may also be
+        // seen rotated by 90 degrees, with its rows roughly vertical: its rows
+        // are then reported from right to left in the image, each from top to
+        // bottom. Each dimension must be at least 3
+        int gridn_width;
+        int gridn_height;
+
+        options_t() :
+            Nthreads(1),
+            bit_depth(16),
+            variance_window_radius(10),
+            refinement_method(REFINEMENT_CHESS),
+            image_pyramid_level_hint(-1),
+            remember_pyramid_level(false),
+            speculative_levels(false),
+            grid_candidates_max(0),
+            prefilter(false),
+            streaming(false),
+            neighbor_graph(NEIGHBOR_GRAPH_VORONOI),
+            gridn_width(MRGINGHAM_GRIDN_DEFAULT),
+            gridn_height(MRGINGHAM_GRIDN_DEFAULT)
+        {}
+    };
+
+    // The circle grid has gridn_height rows of gridn_width circles each. See
+    // options_t::gridn_width
     bool find_circle_grid_from_image_array( std::vector<mrgingham::PointDouble>& points_out,
                                             const cv::Mat& image,
                                             bool     debug = false,
-                                            debug_sequence_t debug_sequence = debug_sequence_t());
+                                            debug_sequence_t debug_sequence = debug_sequence_t(),
+                                            int      gridn_width  = MRGINGHAM_GRIDN_DEFAULT,
+                                            int      gridn_height = MRGINGHAM_GRIDN_DEFAULT);
     bool find_circle_grid_from_image_file( std::vector<mrgingham::PointDouble>& points_out,
                                            const char* filename,
                                            bool     debug = false,
-                                           debug_sequence_t debug_sequence = debug_sequence_t());
+                                           debug_sequence_t debug_sequence = debug_sequence_t(),
+                                           int      gridn_width  = MRGINGHAM_GRIDN_DEFAULT,
+                                           int      gridn_height = MRGINGHAM_GRIDN_DEFAULT);
 
     // set image_pyramid_level=0 to just use the image as is.
     //
@@ -37,15 +217,31 @@ namespace mrgingham
     // factor of 4.
     //
     // image_pyramid_level < 0 means we try several levels, taking the first one
-    // that produces results
+    // that produces results. I try options.image_pyramid_level_hint first, if
+    // given. Then level 3, and then the finer levels, in order
     //
     // If we want to refine each reported point, pass a pointer to a buffer into
     // refinement_level. I'll realloc() the buffer as needed, and I'll return
-    // the pyramid level of each point on exit.
+    // the pyramid level of each point on exit. With
+    // options.refinement_method == REFINEMENT_SADDLE, the points whose saddle
+    // fit converged report level 0, and the others report the level they were
+    // found at.
     //
     // *refinement_level is managed by realloc(). IT IS THE CALLER'S
     // *RESPONSIBILITY TO free() IT
     //
+    // The image is indexed with its stride (image.step), so it may be a
+    // sub-region of a larger image or it may have padded rows. It's processed
+    // in place, without a copy.
+    //
+    // The image is CV_8U or CV_16U. For CV_16U images, options.bit_depth says
+    // how many bits are significant
+    //
+    // If covariances_out is non-NULL, I return the covariance of each point in
+    // it: the spread of the ChESS response around that corner, at the level
+    // where the point was found or last refined with ChESS. See
+    // CornerCovariance. The saddle refinement doesn't update it
+    //
     // Returns the pyramid level where we found the grid, or <0 on failure
     int  find_chessboard_from_image_array( std::vector<mrgingham::PointDouble>& points_out,
                                            signed char**                        refinement_level,
@@ -53,7 +249,9 @@ namespace mrgingham
                                            int                                  image_pyramid_level  = -1,
                                            bool                                 debug                = false,
                                            debug_sequence_t                     debug_sequence = debug_sequence_t(),
-                                           const char*                          debug_image_filename = NULL);
+                                           const char*                          debug_image_filename = NULL,
+                                           const options_t&                     options              = options_t(),
+                                           std::vector<CornerCovariance>*       covariances_out      = NULL);
 
     // set image_pyramid_level=0 to just use the image as is.
     //
@@ -62,11 +260,15 @@ namespace mrgingham
     // factor of 4.
     //
     // image_pyramid_level < 0 means we try several levels, taking the first one
-    // that produces results
+    // that produces results. I try options.image_pyramid_level_hint first, if
+    // given. Then level 3, and then the finer levels, in order
     //
     // If we want to refine each reported point, pass a pointer to a buffer into
     // refinement_level. I'll realloc() the buffer as needed, and I'll return
-    // the pyramid level of each point on exit.
+    // the pyramid level of each point on exit. With
+    // options.refinement_method == REFINEMENT_SADDLE, the points whose saddle
+    // fit converged report level 0, and the others report the level they were
+    // found at.
     //
     // *refinement_level is managed by realloc(). IT IS THE CALLER'S
     // *RESPONSIBILITY TO free() IT
@@ -77,10 +279,81 @@ namespace mrgingham
                                          const char*                          filename,
                                          int                                  image_pyramid_level = -1,
                                          bool                                 debug               = false,
-                                         debug_sequence_t                     debug_sequence = debug_sequence_t());
+                                         debug_sequence_t                     debug_sequence = debug_sequence_t(),
+                                         const options_t&                     options             = options_t());
+
+    // A chessboard detector that owns all its working memory: the image
+    // pyramid, the corner-finder buffers, the grid-finder buffers and the
+    // refinement levels. These are kept from call to call, and reused. So once
+    // a detector has seen an image or two of a given size, processing more
+    // such images doesn't allocate anything, except in the construction of
+    // the voronoi diagram: boost allocates internally there. With
+    // options.neighbor_graph == NEIGHBOR_GRAPH_KNN, there's no voronoi diagram.
+    //
+    // A detector may only be used by one thread at a time. Processing several
+    // images concurrently needs one detector per thread
+    class __attribute__((visibility("default"))) ChessboardDetector
+    {
+    public:
+        ChessboardDetector(const options_t& options = options_t());
+        ~ChessboardDetector();
+
+        // Same as the free function find_chessboard_from_image_array(), but
+        // using the buffers in this detector. points_out is cleared first. If
+        // refinement_level is non-NULL, I refine the points, and I return the
+        // pyramid level of each point in (*refinement_level)[i]. If
+        // covariances_out is non-NULL, I return the covariance of each point
+        // in it. Returns the pyramid level where we found the grid, or <0 on
+        // failure
+        int find_chessboard_from_image_array( std::vector<mrgingham::PointDouble>& points_out,
+                                              std::vector<signed char>*            refinement_level,
+                                              const cv::Mat&                       image,
+                                              int                                  image_pyramid_level  = -1,
+                                              bool                                 debug                = false,
+                                              debug_sequence_t                     debug_sequence = debug_sequence_t(),
+                                              const char*                          debug_image_filename = NULL,
+                                              std::vector<CornerCovariance>*       covariances_out      = NULL);
+
+        // What options.prefilter concluded about the last image. The result
+        // is PREFILTER_NOT_RUN if the prefilter is off or didn't apply
+        const prefilter_details_t& get_prefilter_details() const;
+
+    private:
+        struct context_t;
+        context_t* ctx;
+        options_t  options;
+
+        bool find_chessboard_at_level( std::vector<mrgingham::PointDouble>& points_out,
+                                       std::vector<signed char>*            refinement_level,
+                                       std::vector<CornerCovariance>*       covariances_out,
+                                       int                                  image_pyramid_level,
+                                       bool                                 debug,
+                                       const debug_sequence_t&              debug_sequence,
+                                       const char*                          debug_image_filename);
+        void refine_from_level( std::vector<mrgingham::PointDouble>& points_out,
+                                std::vector<signed char>*            refinement_level,
+                                std::vector<CornerCovariance>*       covariances_out,
+                                int                                  image_pyramid_level,
+                                bool                                 debug,
+                                const char*                          debug_image_filename);
+        int find_chessboard_speculatively( std::vector<mrgingham::PointDouble>& points_out,
+                                           std::vector<signed char>*            refinement_level,
+                                           std::vector<CornerCovariance>*       covariances_out,
+                                           bool                                 debug,
+                                           const debug_sequence_t&              debug_sequence,
+                                           const char*                          debug_image_filename);
+
+        // not copyable
+        ChessboardDetector(const ChessboardDetector&);
+        ChessboardDetector& operator=(const ChessboardDetector&);
+    };
 
+    // Looks for a grid of gridn_height rows of gridn_width points each among
+    // the given points. See options_t::gridn_width
     bool find_grid_from_points( std::vector<mrgingham::PointDouble>& points_out,
                                 const std::vector<mrgingham::PointInt>& points,
                                 bool     debug             = false,
-                                const debug_sequence_t& debug_sequence = debug_sequence_t());
+                                const debug_sequence_t& debug_sequence = debug_sequence_t(),
+                                int      gridn_width       = MRGINGHAM_GRIDN_DEFAULT,
+                                int      gridn_height      = MRGINGHAM_GRIDN_DEFAULT);
 };
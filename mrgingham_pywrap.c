@@ -151,6 +151,11 @@ static PyObject* find_chessboard_corners(PyObject* NPY_UNUSED(self),
         PyErr_SetString(PyExc_RuntimeError, "Image rows must live in contiguous memory");
         goto done;
     }
+    if( strides[ndims-2] <= 0 )
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Image rows must be stored in increasing order in memory");
+        goto done;
+    }
 
     bool add_points(int* xy, int N, double scale)
     {
@@ -203,17 +208,21 @@ static PyObject* find_chessboard(PyObject* NPY_UNUSED(self),
     PyArrayObject* image               = NULL;
     PyObject*      result              = NULL;
     int            image_pyramid_level = -1;
+    int            gridn_width         = 10;
+    int            gridn_height        = 10;
 
     SET_SIGINT();
 
     char* keywords[] = { "image", "image_pyramid_level",
+                         "gridn_width", "gridn_height",
                          NULL };
 
     if(!PyArg_ParseTupleAndKeywords( args, kwargs,
-                                     "O&|i",
+                                     "O&|iii",
                                      keywords,
                                      PyArray_Converter, &image,
                                      &image_pyramid_level,
+                                     &gridn_width, &gridn_height,
                                      NULL))
         goto done;
 
@@ -236,6 +245,17 @@ static PyObject* find_chessboard(PyObject* NPY_UNUSED(self),
         PyErr_SetString(PyExc_RuntimeError, "Image rows must live in contiguous memory");
         goto done;
     }
+    if( strides[ndims-2] <= 0 )
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Image rows must be stored in increasing order in memory");
+        goto done;
+    }
+    if( gridn_width < 3 || gridn_height < 3 )
+    {
+        PyErr_Format(PyExc_RuntimeError, "The grid must have at least 3 points in each direction; got gridn_width=%d, gridn_height=%d",
+                     gridn_width, gridn_height);
+        goto done;
+    }
 
     bool add_points(double* xy, int N)
     {
@@ -245,7 +265,7 @@ static PyObject* find_chessboard(PyObject* NPY_UNUSED(self),
         if(result == NULL) return false;
 
         double* out_data = (double*)PyArray_BYTES((PyArrayObject*)result);
-        memcpy(out_data, xy, 2*sizeof(double));
+        memcpy(out_data, xy, 2*N*sizeof(double));
         return true;
     }
     if(! find_chessboard_from_image_array_C(PyArray_DIMS(image)[0],
@@ -254,6 +274,7 @@ static PyObject* find_chessboard(PyObject* NPY_UNUSED(self),
                                             PyArray_BYTES(image),
 
                                             image_pyramid_level,
+                                            gridn_width, gridn_height,
                                             &add_points) )
     {
         // This is allowed to fail. We possibly found no chessboard. This is
@@ -61,6 +61,10 @@ bool find_chessboard_from_image_array_C( // in
                                         // good scaling level. Try this first
                                         int image_pyramid_level,
 
+                                        // The grid has gridn_height rows of
+                                        // gridn_width points each
+                                        int gridn_width, int gridn_height,
+
                                         bool (*add_points)(double* xy, int N) )
 {
     cv::Mat cvimage(Nrows, Ncols, CV_8UC1,
@@ -68,12 +72,19 @@ bool find_chessboard_from_image_array_C( // in
 
     std::vector<mrgingham::PointDouble> out_points;
 
+    mrgingham::options_t options;
+    options.gridn_width  = gridn_width;
+    options.gridn_height = gridn_height;
+
     signed char* refinement_level = NULL;
     bool result =
         (find_chessboard_from_image_array( out_points,
                                            &refinement_level,
                                            cvimage,
-                                           image_pyramid_level ) >= 0);
+                                           image_pyramid_level,
+                                           false, mrgingham::debug_sequence_t(),
+                                           NULL,
+                                           options ) >= 0);
     free(refinement_level);
     if( !result ) return false;
 
@@ -27,6 +27,10 @@ bool find_chessboard_from_image_array_C( // in
                                         // good scaling level. Try this first
                                         int image_pyramid_level,
 
+                                        // The grid has gridn_height rows of
+                                        // gridn_width points each
+                                        int gridn_width, int gridn_height,
+
                                         bool (*add_points)(double* xy, int N) );
 #ifdef __cplusplus
 }
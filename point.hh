@@ -13,4 +13,27 @@ namespace mrgingham
         double x,y;
         PointDouble(double _x=0, double _y=0) : x(_x), y(_y) {}
     };
+
+    // The second angular harmonic of the intensity on a ring around a
+    // chessboard corner: (sum(I cos 2th), sum(I sin 2th)), unnormalized. Its
+    // phase says which pair of opposite quadrants is bright. This flips from
+    // each corner to the next along a row or column of the board, so grid
+    // neighbors have c0*c1 + s0*s1 < 0
+    struct CornerPolarity
+    {
+        int c,s;
+        CornerPolarity(int _c=0, int _s=0) : c(_c), s(_s) {}
+    };
+
+    // The covariance of the ChESS response around a corner: the second central
+    // moments of the response, weighted the same way as the centroid that
+    // gives the corner position. In full-resolution pixels^2. A wide response
+    // means the corner is poorly localized, and an elongated one says in which
+    // direction. This is a relative measure of the uncertainty of each corner,
+    // not a calibrated one
+    struct CornerCovariance
+    {
+        double xx, xy, yy;
+        CornerCovariance(double _xx=0, double _xy=0, double _yy=0) : xx(_xx), xy(_xy), yy(_yy) {}
+    };
 };
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <atomic>
+
+#include "find_chessboard_corners.hh"
+#include "thread_pool.hh"
+
+// The saddle-point refinement. Instead of re-detecting each corner at finer and
+// finer pyramid levels, I look at the full-resolution image in a small window
+// around each corner. Around a chessboard corner the intensity looks like a
+// saddle, so I fit a quadratic surface
+//
+//   f(x,y) = a x^2 + b xy + c y^2 + d x + e y + f
+//
+// to the pixels in the window, and move the window to the saddle point of the
+// surface. I keep doing this until the saddle point is at the center of the
+// window. The window is always sampled at the same offsets from its center
+// (interpolated bilinearly), and a chessboard corner is point-symmetric. So when
+// the saddle point is at the center of the window, the center is at the corner.
+//
+// The fit is weighted with a tent function that peaks at the center of the
+// window. The weighting and the bilinear interpolation smooth the image enough
+// to make the quadratic model work.
+
+// I give up if the saddle point doesn't converge after this many iterations
+#define SADDLE_ITERATIONS_MAX             20
+
+// The iterations stop once the saddle point moves by less than this many
+// pixels
+#define SADDLE_CONVERGENCE_THRESHOLD      0.005
+
+// The radius of the fitting window, in full-resolution pixels, is
+// (SADDLE_WINDOW_R_PER_LEVEL << level), where level is the pyramid level the
+// point was found at: the squares are bigger in the images that need more
+// downsampling. I clamp the radius to these bounds
+#define SADDLE_WINDOW_R_PER_LEVEL         2
+#define SADDLE_WINDOW_R_MIN               3
+#define SADDLE_WINDOW_R_MAX               16
+
+namespace mrgingham
+{
+
+// The normal equations of the weighted least-squares fit depend only on the
+// window radius, since the window is always sampled at the same offsets. So I
+// invert them once, and each iteration only needs to compute the right-hand
+// side. Returns false if the system is singular
+static bool saddle_fit_inverse(double Minv[6][6], int R)
+{
+    double M[6][12] = {};
+
+    for(int dy=-R; dy<=R; dy++)
+        for(int dx=-R; dx<=R; dx++)
+        {
+            double w = (double)((R+1-abs(dx)) * (R+1-abs(dy)));
+            double basis[6] = { (double)(dx*dx), (double)(dx*dy), (double)(dy*dy),
+                                (double)dx, (double)dy, 1.0 };
+            for(int i=0; i<6; i++)
+                for(int j=0; j<6; j++)
+                    M[i][j] += w*basis[i]*basis[j];
+        }
+
+    // Gauss-Jordan elimination with partial pivoting
+    for(int i=0; i<6; i++)
+        M[i][6+i] = 1.0;
+    for(int i=0; i<6; i++)
+    {
+        int ipivot = i;
+        for(int j=i+1; j<6; j++)
+            if(fabs(M[j][i]) > fabs(M[ipivot][i]))
+                ipivot = j;
+        if(fabs(M[ipivot][i]) < 1e-12)
+            return false;
+        if(ipivot != i)
+            for(int k=0; k<12; k++)
+            {
+                double t     = M[i][k];
+                M[i][k]      = M[ipivot][k];
+                M[ipivot][k] = t;
+            }
+
+        double s = 1.0 / M[i][i];
+        for(int k=0; k<12; k++)
+            M[i][k] *= s;
+        for(int j=0; j<6; j++)
+        {
+            if(j == i) continue;
+            double m = M[j][i];
+            for(int k=0; k<12; k++)
+                M[j][k] -= m*M[i][k];
+        }
+    }
+
+    for(int i=0; i<6; i++)
+        for(int j=0; j<6; j++)
+            Minv[i][j] = M[i][6+j];
+    return true;
+}
+
+// Refines a single point. Returns true if the saddle point converged, and
+// false if it didn't, or if the surface isn't a saddle, or if the window ran
+// off the image. *pt is updated only on success
+template<typename T>
+static bool refine_point_saddle(// in/out
+                                PointDouble* pt,
+
+                                // in
+                                const cv::Mat& image,
+                                int R, const double Minv[6][6])
+{
+    const int W = image.cols;
+    const int H = image.rows;
+
+    const double x_start = pt->x;
+    const double y_start = pt->y;
+    double       cx      = x_start;
+    double       cy      = y_start;
+
+    for(int iteration=0; iteration<SADDLE_ITERATIONS_MAX; iteration++)
+    {
+        // I interpolate between pixels (ix,iy) and (ix+1,iy+1), so all of
+        // these must be in the image
+        const int ix = (int)floor(cx);
+        const int iy = (int)floor(cy);
+        if(ix - R < 0 || ix + R + 1 >= W ||
+           iy - R < 0 || iy + R + 1 >= H)
+            return false;
+
+        // The interpolation weights are the same everywhere in the window
+        const double fx  = cx - ix;
+        const double fy  = cy - iy;
+        const double w00 = (1.-fx)*(1.-fy);
+        const double w01 =     fx *(1.-fy);
+        const double w10 = (1.-fx)*    fy;
+        const double w11 =     fx *    fy;
+
+        double rhs[6] = {};
+        for(int dy=-R; dy<=R; dy++)
+        {
+            const T* row0 = image.ptr<T>(iy+dy);
+            const T* row1 = image.ptr<T>(iy+dy+1);
+            for(int dx=-R; dx<=R; dx++)
+            {
+                double v =
+                    w00*row0[ix+dx] + w01*row0[ix+dx+1] +
+                    w10*row1[ix+dx] + w11*row1[ix+dx+1];
+                double wv = (double)((R+1-abs(dx)) * (R+1-abs(dy))) * v;
+
+                rhs[0] += wv*(double)(dx*dx);
+                rhs[1] += wv*(double)(dx*dy);
+                rhs[2] += wv*(double)(dy*dy);
+                rhs[3] += wv*(double)dx;
+                rhs[4] += wv*(double)dy;
+                rhs[5] += wv;
+            }
+        }
+
+        double p[5];
+        for(int i=0; i<5; i++)
+        {
+            p[i] = 0.0;
+            for(int j=0; j<6; j++)
+                p[i] += Minv[i][j]*rhs[j];
+        }
+        const double a = p[0], b = p[1], c = p[2], d = p[3], e = p[4];
+
+        // The Hessian is [2a b; b 2c]. At a saddle its determinant is negative
+        const double det = 4.*a*c - b*b;
+        if(det >= 0.)
+            return false;
+
+        // The saddle point is where the gradient is 0:
+        //   [2a b; b 2c] [sx; sy] = -[d; e]
+        const double sx = (b*e - 2.*c*d) / det;
+        const double sy = (b*d - 2.*a*e) / det;
+        if(fabs(sx) > R || fabs(sy) > R)
+            return false;
+
+        cx += sx;
+        cy += sy;
+
+        // If I wandered off too far, I'm not looking at the corner I started
+        // with anymore
+        if( (cx-x_start)*(cx-x_start) + (cy-y_start)*(cy-y_start) > (double)(R*R) )
+            return false;
+
+        if( sx*sx + sy*sy < SADDLE_CONVERGENCE_THRESHOLD*SADDLE_CONVERGENCE_THRESHOLD )
+        {
+            pt->x = cx;
+            pt->y = cy;
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+static int refine_chessboard_corners_saddle_typed(// out/in
+                                                  std::vector<mrgingham::PointDouble>* points,
+                                                  signed char* level,
+
+                                                  // in
+                                                  const cv::Mat& image,
+                                                  bool debug,
+                                                  int Nthreads)
+{
+    // The window radius depends on the level each point was found at. I
+    // invert the normal equations for each possible radius up-front
+    double Minv[MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX+1][6][6];
+    bool   Minv_valid[MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX+1] = {};
+    int    R_at_level[MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX+1];
+    for(int l=0; l<=MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX; l++)
+    {
+        int R = SADDLE_WINDOW_R_PER_LEVEL << l;
+        if(R < SADDLE_WINDOW_R_MIN) R = SADDLE_WINDOW_R_MIN;
+        if(R > SADDLE_WINDOW_R_MAX) R = SADDLE_WINDOW_R_MAX;
+        R_at_level[l] = R;
+    }
+
+    const int Npoints = (int)points->size();
+    for(int i=0; i<Npoints; i++)
+    {
+        int l = level[i];
+        if(l < 0 || l > MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX || Minv_valid[l])
+            continue;
+        if(!saddle_fit_inverse(Minv[l], R_at_level[l]))
+        {
+            fprintf(stderr, "%s:%d in %s(): Couldn't invert the saddle-fit normal equations for R=%d."
+                    " Sorry.\n", __FILE__, __LINE__, __func__, R_at_level[l]);
+            return 0;
+        }
+        Minv_valid[l] = true;
+    }
+
+    // Each point is refined independently, so I split them among the threads
+    int Nworkers = Nthreads;
+    if(Nworkers > Npoints / 8) Nworkers = Npoints / 8;
+    if(Nworkers < 1)           Nworkers = 1;
+
+    std::atomic<int> N(0);
+    parallel_for(Nworkers, Nthreads,
+                 [&](int iworker)
+                 {
+                     int Nrefined = 0;
+                     int i0 = Npoints *  iworker    / Nworkers;
+                     int i1 = Npoints * (iworker+1) / Nworkers;
+                     for(int i=i0; i<i1; i++)
+                     {
+                         int l = level[i];
+                         if(l < 0 || l > MRGINGHAM_IMAGE_PYRAMID_LEVEL_MAX)
+                             continue;
+
+                         if(refine_point_saddle<T>(&(*points)[i], image,
+                                                   R_at_level[l], Minv[l]))
+                         {
+                             level[i] = 0;
+                             Nrefined++;
+                         }
+                         else if(debug)
+                             fprintf(stderr, "Saddle refinement didn't converge for point %d at (%f,%f)\n",
+                                     i, (*points)[i].x, (*points)[i].y);
+                     }
+                     N += Nrefined;
+                 });
+    return N;
+}
+
+__attribute__((visibility("default")))
+int refine_chessboard_corners_saddle( // out/in
+                                      std::vector<mrgingham::PointDouble>* points,
+                                      signed char* level,
+
+                                      // in
+                                      image_pyramid_t* pyramid,
+                                      bool debug,
+                                      const mrgingham::options_t& options)
+{
+    // Level 0 is the input image itself, so this doesn't compute anything
+    const cv::Mat* image = pyramid->get(0);
+    if( image == NULL )
+        return 0;
+
+    const int Nthreads = options.Nthreads > 0 ? options.Nthreads : get_Ncores();
+
+    if( image->type() == CV_8U )
+        return refine_chessboard_corners_saddle_typed<uint8_t>(points, level, *image,
+                                                               debug, Nthreads);
+    if( image->type() == CV_16U )
+        return refine_chessboard_corners_saddle_typed<uint16_t>(points, level, *image,
+                                                                debug, Nthreads);
+
+    fprintf(stderr, "%s:%d in %s(): I can only handle CV_8U and CV_16U arrays currently."
+            " Sorry.\n", __FILE__, __LINE__, __func__);
+    return 0;
+}
+
+};
@@ -0,0 +1,295 @@
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <vector>
+
+extern "C"
+{
+#include "ChESS.h"
+}
+
+// Checks that the vectorized ChESS implementations produce bit-identical output
+// to the scalar one. The fused response+clamp+mask kernels and the 16-bit
+// kernels are checked too. I look at random images of assorted sizes and strides, and
+// at any images given on the commandline
+
+typedef void (ChESS_function_t)(int16_t* response, const uint8_t* image,
+                                int w, int h, int stride);
+
+static bool compare_one(const char* what,
+                        ChESS_function_t* f, const char* fname,
+                        const uint8_t* image, int w, int h, int stride)
+{
+    // I fill the outputs with garbage beforehand. The borders aren't written
+    // by any implementation, so they must match too
+    std::vector<int16_t> ref(w*h, (int16_t)0x5a5a), out(w*h, (int16_t)0x5a5a);
+
+    mrgingham_ChESS_response_5_scalar(ref.data(), image, w, h, stride);
+    (*f)                             (out.data(), image, w, h, stride);
+
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            if(ref[x + y*w] != out[x + y*w])
+            {
+                fprintf(stderr, "MISMATCH: %s (%dx%d, stride %d): %s gave %d at (%d,%d); scalar gave %d\n",
+                        what, w, h, stride, fname, out[x + y*w], x, y, ref[x + y*w]);
+                return false;
+            }
+    return true;
+}
+
+typedef void (ChESS_clamp_mask_function_t)(int16_t* response, uint64_t* mask,
+                                           const uint8_t* image,
+                                           int w, int h, int stride,
+                                           int16_t threshold);
+
+// The fused kernels must produce the scalar response, clamped to >= 0, and a
+// mask of exactly the pixels with a clamped response > threshold
+static bool compare_one_clamp_mask(const char* what,
+                                   ChESS_clamp_mask_function_t* f, const char* fname,
+                                   const uint8_t* image, int w, int h, int stride,
+                                   int16_t threshold)
+{
+    const int Nwords = MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w);
+
+    std::vector<int16_t>  ref(w*h, (int16_t)0x5a5a), out(w*h, (int16_t)0x5a5a);
+    std::vector<uint64_t> mask(Nwords*h, 0x5a5a5a5a5a5a5a5aULL);
+
+    mrgingham_ChESS_response_5_scalar(ref.data(), image, w, h, stride);
+    (*f)(out.data(), mask.data(), image, w, h, stride, threshold);
+
+    for(int y=7; y<h-7; y++)
+        for(int x=0; x<w; x++)
+        {
+            int16_t r = ref[x + y*w];
+            if(x >= 7 && x < w-7 && r < 0) r = 0;
+
+            bool bit_want = x >= 7 && x < w-7 && r > threshold;
+            bool bit_got  = (mask[y*Nwords + x/64] >> (x%64)) & 1;
+            if(r != out[x + y*w] || bit_want != bit_got)
+            {
+                fprintf(stderr, "MISMATCH: %s (%dx%d, stride %d, threshold %d): %s gave %d/%d at (%d,%d); want %d/%d\n",
+                        what, w, h, stride, threshold, fname,
+                        out[x + y*w], bit_got, x, y, r, bit_want);
+                return false;
+            }
+        }
+    for(int x=0; x<w; x++)
+        for(int y=0; y<h; y++)
+            if(y < 7 || y >= h-7)
+                if(ref[x + y*w] != out[x + y*w])
+                {
+                    fprintf(stderr, "MISMATCH: %s (%dx%d, stride %d): %s wrote the border at (%d,%d)\n",
+                            what, w, h, stride, fname, x, y);
+                    return false;
+                }
+    return true;
+}
+
+// The 16-bit flavors. Same checks as above, for a given shift
+typedef void (ChESS_u16_function_t)(int16_t* response, const uint16_t* image,
+                                    int w, int h, int stride, int shift);
+typedef void (ChESS_u16_clamp_mask_function_t)(int16_t* response, uint64_t* mask,
+                                               const uint16_t* image,
+                                               int w, int h, int stride, int shift,
+                                               int16_t threshold);
+
+static bool compare_one_u16(const char* what,
+                            ChESS_u16_function_t* f, ChESS_u16_clamp_mask_function_t* f_clamp_mask,
+                            const char* fname,
+                            const uint16_t* image, int w, int h, int stride, int shift)
+{
+    const int16_t threshold = 15;
+    const int     Nwords    = MRGINGHAM_CHESS_MASK_WORDS_PER_ROW(w);
+
+    std::vector<int16_t>  ref(w*h, (int16_t)0x5a5a), out(w*h, (int16_t)0x5a5a), out_clamped(w*h, (int16_t)0x5a5a);
+    std::vector<uint64_t> mask(Nwords*h, 0x5a5a5a5a5a5a5a5aULL);
+
+    mrgingham_ChESS_response_5_u16_scalar(ref.data(), image, w, h, stride, shift);
+    (*f)           (out.data(),                      image, w, h, stride, shift);
+    (*f_clamp_mask)(out_clamped.data(), mask.data(), image, w, h, stride, shift, threshold);
+
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+        {
+            bool inside = x >= 7 && x < w-7 && y >= 7 && y < h-7;
+
+            int16_t r         = ref[x + y*w];
+            int16_t r_clamped = (inside && r < 0) ? 0 : r;
+            if(ref[x + y*w] != out[x + y*w] || r_clamped != out_clamped[x + y*w])
+            {
+                fprintf(stderr, "MISMATCH: %s (%dx%d, stride %d, shift %d): %s gave %d/%d at (%d,%d); want %d/%d\n",
+                        what, w, h, stride, shift, fname,
+                        out[x + y*w], out_clamped[x + y*w], x, y, r, r_clamped);
+                return false;
+            }
+            if(y >= 7 && y < h-7)
+            {
+                bool bit_want = inside && r_clamped > threshold;
+                bool bit_got  = (mask[y*Nwords + x/64] >> (x%64)) & 1;
+                if(bit_want != bit_got)
+                {
+                    fprintf(stderr, "MISMATCH: %s (%dx%d, stride %d, shift %d): %s has mask bit %d at (%d,%d); want %d\n",
+                            what, w, h, stride, shift, fname, bit_got, x, y, bit_want);
+                    return false;
+                }
+            }
+        }
+    return true;
+}
+
+static bool compare_all_u16(const char* what,
+                            const uint16_t* image, int w, int h, int stride, int shift)
+{
+    bool ok = true;
+#if defined __x86_64__ || defined __i386__
+    if(__builtin_cpu_supports("avx2"))
+        ok = compare_one_u16(what,
+                             &mrgingham_ChESS_response_5_u16_avx2, &mrgingham_ChESS_response_5_u16_clamp_mask_avx2,
+                             "u16_avx2", image, w, h, stride, shift) && ok;
+#endif
+    ok = compare_one_u16(what,
+                         &mrgingham_ChESS_response_5_u16, &mrgingham_ChESS_response_5_u16_clamp_mask,
+                         "u16_dispatched", image, w, h, stride, shift) && ok;
+    ok = compare_one_u16(what,
+                         &mrgingham_ChESS_response_5_u16_scalar, &mrgingham_ChESS_response_5_u16_clamp_mask_scalar,
+                         "u16_clamp_mask_scalar", image, w, h, stride, shift) && ok;
+    return ok;
+}
+
+static bool compare_all(const char* what,
+                        const uint8_t* image, int w, int h, int stride)
+{
+    bool ok = true;
+#if defined __x86_64__ || defined __i386__
+    if(__builtin_cpu_supports("sse4.1"))
+        ok = compare_one(what, &mrgingham_ChESS_response_5_sse41, "sse4.1", image, w, h, stride) && ok;
+    if(__builtin_cpu_supports("avx2"))
+        ok = compare_one(what, &mrgingham_ChESS_response_5_avx2,  "avx2",   image, w, h, stride) && ok;
+#endif
+    ok = compare_one(what, &mrgingham_ChESS_response_5, "dispatched", image, w, h, stride) && ok;
+
+    // A few thresholds, including the one mrgingham uses, and ones that make
+    // most of the mask bits set or unset
+    const int16_t thresholds[] = { -1, 0, 15, 200 };
+    for(int16_t threshold : thresholds)
+    {
+        ok = compare_one_clamp_mask(what, &mrgingham_ChESS_response_5_clamp_mask_scalar,
+                                    "clamp_mask_scalar", image, w, h, stride, threshold) && ok;
+#if defined __x86_64__ || defined __i386__
+        if(__builtin_cpu_supports("sse4.1"))
+            ok = compare_one_clamp_mask(what, &mrgingham_ChESS_response_5_clamp_mask_sse41,
+                                        "clamp_mask_sse4.1", image, w, h, stride, threshold) && ok;
+        if(__builtin_cpu_supports("avx2"))
+            ok = compare_one_clamp_mask(what, &mrgingham_ChESS_response_5_clamp_mask_avx2,
+                                        "clamp_mask_avx2", image, w, h, stride, threshold) && ok;
+#endif
+        ok = compare_one_clamp_mask(what, &mrgingham_ChESS_response_5_clamp_mask,
+                                    "clamp_mask_dispatched", image, w, h, stride, threshold) && ok;
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--Nrandom N] [image image ...]\n"
+        "\n"
+        "  Compares the vectorized ChESS implementations against the scalar one. We\n"
+        "  look at N random images (100 by default) and at each image given on the\n"
+        "  commandline. Returns non-zero if any mismatches were found\n";
+
+    struct option opts[] = {
+        { "Nrandom", required_argument, NULL, 'n' },
+        { "help",    no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int Nrandom = 100;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'n':
+            Nrandom = atoi(optarg);
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+#if defined __x86_64__ || defined __i386__
+    fprintf(stderr, "CPU supports: sse4.1: %s, avx2: %s\n",
+            __builtin_cpu_supports("sse4.1") ? "yes" : "no",
+            __builtin_cpu_supports("avx2")   ? "yes" : "no");
+#endif
+
+    bool ok = true;
+    int  Nchecked = 0;
+
+    srandom(0);
+    for(int i=0; i<Nrandom; i++)
+    {
+        // Assorted sizes: too small to have any valid output, not multiples of
+        // the vector width, and a few larger ones
+        int w      = 1 + random() % (i < Nrandom/2 ? 80 : 700);
+        int h      = 1 + random() % (i < Nrandom/2 ? 40 : 300);
+        int stride = w + random() % 40;
+
+        std::vector<uint8_t> image(stride*h);
+        // Half the images are pure noise. The other half are saturated, to
+        // make the intermediate sums hit their extremes
+        for(size_t j=0; j<image.size(); j++)
+            image[j] = (i % 2) ? (uint8_t)random() : ((random() & 1) ? 255 : 0);
+
+        ok = compare_all("random", image.data(), w, h, stride) && ok;
+        Nchecked++;
+
+        // And the same for 16-bit images, with a few different bit depths.
+        // shift=0 makes the response saturate
+        int bit_depth = 8 + random() % 9;
+        std::vector<uint16_t> image16(stride*h);
+        for(size_t j=0; j<image16.size(); j++)
+            image16[j] = (i % 2) ?
+                (uint16_t)(random() & ((1 << bit_depth) - 1)) :
+                ((random() & 1) ? (uint16_t)((1 << bit_depth) - 1) : 0);
+        ok = compare_all_u16("random16", image16.data(), w, h, stride, bit_depth - 8) && ok;
+        ok = compare_all_u16("random16", image16.data(), w, h, stride, 0) && ok;
+    }
+
+    for(int iarg=optind; iarg<argc; iarg++)
+    {
+        cv::Mat image = cv::imread(argv[iarg], CV_LOAD_IMAGE_GRAYSCALE);
+        if( image.data == NULL )
+        {
+            fprintf(stderr, "Couldn't open image '%s'\n", argv[iarg]);
+            return 1;
+        }
+        ok = compare_all(argv[iarg], image.data, image.cols, image.rows, (int)image.step) && ok;
+        Nchecked++;
+    }
+
+    if(!ok)
+    {
+        fprintf(stderr, "FAILED: the implementations do not agree\n");
+        return 1;
+    }
+    fprintf(stderr, "OK: all implementations agree on %d images\n", Nchecked);
+    return 0;
+}
@@ -0,0 +1,393 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include <vector>
+
+#include "mrgingham.hh"
+#include "mrgingham-internal.h"
+#include "find_chessboard_corners.hh"
+
+using namespace mrgingham;
+
+// Checks that a warmed-up ChessboardDetector doesn't touch the heap. I count
+// the heap allocations by interposing the glibc allocator entry points. After a
+// few warm-up runs on an image, the corner finder and the refinement must not
+// allocate anything at all. The grid finder allocates inside boost's voronoi
+// construction; I report how much. With the nearest-neighbor graph instead of
+// the voronoi diagram, the grid finder must not allocate either. And I make
+// sure that the detector as a whole allocates nothing beyond the voronoi
+// construction.
+//
+// The detector is checked at the level where the chessboard was found, and
+// with the automatic level search. The search tries several levels, running
+// the grid finder at each, so with the voronoi diagram it allocates more than
+// the grid finder does at one level. I thus check the search with the
+// nearest-neighbor graph: there it must not allocate at all. And I check all
+// of this with Nthreads > 1 as well, where the work is split among the
+// workers of the thread pool
+
+extern "C"
+{
+    void* __libc_malloc  (size_t size);
+    void* __libc_calloc  (size_t n, size_t size);
+    void* __libc_realloc (void* ptr, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+
+    // The pool workers allocate concurrently with the calling thread, so I
+    // count atomically
+    static volatile bool counting     = false;
+    static int           Nallocations = 0;
+
+    static void count_allocation(void)
+    {
+        if(counting)
+            __atomic_add_fetch(&Nallocations, 1, __ATOMIC_RELAXED);
+    }
+
+    void* malloc(size_t size)
+    {
+        count_allocation();
+        return __libc_malloc(size);
+    }
+    void* calloc(size_t n, size_t size)
+    {
+        count_allocation();
+        return __libc_calloc(n, size);
+    }
+    void* realloc(void* ptr, size_t size)
+    {
+        count_allocation();
+        return __libc_realloc(ptr, size);
+    }
+    void* memalign(size_t alignment, size_t size)
+    {
+        count_allocation();
+        return __libc_memalign(alignment, size);
+    }
+    void* aligned_alloc(size_t alignment, size_t size)
+    {
+        count_allocation();
+        return __libc_memalign(alignment, size);
+    }
+    int posix_memalign(void** ptr, size_t alignment, size_t size)
+    {
+        count_allocation();
+        *ptr = __libc_memalign(alignment, size);
+        return *ptr == NULL ? ENOMEM : 0;
+    }
+}
+
+static void count_start(void)
+{
+    __atomic_store_n(&Nallocations, 0, __ATOMIC_SEQ_CST);
+    counting = true;
+}
+static int count_stop(void)
+{
+    counting = false;
+    return __atomic_load_n(&Nallocations, __ATOMIC_SEQ_CST);
+}
+
+struct stage_counts_t
+{
+    int corners, grid, refinement;
+};
+
+// Runs the stages of the detector by hand, with reused buffers, counting the
+// allocations in each one
+static bool run_stages(stage_counts_t* counts,
+                       image_pyramid_t* pyramid,
+                       chessboard_corners_buffers_t* corners_buffers,
+                       find_grid_buffers_t* grid_buffers,
+                       std::vector<PointInt>* points,
+                       std::vector<PointDouble>* points_out,
+                       std::vector<signed char>* refinement_level,
+                       const cv::Mat& image, int image_pyramid_level)
+{
+    points->clear();
+    points_out->clear();
+
+    count_start();
+    pyramid->reset(image);
+    find_chessboard_corners_from_image_array(points, pyramid, image_pyramid_level,
+                                             false, NULL, options_t(),
+                                             corners_buffers);
+    counts->corners = count_stop();
+
+    count_start();
+    bool found = find_grid_from_points(*points_out, *points,
+                                       false, debug_sequence_t(),
+                                       grid_buffers);
+    counts->grid = count_stop();
+    if(!found)
+        return false;
+
+    count_start();
+    refinement_level->resize(points_out->size());
+    for(int i=0; i<(int)points_out->size(); i++)
+        (*refinement_level)[i] = (signed char)image_pyramid_level;
+    for(int level = image_pyramid_level-1; level >= 0; level--)
+        refine_chessboard_corners_from_image_array(points_out, refinement_level->data(),
+                                                   pyramid, level,
+                                                   false, NULL, options_t(),
+                                                   corners_buffers);
+    counts->refinement = count_stop();
+
+    return true;
+}
+
+struct detector_counts_t
+{
+    int level, autolevel;
+};
+
+// Warms up the detector on this image, both at the given level and with the
+// automatic level search. Then counts the allocations of one more run of each
+static void count_detector(detector_counts_t* counts,
+                           ChessboardDetector* detector,
+                           std::vector<PointDouble>* points_out,
+                           std::vector<signed char>* refinement_level,
+                           const cv::Mat& image, int image_pyramid_level,
+                           int Nwarmup)
+{
+    for(int iwarmup=0; iwarmup<Nwarmup; iwarmup++)
+    {
+        detector->find_chessboard_from_image_array(*points_out, refinement_level,
+                                                   image, image_pyramid_level);
+        detector->find_chessboard_from_image_array(*points_out, refinement_level,
+                                                   image);
+    }
+
+    count_start();
+    detector->find_chessboard_from_image_array(*points_out, refinement_level,
+                                               image, image_pyramid_level);
+    counts->level = count_stop();
+
+    count_start();
+    detector->find_chessboard_from_image_array(*points_out, refinement_level,
+                                               image);
+    counts->autolevel = count_stop();
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--clahe] [--blur radius] [--Nwarmup N] [--jobs N] image image ...\n"
+        "\n"
+        "  --clahe and --blur pre-process the images like they do in the\n"
+        "  test-dump-chessboard-corners tool. The pre-processing isn't counted\n"
+        "\n"
+        "  Each image must contain a chessboard that mrgingham can find. I process\n"
+        "  each one a few times to warm up the buffers (--Nwarmup; 3 by default), and\n"
+        "  then count the heap allocations of one more run. Returns non-zero if the\n"
+        "  corner finder, the refinement or the grid finder using the nearest-neighbor\n"
+        "  graph allocated anything, or if the detector allocated anything outside of\n"
+        "  the grid finder. The detector is checked at the level where the chessboard\n"
+        "  was found, and with the automatic level search. The level search is checked\n"
+        "  with the nearest-neighbor graph, where it must not allocate at all.\n"
+        "\n"
+        "  All the detector checks are done both single-threaded and with N threads\n"
+        "  (--jobs; 4 by default)\n";
+
+    struct option opts[] = {
+        { "blur",    required_argument, NULL, 'b' },
+        { "clahe",   no_argument,       NULL, 'c' },
+        { "Nwarmup", required_argument, NULL, 'n' },
+        { "jobs",    required_argument, NULL, 'j' },
+        { "help",    no_argument,       NULL, 'h' },
+        {}
+    };
+
+    bool doclahe     = false;
+    int  blur_radius = -1;
+    int  Nwarmup     = 3;
+    int  Nthreads    = 4;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'c':
+            doclahe = true;
+            break;
+
+        case 'b':
+            blur_radius = atoi(optarg);
+            break;
+
+        case 'n':
+            Nwarmup = atoi(optarg);
+            break;
+
+        case 'j':
+            Nthreads = atoi(optarg);
+            if(Nthreads < 2)
+            {
+                fprintf(stderr, "--jobs must be at least 2\n");
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( optind > argc-1 )
+    {
+        fprintf(stderr, "Need at least one image\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    cv::Ptr<cv::CLAHE> clahe;
+    if(doclahe)
+    {
+        clahe = cv::createCLAHE();
+        clahe->setClipLimit(8);
+    }
+
+    bool ok = true;
+
+    options_t options_threaded;
+    options_threaded.Nthreads = Nthreads;
+    options_t options_knn;
+    options_knn.neighbor_graph = NEIGHBOR_GRAPH_KNN;
+    options_t options_knn_threaded = options_knn;
+    options_knn_threaded.Nthreads = Nthreads;
+
+    ChessboardDetector            detector;
+    ChessboardDetector            detector_threaded    (options_threaded);
+    ChessboardDetector            detector_knn         (options_knn);
+    ChessboardDetector            detector_knn_threaded(options_knn_threaded);
+    image_pyramid_t               pyramid;
+    chessboard_corners_buffers_t* corners_buffers = chessboard_corners_buffers_alloc();
+    find_grid_buffers_t*          grid_buffers    = find_grid_buffers_alloc();
+    std::vector<PointInt>         points;
+    std::vector<PointDouble>      points_out;
+    std::vector<PointDouble>      points_out_knn;
+    std::vector<signed char>      refinement_level;
+
+    for(int i=optind; i<argc; i++)
+    {
+        const char* filename = argv[i];
+        cv::Mat image = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
+        if( image.data == NULL )
+        {
+            fprintf(stderr, "Couldn't open image '%s'\n", filename);
+            return 1;
+        }
+        if( doclahe )
+        {
+            cv::equalizeHist(image, image);
+            clahe->apply(image, image);
+        }
+        if( blur_radius > 0 )
+        {
+            cv::blur( image, image,
+                      cv::Size(1 + 2*blur_radius,
+                               1 + 2*blur_radius));
+        }
+
+        int level = detector.find_chessboard_from_image_array(points_out, &refinement_level,
+                                                              image);
+        if(level < 0)
+        {
+            fprintf(stderr, "%s: no chessboard found. Can't test this image\n", filename);
+            ok = false;
+            continue;
+        }
+
+        stage_counts_t counts;
+        for(int iwarmup=0; iwarmup<Nwarmup; iwarmup++)
+            run_stages(&counts, &pyramid, corners_buffers, grid_buffers,
+                       &points, &points_out, &refinement_level,
+                       image, level);
+
+        if(!run_stages(&counts, &pyramid, corners_buffers, grid_buffers,
+                       &points, &points_out, &refinement_level,
+                       image, level))
+        {
+            fprintf(stderr, "%s: the staged run didn't find the chessboard\n", filename);
+            ok = false;
+            continue;
+        }
+
+        for(int iwarmup=0; iwarmup<Nwarmup; iwarmup++)
+        {
+            points_out_knn.clear();
+            find_grid_from_points(points_out_knn, points,
+                                  false, debug_sequence_t(),
+                                  grid_buffers, NULL, NEIGHBOR_GRAPH_KNN);
+        }
+        points_out_knn.clear();
+        count_start();
+        find_grid_from_points(points_out_knn, points,
+                              false, debug_sequence_t(),
+                              grid_buffers, NULL, NEIGHBOR_GRAPH_KNN);
+        int Ngrid_knn = count_stop();
+
+        detector_counts_t Ndetector, Ndetector_threaded, Ndetector_knn, Ndetector_knn_threaded;
+        count_detector(&Ndetector,              &detector,
+                       &points_out, &refinement_level, image, level, Nwarmup);
+        count_detector(&Ndetector_threaded,     &detector_threaded,
+                       &points_out, &refinement_level, image, level, Nwarmup);
+        count_detector(&Ndetector_knn,          &detector_knn,
+                       &points_out, &refinement_level, image, level, Nwarmup);
+        count_detector(&Ndetector_knn_threaded, &detector_knn_threaded,
+                       &points_out, &refinement_level, image, level, Nwarmup);
+
+        printf("%s: level %d: allocations after warm-up: corners %d, refinement %d, grid (boost voronoi) %d, grid (knn) %d\n",
+               filename, level,
+               counts.corners, counts.refinement, counts.grid, Ngrid_knn);
+        printf("%s: whole detector at level %d / searching the levels: voronoi %d/%d, voronoi with %d threads %d/%d, knn %d/%d, knn with %d threads %d/%d\n",
+               filename, level,
+               Ndetector.level,              Ndetector.autolevel,
+               Nthreads,
+               Ndetector_threaded.level,     Ndetector_threaded.autolevel,
+               Ndetector_knn.level,          Ndetector_knn.autolevel,
+               Nthreads,
+               Ndetector_knn_threaded.level, Ndetector_knn_threaded.autolevel);
+
+        if(counts.corners != 0 || counts.refinement != 0 || Ngrid_knn != 0)
+        {
+            fprintf(stderr, "%s: FAILED: the corner finder, the refinement or the knn grid finder allocated\n", filename);
+            ok = false;
+        }
+        if(Ndetector.level != counts.grid || Ndetector_threaded.level != counts.grid)
+        {
+            fprintf(stderr, "%s: FAILED: the detector allocated outside of the grid finder\n", filename);
+            ok = false;
+        }
+        if(Ndetector_knn.level          != Ngrid_knn || Ndetector_knn.autolevel          != Ngrid_knn ||
+           Ndetector_knn_threaded.level != Ngrid_knn || Ndetector_knn_threaded.autolevel != Ngrid_knn)
+        {
+            fprintf(stderr, "%s: FAILED: the detector using the knn grid finder allocated\n", filename);
+            ok = false;
+        }
+    }
+
+    chessboard_corners_buffers_free(corners_buffers);
+    find_grid_buffers_free(grid_buffers);
+
+    if(!ok)
+        return 1;
+    printf("All OK\n");
+    return 0;
+}
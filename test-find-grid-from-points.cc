@@ -1,6 +1,7 @@
 #include "mrgingham.hh"
 #include "mrgingham-internal.h"
 #include <stdio.h>
+#include <math.h>
 #include <getopt.h>
 
 using namespace mrgingham;
@@ -33,24 +34,76 @@ static bool read_points( std::vector<PointInt>* points, const char* file )
     return true;
 }
 
+// Rotates the points clockwise by 90 degrees, in the image. With y pointing
+// down, the top-left corner goes to the top-right, at x = ymax
+static void rotate_points( std::vector<PointInt>* points_rotated,
+                           const std::vector<PointInt>& points,
+                           int ymax )
+{
+    points_rotated->clear();
+    for(int i=0; i<(int)points.size(); i++)
+        points_rotated->push_back( PointInt( ymax - points[i].y, points[i].x ) );
+}
+
+// The board is rotated along with the points, so I should see the same points,
+// rotated, in the same order
+static bool check_rotated( const std::vector<PointDouble>& points_out,
+                           const std::vector<PointDouble>& points_out_rotated,
+                           int ymax )
+{
+    if(points_out_rotated.size() != points_out.size())
+    {
+        fprintf(stderr, "Rotated points: found %zd grid points instead of %zd\n",
+                points_out_rotated.size(), points_out.size());
+        return false;
+    }
+    for(int i=0; i<(int)points_out.size(); i++)
+    {
+        double x = (double)ymax / (double)FIND_GRID_SCALE - points_out[i].y;
+        double y = points_out[i].x;
+        if( fabs(points_out_rotated[i].x - x) > 1e-6 ||
+            fabs(points_out_rotated[i].y - y) > 1e-6 )
+        {
+            fprintf(stderr, "Rotated points: grid point %d is at (%f,%f). Expected (%f,%f)\n",
+                    i, points_out_rotated[i].x, points_out_rotated[i].y, x, y);
+            return false;
+        }
+    }
+    return true;
+}
+
 
 int main(int argc, char* argv[])
 {
     const char* usage =
-        "Usage: %s [--debug] points.vnl\n"
+        "Usage: %s [--debug] [--gridn N|WxH] [--check-rotated] points.vnl\n"
         "\n"
         "Given a set of pre-detected points, this tool finds a chessboard grid, and returns\n"
         "the ordered coordinates of this grid on standard output. The pre-detected points\n"
-        "can come from something like test-dump-chessboard-corners.\n";
+        "can come from something like test-dump-chessboard-corners. --gridn selects the\n"
+        "size of the grid, as in mrgingham: NxN, or rows of W points and H rows. The\n"
+        "default is 10x10\n"
+        "\n"
+        "--check-rotated is a self-test for grids that aren't square. After finding the\n"
+        "grid, I rotate the points by 90 degrees, and find the grid again. The board was\n"
+        "rotated too, so I should see the same grid, rotated, in the same order. I exit\n"
+        "with an error if I don't. The board in points.vnl should be roughly upright:\n"
+        "rotating a sideways board turns it upside-down, and I report an upside-down\n"
+        "board in the order it appears in the image\n";
 
     struct option opts[] = {
         { "help",              no_argument,       NULL, 'h' },
         { "debug",             no_argument,       NULL, 'd' },
+        { "gridn",             required_argument, NULL, 'G' },
+        { "check-rotated",     no_argument,       NULL, 'R' },
         {}
     };
 
 
     bool        debug               = false;
+    bool        do_check_rotated    = false;
+    int         gridn_width         = MRGINGHAM_GRIDN_DEFAULT;
+    int         gridn_height        = MRGINGHAM_GRIDN_DEFAULT;
 
     int opt;
     do
@@ -70,6 +123,26 @@ int main(int argc, char* argv[])
             debug = true;
             break;
 
+        case 'R':
+            do_check_rotated = true;
+            break;
+
+        case 'G':
+        {
+            char x;
+            int Nread = sscanf(optarg, "%d%c%d", &gridn_width, &x, &gridn_height);
+            if(Nread == 1)
+                gridn_height = gridn_width;
+            else if(Nread != 3 || x != 'x')
+            {
+                fprintf(stderr, "I could not parse 'N' or 'WxH' from --gridn '%s'. Giving up\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+        }
+
         case '?':
             fprintf(stderr, "Unknown option\n");
             fprintf(stderr, usage, argv[0]);
@@ -85,19 +158,45 @@ int main(int argc, char* argv[])
     }
 
 
+    if( do_check_rotated && gridn_width == gridn_height )
+    {
+        fprintf(stderr, "--check-rotated needs a grid that isn't square: I can't tell a square grid from one rotated by 90 degrees\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
     std::vector<PointInt> points;
     if( !read_points(&points, argv[argc-1]) )
         return 1;
 
     std::vector<PointDouble> points_out;
-    bool result = find_grid_from_points(points_out, points, debug);
+    bool result = find_grid_from_points(points_out, points, debug, debug_sequence_t(),
+                                        gridn_width, gridn_height);
 
     printf("# x y\n");
-    if( result )
+    if( !result )
+        return 1;
+    for(int i=0; i<(int)points_out.size(); i++)
+        printf("%f %f\n", points_out[i].x, points_out[i].y);
+
+    if( do_check_rotated )
     {
-        for(int i=0; i<(int)points_out.size(); i++)
-            printf("%f %f\n", points_out[i].x, points_out[i].y);
-        return 0;
+        int ymax = 0;
+        for(int i=0; i<(int)points.size(); i++)
+            if( points[i].y > ymax ) ymax = points[i].y;
+
+        std::vector<PointInt>    points_rotated;
+        std::vector<PointDouble> points_out_rotated;
+        rotate_points(&points_rotated, points, ymax);
+        if( !find_grid_from_points(points_out_rotated, points_rotated, debug, debug_sequence_t(),
+                                   gridn_width, gridn_height) )
+        {
+            fprintf(stderr, "Rotated points: no grid found\n");
+            return 1;
+        }
+        if( !check_rotated(points_out, points_out_rotated, ymax) )
+            return 1;
+        fprintf(stderr, "Rotated points: found the same grid\n");
     }
-    return 1;
+    return 0;
 }
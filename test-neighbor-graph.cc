@@ -0,0 +1,209 @@
+#include "mrgingham.hh"
+#include "mrgingham-internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+
+using namespace mrgingham;
+
+// Checks that the grid finder agrees with itself with both neighbor-graph
+// backends (NEIGHBOR_GRAPH_VORONOI and NEIGHBOR_GRAPH_KNN), and reports how long
+// each one takes. The inputs are recorded corner sets, such as the
+// /tmp/mrgingham-1-corners.vnl written by test-dump-chessboard-corners.
+//
+// If both backends find a grid, it must be the same grid. The two graphs aren't
+// identical, and in clutter (two detections of the same corner a few pixels
+// apart, for instance) one backend can find a grid where the other doesn't.
+// These cases are reported, but they aren't errors
+
+static bool read_points( std::vector<PointInt>* points, const char* file )
+{
+    FILE* fp = fopen(file, "r");
+    if( fp == NULL )
+    {
+        fprintf(stderr, "couldn't open '%s'\n", file);
+        return false;
+    }
+
+    char* line = NULL;
+    size_t n = 0;
+
+    while(getline(&line, &n, fp) >= 0)
+    {
+        double x,y;
+        int Nread = sscanf(line, "%lf %lf", &x, &y);
+        if(Nread != 2)
+            continue;
+
+        PointInt pt( (int)( x * FIND_GRID_SCALE + 0.5 ),
+                  (int)( y * FIND_GRID_SCALE + 0.5 ) );
+        points->push_back(pt);
+    }
+    fclose(fp);
+    free(line);
+    return true;
+}
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e3 + (double)t.tv_nsec * 1e-6;
+}
+
+// Finds the grid Niterations times with the given backend. Returns the best
+// time of one call, in ms
+static double find_grid_timed( bool* found,
+                               std::vector<PointDouble>* points_out,
+                               const std::vector<PointInt>& points,
+                               find_grid_buffers_t* buffers,
+                               neighbor_graph_method_t neighbor_graph,
+                               int Niterations )
+{
+    double t_best = -1.0;
+    for(int i=0; i<Niterations; i++)
+    {
+        points_out->clear();
+
+        double t0 = now_ms();
+        *found = find_grid_from_points(*points_out, points,
+                                       false, debug_sequence_t(),
+                                       buffers, NULL,
+                                       neighbor_graph);
+        double t = now_ms() - t0;
+        if(t_best < 0.0 || t < t_best)
+            t_best = t;
+    }
+    return t_best;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--iterations N] points.vnl [points.vnl ...]\n"
+        "\n"
+        "Finds the chessboard grid in each set of pre-detected points with each\n"
+        "neighbor-graph backend: the voronoi diagram and the nearest-neighbor graph.\n"
+        "If both find a grid, it must be the same grid. Point sets where only one\n"
+        "backend finds a grid are reported. The best time of N calls (default 20) is\n"
+        "reported for each backend. The points can come from something like\n"
+        "test-dump-chessboard-corners. Returns 0 if no two grids disagree\n";
+
+    struct option opts[] = {
+        { "iterations",        required_argument, NULL, 'n' },
+        { "help",              no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int Niterations = 20;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'n':
+            Niterations = atoi(optarg);
+            if(Niterations <= 0)
+            {
+                fprintf(stderr, "The iteration count must be a positive integer\n");
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( optind > argc-1)
+    {
+        fprintf(stderr, "Need at least one points-file on the cmdline\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    find_grid_buffers_t* buffers = find_grid_buffers_alloc();
+
+    bool   all_ok           = true;
+    int    Nsame            = 0;
+    int    Nonly_voronoi    = 0;
+    int    Nonly_knn        = 0;
+    int    Nneither         = 0;
+    double t_voronoi_total  = 0.0;
+    double t_knn_total      = 0.0;
+
+    for(int iarg = optind; iarg < argc; iarg++)
+    {
+        const char* filename = argv[iarg];
+
+        std::vector<PointInt> points;
+        if( !read_points(&points, filename) )
+        {
+            all_ok = false;
+            continue;
+        }
+
+        std::vector<PointDouble> points_voronoi, points_knn;
+        bool found_voronoi, found_knn;
+        double t_voronoi = find_grid_timed(&found_voronoi, &points_voronoi, points, buffers,
+                                           NEIGHBOR_GRAPH_VORONOI, Niterations);
+        double t_knn     = find_grid_timed(&found_knn,     &points_knn,     points, buffers,
+                                           NEIGHBOR_GRAPH_KNN,     Niterations);
+        t_voronoi_total += t_voronoi;
+        t_knn_total     += t_knn;
+
+        const char* result;
+        if(found_voronoi && found_knn)
+        {
+            bool same = points_voronoi.size() == points_knn.size();
+            for(int i=0; same && i<(int)points_voronoi.size(); i++)
+                same =
+                    fabs(points_voronoi[i].x - points_knn[i].x) < 1e-9 &&
+                    fabs(points_voronoi[i].y - points_knn[i].y) < 1e-9;
+            if(same)
+            {
+                Nsame++;
+                result = "Same grid";
+            }
+            else
+            {
+                all_ok = false;
+                result = "MISMATCH: different grids";
+            }
+        }
+        else if(found_voronoi) { Nonly_voronoi++; result = "Only voronoi found a grid"; }
+        else if(found_knn)     { Nonly_knn++;     result = "Only knn found a grid";     }
+        else                   { Nneither++;      result = "Neither found a grid";      }
+
+        printf("%s: %d points. voronoi: %.3fms; knn: %.3fms. %s\n",
+               filename, (int)points.size(), t_voronoi, t_knn, result);
+    }
+
+    find_grid_buffers_free(buffers);
+
+    printf("Same grid: %d. Only voronoi: %d. Only knn: %d. Neither: %d\n",
+           Nsame, Nonly_voronoi, Nonly_knn, Nneither);
+    printf("Total: voronoi %.3fms; knn %.3fms\n", t_voronoi_total, t_knn_total);
+    if(!all_ok)
+    {
+        printf("Some grids DISAGREE\n");
+        return 1;
+    }
+    printf("All OK\n");
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "thread_pool.hh"
+
+namespace mrgingham
+{
+
+// One parallel_for() call. These live on the stack of the calling thread, and
+// are linked into the pool's list of active batches while they run. So running
+// a batch allocates nothing
+struct batch_t
+{
+    void (*f)(int i, void* cookie);
+    void* cookie;
+
+    int N;
+    int Nthreads_max;
+
+    int next;     // the next index to hand out
+    int Ndone;    // how many indices have been completed
+    int Nworkers; // how many pool workers are on this batch right now
+
+    batch_t* list_next;
+};
+
+struct pool_t
+{
+    std::mutex              mutex;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+
+    batch_t* batches;
+    int      Nworkers;
+
+    pool_t() : batches(NULL), Nworkers(0) {}
+};
+
+// I never destroy the pool: the workers are detached, and they run until the
+// process exits
+static pool_t* get_pool(void)
+{
+    static pool_t* pool = new pool_t;
+    return pool;
+}
+
+// Looks for a batch that a worker could help with. Must be called with the
+// mutex held
+static batch_t* find_work(pool_t* pool)
+{
+    for(batch_t* b = pool->batches; b != NULL; b = b->list_next)
+        if(b->next < b->N &&
+           // the caller itself is one of the Nthreads_max
+           b->Nworkers < b->Nthreads_max - 1)
+            return b;
+    return NULL;
+}
+
+static void run_one(pool_t* pool, batch_t* b,
+                    std::unique_lock<std::mutex>& lock)
+{
+    int i = b->next++;
+
+    lock.unlock();
+    (*b->f)(i, b->cookie);
+    lock.lock();
+
+    if(++b->Ndone == b->N)
+        pool->work_done.notify_all();
+}
+
+static void worker(pool_t* pool)
+{
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while(true)
+    {
+        batch_t* b = find_work(pool);
+        if(b == NULL)
+        {
+            pool->work_available.wait(lock);
+            continue;
+        }
+
+        b->Nworkers++;
+        run_one(pool, b, lock);
+        b->Nworkers--;
+    }
+}
+
+int get_Ncores(void)
+{
+    int N = (int)std::thread::hardware_concurrency();
+    return N > 0 ? N : 1;
+}
+
+void parallel_for(int N, int Nthreads,
+                  void (*f)(int i, void* cookie), void* cookie)
+{
+    if(Nthreads > N) Nthreads = N;
+    if(Nthreads <= 1)
+    {
+        for(int i=0; i<N; i++)
+            (*f)(i, cookie);
+        return;
+    }
+
+    pool_t* pool = get_pool();
+
+    batch_t b = {};
+    b.f            = f;
+    b.cookie       = cookie;
+    b.N            = N;
+    b.Nthreads_max = Nthreads;
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+
+    // Make sure we have enough workers. I only ever grow the pool
+    while(pool->Nworkers < Nthreads-1)
+    {
+        std::thread(&worker, pool).detach();
+        pool->Nworkers++;
+    }
+
+    b.list_next    = pool->batches;
+    pool->batches  = &b;
+    pool->work_available.notify_all();
+
+    // I do work myself too. Then I wait for the workers to finish whatever
+    // they picked up
+    while(b.next < b.N)
+        run_one(pool, &b, lock);
+    while(b.Ndone < b.N)
+        pool->work_done.wait(lock);
+
+    for(batch_t** pb = &pool->batches; *pb != NULL; pb = &(*pb)->list_next)
+        if(*pb == &b)
+        {
+            *pb = b.list_next;
+            break;
+        }
+}
+
+}
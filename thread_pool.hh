@@ -0,0 +1,36 @@
+#pragma once
+
+// A simple process-wide pool of worker threads, used to parallelize the
+// processing of a single image. The workers are spawned the first time they're
+// needed, and they stick around until the process exits
+
+namespace mrgingham
+{
+    // Returns the number of cores on this machine
+    int get_Ncores(void);
+
+    // Calls f(i, cookie) for each i in [0,N), and blocks until all of these
+    // calls have returned. At most Nthreads threads (including the calling
+    // thread) work on this concurrently. If Nthreads <= 1, everything runs
+    // serially in the calling thread.
+    //
+    // This may be called from multiple threads at the same time, and it may be
+    // nested: f() may itself call parallel_for(). The calling thread does work
+    // too, so nesting can't deadlock
+    void parallel_for(int N, int Nthreads,
+                      void (*f)(int i, void* cookie), void* cookie);
+
+    // Convenience wrapper to take any callable f(i)
+    template<typename F>
+    void parallel_for(int N, int Nthreads, const F& f)
+    {
+        struct S
+        {
+            static void call(int i, void* cookie)
+            {
+                (*(const F*)cookie)(i);
+            }
+        };
+        parallel_for(N, Nthreads, &S::call, (void*)&f);
+    }
+};